@@ -1,21 +1,73 @@
 #pragma once
 #include <cstddef>
-#include <sstream>
+#include <ostream>
+#include <iomanip>
+#include <concepts>
 #include <stdexcept>
 #include <string>
 #include <vector>
-#include <windows.h>
-#include <winhttp.h>
-#include <minwinbase.h>
 #include <functional>
 #include <optional>
 #include <thread>
+#include <stop_token>
+#include <fstream>
+#include <filesystem>
+#include <span>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <memory>
+#include <memory_resource>
+#include <charconv>
+#include <map>
+#include <set>
+#include <tuple>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <latch>
+#include <chrono>
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <array>
+#include <bit>
+#include <climits>
+#include <limits>
+#include <random>
+#ifdef _WIN32
+#include <windows.h>
+#include <winhttp.h>
+#include <minwinbase.h>
 #include <winnt.h>
 #include <shlobj.h>
-#include <format>
-#include <fstream>
 
 #pragma comment(lib, "winhttp.lib")
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+#ifdef WINHTTP_ZLIB_SUPPORT
+#include <zlib.h>
+#endif
+#ifdef WINHTTP_BROTLI_SUPPORT
+#include <brotli/decode.h>
+#endif
 
 namespace WinHTTP::Util {
     inline std::vector<std::string> split(const std::string& str, const std::string& delimiter) {
@@ -32,492 +84,7959 @@ namespace WinHTTP::Util {
 
         return tokens;
     }
+    // UTF-8 encodes a wide string onto the end of ret, for the parts of a request that go on the wire as bytes.
+    template<typename String_>
+    void append_narrow(String_& ret, std::wstring_view str) {
+        for (std::size_t i = 0; i < str.size(); ++i) {
+            auto c = static_cast<std::uint32_t>(str[i]);
+            if constexpr (sizeof(wchar_t) == 2) {
+                if (c >= 0xD800 && c < 0xDC00 && i + 1 < str.size()) {
+                    c = 0x10000 + ((c - 0xD800) << 10) + (static_cast<std::uint32_t>(str[++i]) - 0xDC00);
+                }
+            }
+            if (c < 0x80) {
+                ret += static_cast<char>(c);
+            } else if (c < 0x800) {
+                ret += static_cast<char>(0xC0 | (c >> 6));
+                ret += static_cast<char>(0x80 | (c & 0x3F));
+            } else if (c < 0x10000) {
+                ret += static_cast<char>(0xE0 | (c >> 12));
+                ret += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+                ret += static_cast<char>(0x80 | (c & 0x3F));
+            } else {
+                ret += static_cast<char>(0xF0 | (c >> 18));
+                ret += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+                ret += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+                ret += static_cast<char>(0x80 | (c & 0x3F));
+            }
+        }
+    }
+    inline std::string narrow(std::wstring_view str) {
+        std::string ret;
+        ret.reserve(str.size());
+        append_narrow(ret, str);
+        return ret;
+    }
+    template<typename String_>
+    void append_number(String_& ret, std::uint64_t value) {
+        char digits[20];
+        auto end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+        ret.append(digits, end);
+    }
+    inline bool iequals(std::string_view a, std::string_view b) {
+        auto lower = [](char c) { return c >= 'A' && c <= 'Z' ? static_cast<char>(c | 0x20) : c; };
+        return std::equal(a.begin(), a.end(), b.begin(), b.end(), [&](char x, char y) {
+            return lower(x) == lower(y);
+        });
+    }
+    // Value of the first header called name in a raw response head, whitespace trimmed.
+    inline std::optional<std::string_view> find_header(std::string_view head, std::string_view name) {
+        std::size_t pos = head.find("\r\n");
+        while (pos != std::string_view::npos && pos + 2 < head.size()) {
+            std::size_t begin = pos + 2;
+            std::size_t end = head.find("\r\n", begin);
+            auto line = head.substr(begin, end == std::string_view::npos ? std::string_view::npos : end - begin);
+            auto colon = line.find(':');
+            if (colon != std::string_view::npos && iequals(line.substr(0, colon), name)) {
+                auto value = line.substr(colon + 1);
+                while (not value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+                while (not value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+                return value;
+            }
+            pos = end;
+        }
+        return {};
+    }
+
+    // Scratch memory for one request at a time. Strings built while sending a request are carved
+    // out of an inline buffer and only go to the heap once it's used up. Release it before the next request.
+    template<std::size_t Size_>
+    class Arena : public std::pmr::memory_resource {
+        public:
+        Arena() = default;
+        Arena(const Arena&) = delete;
+        void Release() {
+            resource.release();
+        }
+
+        private:
+        void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+            return resource.allocate(bytes, alignment);
+        }
+        void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+            resource.deallocate(p, bytes, alignment);
+        }
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+        alignas(std::max_align_t) std::byte buffer[Size_];
+        std::pmr::monotonic_buffer_resource resource{buffer, Size_};
+    };
 }
 
 namespace WinHTTP {
-    class WinHTTP {
+    enum class FormContentType {
+        Text,
+        File,
+        AttachedFile
+    };
+    class FormContent { 
         public: 
-        #pragma region TYPES
-        enum class ProxyType {
-            DefaultProxy = WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
-            NoProxy = WINHTTP_ACCESS_TYPE_NO_PROXY,
-            NamedProxy = WINHTTP_ACCESS_TYPE_NAMED_PROXY,
-            AutomaticProxy = WINHTTP_ACCESS_TYPE_AUTOMATIC_PROXY,
-        };
-        enum class Error {
-            None = 0,
+        std::string data; 
+        const FormContentType type = FormContentType::Text; 
+        const std::string additionalData = "text";
+    };
+    class FormData {
+        public: 
+        std::string name;
+        FormContent content; 
+    };
+    class wstring_vector : public std::vector<std::wstring> {
+    public:
+        std::vector<const wchar_t*> to_lpcwstr() const {
+            std::vector<const wchar_t*> ret;
+            ret.reserve(this->size()); // Reserve space to avoid multiple allocations
+            for (const auto& data : *this) {
+                ret.push_back(data.c_str());
+            }
+            return ret;
+        }
+        // Fills out with the pointers and a terminating nullptr, as WinHttpOpenRequest takes them.
+        // Reuses out's storage, so a vector kept around stops allocating after the first call.
+        void to_lpcwstr(std::vector<const wchar_t*>& out) const {
+            out.clear();
+            for (const auto& data : *this) {
+                out.push_back(data.c_str());
+            }
+            out.push_back(nullptr);
+        }
+    };
 
-            SessionCreationFailed,
-            SessionNotAvailable,
+    // A server connections are opened to. Connections are pooled per endpoint.
+    struct Endpoint {
+        std::wstring host;
+        std::uint16_t port = 80;
+        bool secure = false;
+        auto operator<=>(const Endpoint&) const = default;
+    };
 
-            ConnectionFailed,
-            ConnectionNotAvailable,
+    // HTTP version a response came over.
+    enum class Protocol {
+        Http1,
+        Http2,
+    };
 
-            RequestFailed,
-            RequestNotAvailable,
+    // Everything the builder collects about a request, independent of the transport that sends it.
+    struct RequestSpec {
+        std::wstring verb = L"GET", objectName, version, referrer;
+        wstring_vector accept_types;
+        std::uint32_t flags = 0;
+        // Extra headers, each terminated with CRLF.
+        std::wstring headers;
+        // Sent as multipart/form-data when not empty.
+        std::vector<FormData> formData;
+        // Ask for a compressed response and decode it on the fly.
+        bool decompress = false;
+        // How long to wait for the client's concurrency limiter, zero fails fast. Unset takes its default.
+        std::optional<std::chrono::milliseconds> admissionTimeout;
+        // Time from sending to the end of the body, retries included. Unset waits as long as the transport does.
+        std::optional<std::chrono::milliseconds> timeout;
+    };
+}
 
-            HeaderAddFailed,
-        };
-        class wstring_vector : public std::vector<std::wstring> {
+namespace WinHTTP::Metrics {
+    using Clock = std::chrono::steady_clock;
+
+    // Consecutive phases of a request. Dns, Connect and Tls are only spent on a new connection.
+    enum class Phase {
+        Dns,
+        Connect,
+        Tls,
+        // Request head and body going out.
+        Send,
+        // Sent until the response headers are in, the time to first byte.
+        Wait,
+        // Response body.
+        Download
+    };
+    inline constexpr std::size_t PhaseCount = 6;
+    inline constexpr std::string_view PhaseNames[PhaseCount] = {"dns", "connect", "tls", "send", "wait", "download"};
+
+    // How long each phase of one request took.
+    struct Timing {
+        std::array<std::chrono::nanoseconds, PhaseCount> phases{};
+
+        std::chrono::nanoseconds& operator[](Phase phase) {
+            return phases[static_cast<std::size_t>(phase)];
+        }
+        std::chrono::nanoseconds operator[](Phase phase) const {
+            return phases[static_cast<std::size_t>(phase)];
+        }
+        std::chrono::nanoseconds Total() const {
+            std::chrono::nanoseconds total{0};
+            for (auto phase : phases)
+                total += phase;
+            return total;
+        }
+        // True if the request went out on a connection that was already open.
+        bool Reused() const {
+            return (*this)[Phase::Connect].count() == 0;
+        }
+    };
+
+    // HDR style histogram of durations: every power of two of nanoseconds is split into
+    // SubBuckets linear buckets, so a recorded value is off by at most 1/SubBuckets (about 3%).
+    // Record is a handful of relaxed atomic adds, safe from any number of threads, and
+    // reading it while it's written gives a slightly stale but usable picture.
+    class Histogram {
         public:
-            std::vector<LPCWSTR> to_lpcwstr() const {
-                std::vector<LPCWSTR> ret;
-                ret.reserve(this->size()); // Reserve space to avoid multiple allocations
-                for (const auto& data : *this) {
-                    ret.push_back(data.c_str());
-                }
-                return ret;
+        static constexpr int SubBits = 5;
+        static constexpr std::uint64_t SubBuckets = 1u << SubBits;
+        // Values at or above 2^MaxBits ns (about 18 minutes) land in the last bucket.
+        static constexpr int MaxBits = 40;
+        static constexpr std::size_t Buckets = (MaxBits - SubBits + 1) * SubBuckets;
+
+        void Record(std::chrono::nanoseconds value) {
+            auto ns = static_cast<std::uint64_t>(std::max<std::int64_t>(value.count(), 0));
+            counts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+            count.fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(ns, std::memory_order_relaxed);
+            auto seen = max.load(std::memory_order_relaxed);
+            while (ns > seen && not max.compare_exchange_weak(seen, ns, std::memory_order_relaxed)) {}
+        }
+
+        std::uint64_t Count() const {
+            return count.load(std::memory_order_relaxed);
+        }
+        std::chrono::nanoseconds Sum() const {
+            return std::chrono::nanoseconds(sum.load(std::memory_order_relaxed));
+        }
+        std::chrono::nanoseconds Max() const {
+            return std::chrono::nanoseconds(max.load(std::memory_order_relaxed));
+        }
+        // Upper end of the bucket holding the q-th quantile, 0 <= q <= 1.
+        std::chrono::nanoseconds Percentile(double q) const {
+            auto total = Count();
+            if (total == 0)
+                return std::chrono::nanoseconds(0);
+            auto rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(q * static_cast<double>(total) + 0.5));
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i < Buckets; ++i) {
+                seen += counts[i].load(std::memory_order_relaxed);
+                if (seen >= rank)
+                    return std::chrono::nanoseconds(std::min(upper(i), max.load(std::memory_order_relaxed)));
             }
-        };
-        enum class FormContentType {
-            Text,
-            File,
-            AttachedFile
-        };
-        class FormContent { 
-            public: 
-            std::string data; 
-            const FormContentType type = FormContentType::Text; 
-            const std::string additionalData = "text";
-        };
-        class FormData {
-            public: 
-            std::string name;
-            FormContent content; 
-        };
-        #pragma endregion
+            return Max();
+        }
 
-        #pragma region CLASS_CONSTRUCTORS
-        explicit WinHTTP(const std::wstring& userAgent, ProxyType AccessType = ProxyType::DefaultProxy, const std::wstring& proxyName = L"", const std::wstring& proxyBypass = L"", DWORD flags = 0):
-        requestSent(false), allowMultiThread(false), error(Error::None), ownerThreadId(std::this_thread::get_id()) {
-            hSession = WinHttpOpen(userAgent.c_str(), 
-                                to_underlying(AccessType), 
-                                proxyName.empty() ? WINHTTP_NO_PROXY_NAME : proxyName.c_str(), 
-                            proxyBypass.empty() ? WINHTTP_NO_PROXY_BYPASS : proxyName.c_str(), 
-                                    flags);
-            if(not hSession)
-                SetError(Error::SessionCreationFailed);
+        private:
+        static std::size_t bucket(std::uint64_t ns) {
+            if (ns < SubBuckets)
+                return static_cast<std::size_t>(ns);
+            int exponent = std::min(static_cast<int>(std::bit_width(ns)) - 1, MaxBits);
+            if (exponent == MaxBits)
+                return Buckets - 1;
+            auto sub = (ns >> (exponent - SubBits)) - SubBuckets;
+            return static_cast<std::size_t>((exponent - SubBits + 1) * SubBuckets + sub);
+        }
+        static std::uint64_t upper(std::size_t index) {
+            if (index < SubBuckets)
+                return index;
+            int shift = static_cast<int>(index / SubBuckets) - 1;
+            auto sub = index % SubBuckets;
+            return ((SubBuckets + sub + 1) << shift) - 1;
         }
 
-        WinHTTP(WinHTTP& other)  = delete;
-        WinHTTP(WinHTTP&& other) = delete; 
+        std::array<std::atomic<std::uint64_t>, Buckets> counts{};
+        std::atomic<std::uint64_t> count{0}, sum{0}, max{0};
+    };
 
-        ~WinHTTP() {
-            if(hRequest)    WinHttpCloseHandle(hRequest);
-            if(hConnect)    WinHttpCloseHandle(hConnect);
-            if(hSession)    WinHttpCloseHandle(hSession);
+    // Histograms of one server, a phase each plus the whole request.
+    struct HostMetrics {
+        std::array<Histogram, PhaseCount> phases;
+        Histogram total;
+        std::atomic<std::uint64_t> requests{0}, reused{0};
+
+        const Histogram& operator[](Phase phase) const {
+            return phases[static_cast<std::size_t>(phase)];
         }
-        #pragma endregion
+    };
 
-        // Connects to the given server.
-        void Connect(const std::wstring& serverName, INTERNET_PORT port = INTERNET_DEFAULT_HTTP_PORT, DWORD Reserved = WINHTTP_DEFAULT_ACCEPT_TYPES) {
-            check_thread();
-            if_session_available<void>([&] {
-                hConnect = WinHttpConnect(hSession, serverName.c_str(), port, WINHTTP_DEFAULT_ACCEPT_TYPES);
-                if(not hConnect) {
-                SetError(Error::ConnectionFailed);
+    // Timings of finished requests, aggregated per endpoint. Endpoints are told apart by
+    // address, so record the pool's interned ones. Recording takes no lock: hosts live in a
+    // fixed open addressing table, claimed with a compare and swap the first time they show
+    // up. Past MaxHosts servers, requests are only counted in Dropped.
+    class Registry {
+        public:
+        static constexpr std::size_t MaxHosts = 256;
+
+        Registry() = default;
+        Registry(const Registry&) = delete;
+        ~Registry() {
+            for (auto& slot : slots)
+                delete slot.metrics.load(std::memory_order_relaxed);
+        }
+
+        void Record(const Endpoint& endpoint, const Timing& timing) {
+            auto* metrics = find(&endpoint);
+            if (not metrics) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
                 return;
-                }
-                error = Error::None; 
-            });
+            }
+            for (std::size_t i = 0; i < PhaseCount; ++i)
+                metrics->phases[i].Record(timing.phases[i]);
+            metrics->total.Record(timing.Total());
+            metrics->requests.fetch_add(1, std::memory_order_relaxed);
+            if (timing.Reused())
+                metrics->reused.fetch_add(1, std::memory_order_relaxed);
         }
 
-        // Opens a request to the server. 
-        // When object is destroyed, request is also closed. No need to close it manually. 
-        void OpenRequest(const std::wstring& verb, const std::wstring& objectName, const std::wstring& version = L"", const std::wstring& referrer = L"", wstring_vector accept_types = {}, DWORD flags = 0) {
-            check_thread();
-            if_connection_available<void>([&] {
-                hRequest = WinHttpOpenRequest(hConnect, verb.c_str(), objectName.c_str(), version.c_str(), 
-                referrer.empty() ? NULL : referrer.c_str(), accept_types.empty() ? NULL : accept_types.to_lpcwstr().data(), flags);
-            });
+        // Calls f(const Endpoint&, const HostMetrics&) for every server seen so far.
+        template<typename F_>
+        void ForEach(F_&& f) const {
+            for (auto& slot : slots) {
+                auto* metrics = slot.metrics.load(std::memory_order_acquire);
+                if (metrics)
+                    f(*slot.endpoint.load(std::memory_order_relaxed), *metrics);
+            }
         }
-        // Sends a request to the server.
-        // Need an open request first. 
-        bool SendRequest(const std::wstring& additional_headers = L"", DWORD headersLength = 0, LPVOID optional = WINHTTP_NO_REQUEST_DATA, DWORD optionalLength = 0, DWORD total_length = 0, DWORD_PTR context = NULL) {
-            check_thread();
-            if_request_available<void>([&] {
-                requestSent = WinHttpSendRequest(hRequest, additional_headers.empty() ? WINHTTP_NO_ADDITIONAL_HEADERS : additional_headers.c_str(), headersLength, optional, optionalLength, total_length, context);
-            }, [&] {
-                SetError(Error::RequestNotAvailable);
-            });
-            return requestSent; 
+        // Requests that found the table full.
+        std::uint64_t Dropped() const {
+            return dropped.load(std::memory_order_relaxed);
         }
-        // Sends a multipart form data to the server.
-        // Needs an open request first.
-        bool SendMultiPartFormRequest(std::vector<FormData> form_data, const std::wstring& additional_headers = L"", DWORD headersLength = 0) {
-            return if_request_available<bool>([&]() -> bool {
-                std::string boundary = "----Boundary" + std::to_string((rand() % 999999) + 100000);
-                std::stringstream formBody; 
-                for(auto data : form_data) {
-                    formBody << "--" + boundary + "\r\n";
-                    formBody << std::format("Content-Disposition: form-data; name=\"{}\"", data.name);
-                    if(data.content.type == FormContentType::Text) {   
-                        formBody << "\r\n\r\n" << data.content.data << "\r\n"; 
-                        continue;
-                    } 
-                    if(data.content.type == FormContentType::File) {
-                        std::string base_filename = data.content.data.substr(data.content.data.find_last_of("/\\") + 1);
-                        formBody << "; filename=\"" + base_filename + "\"\r\n";
-                        std::string file_data = read_file_content(data.content.data);
-                        formBody << std::format("Content-Type: {}\r\n\r\n", data.content.additionalData);
-                        formBody << file_data + "\r\n"; 
-                    }
-                    if(data.content.type ==FormContentType::AttachedFile) {
-                        auto adData = Util::split(data.content.additionalData, "|");
-                        formBody << "; filename=\"" + adData[1] + "\"\r\n";
-                        formBody << std::format("Content-Type: {}\r\n\r\n", adData[0]);
-                        formBody << data.content.data + "\r\n";  
-                    }
-                }
-                formBody << "--" + boundary + "--\r\n";
-                std::wstring headers = L"Content-Type: multipart/form-data; boundary=" + std::wstring(boundary.begin(), boundary.end()) + L"\r\n";
-                if (not WinHttpAddRequestHeaders(hRequest, headers.c_str(), (ULONG)-1L, WINHTTP_ADDREQ_FLAG_ADD)) {
-                    SetError(Error::HeaderAddFailed);
-                    return false; 
+
+        // Everything in the Prometheus text format, as summaries in seconds:
+        //   winhttp_request_seconds{host="localhost:8000",phase="wait",quantile="0.99"} 0.000215
+        std::string Scrape() const {
+            std::string out;
+            auto line = [&](std::string_view labels, std::string_view name, double value) {
+                char number[32];
+                auto end = std::to_chars(number, number + sizeof(number), value).ptr;
+                out += "winhttp_request_seconds";
+                out += name;
+                out += '{';
+                out += labels;
+                out += "} ";
+                out.append(number, end);
+                out += '\n';
+            };
+            auto seconds = [](std::chrono::nanoseconds ns) {
+                return std::chrono::duration<double>(ns).count();
+            };
+            out += "# TYPE winhttp_request_seconds summary\n";
+            ForEach([&](const Endpoint& endpoint, const HostMetrics& metrics) {
+                std::string host = "host=\"";
+                Util::append_narrow(host, endpoint.host);
+                host += ':';
+                Util::append_number(host, endpoint.port);
+                host += endpoint.secure ? "\",scheme=\"https\"" : "\",scheme=\"http\"";
+                for (std::size_t i = 0; i <= PhaseCount; ++i) {
+                    auto& histogram = i < PhaseCount ? metrics.phases[i] : metrics.total;
+                    auto labels = host + ",phase=\"" + std::string(i < PhaseCount ? PhaseNames[i] : "total") + '"';
+                    for (double q : {0.5, 0.9, 0.99, 0.999}) {
+                        char quantile[16];
+                        auto end = std::to_chars(quantile, quantile + sizeof(quantile), q).ptr;
+                        line(labels + ",quantile=\"" + std::string(quantile, end) + '"', "", seconds(histogram.Percentile(q)));
+                    }
+                    line(labels, "_sum", seconds(histogram.Sum()));
+                    line(labels, "_count", static_cast<double>(histogram.Count()));
                 }
+            });
+            return out;
+        }
 
-                auto requestdata = formBody.str();
+        private:
+        struct Slot {
+            std::atomic<const Endpoint*> endpoint{nullptr};
+            std::atomic<HostMetrics*> metrics{nullptr};
+        };
 
-                if (not WinHttpSendRequest(hRequest, additional_headers.empty() ? WINHTTP_NO_ADDITIONAL_HEADERS : additional_headers.c_str(), headersLength,  (LPVOID)requestdata.data(), (DWORD)requestdata.size(), (DWORD)requestdata.size(), 0)) {
-                    SetError(Error::RequestFailed);
-                    return false; 
+        HostMetrics* find(const Endpoint* endpoint) {
+            auto start = std::hash<const Endpoint*>{}(endpoint) % MaxHosts;
+            for (std::size_t probe = 0; probe < MaxHosts; ++probe) {
+                auto& slot = slots[(start + probe) % MaxHosts];
+                auto* owner = slot.endpoint.load(std::memory_order_acquire);
+                if (owner == nullptr && slot.endpoint.compare_exchange_strong(owner, endpoint, std::memory_order_acq_rel)) {
+                    auto* metrics = new HostMetrics();
+                    slot.metrics.store(metrics, std::memory_order_release);
+                    return metrics;
                 }
-
-                return true; 
-            }, []{ return false; });
+                if (owner != endpoint)
+                    continue;
+                // Claimed by another thread that may still be publishing it.
+                HostMetrics* metrics;
+                while (not (metrics = slot.metrics.load(std::memory_order_acquire)))
+                    std::this_thread::yield();
+                return metrics;
+            }
+            return nullptr;
         }
 
-        static std::pair<DWORD, std::string> GetLastErrorMessage() {
-            DWORD errorCode = GetLastError();
-            LPSTR errorBuffer = nullptr;
+        std::array<Slot, MaxHosts> slots;
+        std::atomic<std::uint64_t> dropped{0};
+    };
+}
 
-            FormatMessageA(
-                FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-                nullptr,
-                errorCode,
-                MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-                (LPSTR)&errorBuffer,
-                0,
-                nullptr
-            );
+namespace WinHTTP::Multipart {
+    // Size of the scratch buffer the body is streamed through.
+    inline constexpr std::size_t ChunkSize = 64 * 1024;
+    // Longest boundary RFC 2046 allows.
+    inline constexpr std::size_t MaxBoundary = 70;
 
-            std::string errorMessage = errorBuffer ? errorBuffer : "Unknown error";
-            LocalFree(errorBuffer);
-            return {errorCode, errorMessage.substr(0, errorMessage.length() - 2)};
+    // Substring search for boundaries. std::string_view::find looks for the first byte with memchr,
+    // which already runs at memory speed. Keeps a view of needle.
+    class Finder {
+        public:
+        explicit Finder(std::string_view needle) : needle(needle) {}
+
+        // Position of the first needle in haystack at or after from, npos if there's none.
+        std::size_t Find(std::string_view haystack, std::size_t from = 0) const {
+            return haystack.find(needle, from);
+        }
+        bool In(std::string_view haystack) const {
+            return Find(haystack) != std::string_view::npos;
         }
-        // Receives a response from server. Needs an open request
-        // and a request must be sent already.
-        std::optional<std::string> ReceiveResponse(LPVOID reserved = NULL) {
-        check_thread();
-        return if_request_available<std::optional<std::string>>([&]() -> std::optional<std::string> {
-            if (!WinHttpReceiveResponse(hRequest, reserved)) {
-                return {};
-            }
 
-            std::stringstream ret; 
-            DWORD dwSize = 0;
-            DWORD dwDownloaded = 0;
+        private:
+        std::string_view needle;
+    };
 
-            std::vector<char> buffer; // Use vector to manage memory automatically
-            do {
-                dwSize = 0;
-                if (WinHttpQueryDataAvailable(hRequest, &dwSize)) {
-                    buffer.resize(dwSize); // Resize to required size
-                    if (WinHttpReadData(hRequest, buffer.data(), dwSize, &dwDownloaded)) {
-                        ret.write(buffer.data(), dwDownloaded); // Write to stringstream
-                    }
-                } 
-            } while (dwSize > 0);
+    // Looks for a needle in data that arrives in pieces, across the seams between them too.
+    class StreamFinder {
+        public:
+        explicit StreamFinder(std::string_view needle) : finder(needle), size(std::min(needle.size(), MaxBoundary)) {}
 
-            return ret.str();
-        });
+        // True once the needle turned up in what was fed so far.
+        bool Feed(std::string_view chunk) {
+            if (size == 0)
+                return false;
+            if (kept > 0) {
+                // The seam: the end of the previous pieces and the start of this one.
+                std::array<char, 2 * MaxBoundary> seam;
+                auto take = std::min(chunk.size(), size - 1);
+                std::memcpy(seam.data(), carry.data(), kept);
+                std::memcpy(seam.data() + kept, chunk.data(), take);
+                if (finder.In(std::string_view(seam.data(), kept + take)))
+                    return true;
+            }
+            if (finder.In(chunk))
+                return true;
+            // Keep the last size - 1 bytes for the next seam.
+            if (chunk.size() >= size - 1) {
+                kept = size - 1;
+                std::memcpy(carry.data(), chunk.data() + chunk.size() - kept, kept);
+            } else {
+                auto keep = std::min(kept, size - 1 - chunk.size());
+                std::memmove(carry.data(), carry.data() + kept - keep, keep);
+                std::memcpy(carry.data() + keep, chunk.data(), chunk.size());
+                kept = keep + chunk.size();
+            }
+            return false;
+        }
+
+        private:
+        Finder finder;
+        std::size_t size, kept = 0;
+        std::array<char, MaxBoundary> carry;
+    };
+
+    // "----Boundary" and 24 random letters and digits, about 143 bits.
+    inline void RandomBoundary(std::pmr::string& out) {
+        static constexpr char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+        thread_local std::mt19937_64 generator{std::random_device{}()};
+        out = "----Boundary";
+        for (int i = 0; i < 24; ++i)
+            out += alphabet[generator() % (sizeof(alphabet) - 1)];
     }
 
-        bool SessionAvailable() {
-            return hSession; 
-        }
-        bool ConnectionAvailable() {
-            return hConnect;
-        }
-        bool RequestAvailable() {
-            return hRequest; 
+    // Encodes a multipart/form-data body on the fly.
+    // Framing of every part is rendered up front, so the Content-Length is known before
+    // anything is sent. Text and AttachedFile payloads are passed through without copying,
+    // File parts are read from disk chunk by chunk. Peak memory is one chunk buffer.
+    // The random boundary is checked against every part in memory and picked again if one holds it.
+    // File parts are checked while they're streamed, a hit there throws since the framing is out already.
+    // Keeps pointers into form_data, which has to outlive the encoder.
+    // Its strings come from memory, pass a per-request Util::Arena to keep them off the heap.
+    class Encoder {
+        public:
+        // Picks a random boundary that's in none of the parts.
+        explicit Encoder(const std::vector<FormData>& form_data, std::pmr::memory_resource* memory = std::pmr::get_default_resource()) : boundary(memory), tail(memory), parts(memory) {
+            for (int attempt = 0;; ++attempt) {
+                RandomBoundary(boundary);
+                if (not Collides(form_data, boundary))
+                    break;
+                if (attempt == 8)
+                    throw std::runtime_error("Failed to pick a multipart boundary!");
+            }
+            encode(form_data);
         }
-        void SetError(Error e) {
-            check_thread();
-            error = e; 
+        Encoder(const std::vector<FormData>& form_data, std::string_view boundary, std::pmr::memory_resource* memory = std::pmr::get_default_resource()) : boundary(boundary, memory), tail(memory), parts(memory) {
+            encode(form_data);
         }
-        bool ErrorSet() {
-            return error != Error::None;
+
+        std::string_view Boundary() const {
+            return boundary;
         }
-        Error GetError() const {
-            return error;
+        // True if boundary is in the name, type or in-memory data of a part.
+        static bool Collides(const std::vector<FormData>& form_data, std::string_view boundary) {
+            Finder finder(boundary);
+            for (const auto& data : form_data)
+                if (finder.In(data.name) || finder.In(data.content.additionalData) || (data.content.type != FormContentType::File && finder.In(data.content.data)))
+                    return true;
+            return false;
         }
-        std::string GetError(bool) {
-            switch(error) {
-                case Error::ConnectionFailed:
-                    return "Connection failed!";
-                case Error::ConnectionNotAvailable:
-                    return "Connection not available!";
-                case Error::RequestNotAvailable: 
-                    return "Request not available!";
-                case Error::RequestFailed: 
-                    return "Request failed!";
-                case Error::SessionCreationFailed: 
-                    return "Session creation failed!"; 
-                case Error::SessionNotAvailable: 
-                    return "Session not available!";
-                case Error::HeaderAddFailed:
-                    return "Headers add failed!"; 
-                case Error::None:
-                    return "None";
-            }
-            return "";
+        // True if boundary is in one of payloads, which can't be sent with this encoder then.
+        bool Collides(std::span<const std::string_view> payloads) const {
+            Finder finder(boundary);
+            return std::any_of(payloads.begin(), payloads.end(), [&](std::string_view payload) { return finder.In(payload); });
         }
-        bool MultiThreadAllowed() {
-            return allowMultiThread;
+        std::string ContentType() const {
+            return "multipart/form-data; boundary=" + std::string(boundary);
         }
-        void AllowMultiThread() {
-            check_thread();
-            allowMultiThread = true; 
+        // Exact number of bytes Write() will produce.
+        std::uint64_t ContentLength() const {
+            return length;
         }
-        void DisallowMultiThread() {
-            allowMultiThread = false; 
+        // The same with the parts' data replaced by payloads, see Write.
+        std::uint64_t ContentLength(std::span<const std::string_view> payloads) const {
+            auto total = length;
+            for (std::size_t i = 0; i < payloads.size(); ++i)
+                total = total - parts[i].size + payloads[i].size();
+            return total;
         }
-        private: 
-        template<typename Ret_>
-        Ret_ if_session_available(const std::function<Ret_()>& _if, const std::function<Ret_()>& _else = {}) {
-            if(not SessionAvailable()) {
-                SetError(Error::SessionNotAvailable);
-                if(_else)
-                    return _else();
-                return Ret_{}; 
+
+        // Pushes the encoded body into sink as a sequence of std::string_view chunks.
+        // Small pieces are coalesced into buffer, large in-memory payloads are handed over as is.
+        // Stops and returns false as soon as sink returns false.
+        // Non empty payloads are sent instead of the data of each part, which can't be File parts.
+        template<typename Sink_>
+        bool Write(Sink_&& sink, std::span<char> buffer, std::span<const std::string_view> payloads = {}) const {
+            std::size_t used = 0;
+            auto flush = [&]() -> bool {
+                if(used == 0)
+                    return true;
+                auto size = std::exchange(used, 0);
+                return sink(std::string_view(buffer.data(), size));
+            };
+            auto put = [&](std::string_view piece) -> bool {
+                if(piece.size() >= buffer.size())
+                    return flush() && sink(piece);
+                if(used + piece.size() > buffer.size() && not flush())
+                    return false;
+                std::memcpy(buffer.data() + used, piece.data(), piece.size());
+                used += piece.size();
+                return true;
+            };
+
+            for(std::size_t i = 0; i < parts.size(); ++i) {
+                const auto& part = parts[i];
+                if(not put(part.head))
+                    return false;
+                if(not payloads.empty()) {
+                    if(not put(payloads[i]))
+                        return false;
+                } else if(part.data->content.type == FormContentType::File) {
+                    if(not stream_file(part, boundary, buffer, used, flush))
+                        return false;
+                } else if(not put(part.data->content.data)) {
+                    return false;
+                }
+                if(not put("\r\n"))
+                    return false;
             }
-            return _if();
+            return put(tail) && flush();
         }
-        template<typename Ret_>
-        Ret_ if_connection_available(const std::function<Ret_()>& _if, const std::function<Ret_()>& _else = {}) {
-            return if_session_available<Ret_>([&]() -> Ret_ {
-                if(not ConnectionAvailable()) {
-                    SetError(Error::ConnectionNotAvailable);
-                    if(_else)
-                        return _else();
-                    return Ret_{}; 
+
+        private:
+        struct Part {
+            std::pmr::string head;
+            const FormData* data;
+            std::uint64_t size;
+        };
+
+        void encode(const std::vector<FormData>& form_data) {
+            parts.reserve(form_data.size());
+            for(const auto& data : form_data) {
+                Part part{std::pmr::string(parts.get_allocator()), &data, data.content.data.size()};
+                part.head.append("--").append(boundary).append("\r\nContent-Disposition: form-data; name=\"").append(data.name).append("\"");
+                if(data.content.type == FormContentType::Text) {
+                    part.head += "\r\n\r\n";
                 }
-                return _if();
+                if(data.content.type == FormContentType::File) {
+                    std::string_view path = data.content.data;
+                    auto base_filename = path.substr(path.find_last_of("/\\") + 1);
+                    std::error_code ec;
+                    part.size = std::filesystem::file_size(data.content.data, ec);
+                    if(ec) {
+                        throw std::runtime_error("Failed to open file.");
+                    }
+                    part.head.append("; filename=\"").append(base_filename).append("\"\r\nContent-Type: ").append(data.content.additionalData).append("\r\n\r\n");
+                }
+                if(data.content.type == FormContentType::AttachedFile) {
+                    // "content type|file name"
+                    std::string_view adData = data.content.additionalData;
+                    auto bar = adData.find('|');
+                    auto name = bar == std::string_view::npos ? std::string_view{} : adData.substr(bar + 1);
+                    part.head.append("; filename=\"").append(name.substr(0, name.find('|'))).append("\"\r\nContent-Type: ").append(adData.substr(0, bar)).append("\r\n\r\n");
+                }
+                length += part.head.size() + part.size + 2;
+                parts.push_back(std::move(part));
+            }
+            tail.append("--").append(boundary).append("--\r\n");
+            length += tail.size();
+        }
+
+        public:
+        // Pull-style walk over the encoded body, for writers that can't block such as
+        // non-blocking sockets or asynchronous WinHTTP. In-memory payloads come back as views,
+        // File parts are read into scratch, so a piece is valid until the next call.
+        class Cursor {
+            public:
+            explicit Cursor(const Encoder& encoder) : encoder(&encoder) {}
+
+            // Next piece of the body, empty once the body is done.
+            std::string_view Next(std::span<char> scratch) {
+                while (true) {
+                    if (part == encoder->parts.size()) {
+                        if (stage == Stage::Done)
+                            return {};
+                        stage = Stage::Done;
+                        return encoder->tail;
+                    }
+                    const auto& current = encoder->parts[part];
+                    switch (stage) {
+                        case Stage::Head:
+                            stage = Stage::Data;
+                            offset = 0;
+                            return current.head;
+                        case Stage::Data:
+                            if (current.data->content.type != FormContentType::File) {
+                                stage = Stage::Crlf;
+                                if (current.size > 0)
+                                    return current.data->content.data;
+                                break;
+                            }
+                            if (offset < current.size) {
+                                if (not file.is_open()) {
+                                    file.open(current.data->content.data, std::ios::binary);
+                                    if (!file)
+                                        throw std::runtime_error("Failed to open file.");
+                                    finder.emplace(encoder->boundary);
+                                }
+                                auto want = static_cast<std::size_t>(std::min<std::uint64_t>(current.size - offset, scratch.size()));
+                                if (!file.read(scratch.data(), static_cast<std::streamsize>(want)))
+                                    throw std::runtime_error("Failed to read file.");
+                                if (finder->Feed(std::string_view(scratch.data(), want)))
+                                    throw std::runtime_error("Multipart boundary found in a file part!");
+                                offset += want;
+                                return std::string_view(scratch.data(), want);
+                            }
+                            file.close();
+                            stage = Stage::Crlf;
+                            break;
+                        case Stage::Crlf:
+                            stage = Stage::Head;
+                            ++part;
+                            return "\r\n";
+                        case Stage::Done:
+                            return {};
+                    }
+                }
+            }
+
+            private:
+            enum class Stage { Head, Data, Crlf, Done };
+            const Encoder* encoder;
+            std::size_t part = 0;
+            Stage stage = Stage::Head;
+            std::uint64_t offset = 0;
+            std::ifstream file;
+            std::optional<StreamFinder> finder;
+        };
+
+        private:
+
+        template<typename Flush_>
+        static bool stream_file(const Part& part, std::string_view boundary, std::span<char> buffer, std::size_t& used, Flush_& flush) {
+            std::ifstream file(part.data->content.data, std::ios::binary);
+            if (!file) {
+                throw std::runtime_error("Failed to open file.");
+            }
+            StreamFinder finder(boundary);
+            std::uint64_t remaining = part.size;
+            while(remaining > 0) {
+                if(used == buffer.size() && not flush())
+                    return false;
+                auto want = static_cast<std::size_t>(std::min<std::uint64_t>(remaining, buffer.size() - used));
+                if (!file.read(buffer.data() + used, static_cast<std::streamsize>(want))) {
+                    // The size was already promised in Content-Length, a short file would corrupt the body.
+                    throw std::runtime_error("Failed to read file.");
+                }
+                if (finder.Feed(std::string_view(buffer.data() + used, want)))
+                    throw std::runtime_error("Multipart boundary found in a file part!");
+                used += want;
+                remaining -= want;
+            }
+            return true;
+        }
+
+        std::pmr::string boundary, tail;
+        std::pmr::vector<Part> parts;
+        std::uint64_t length = 0;
+    };
+}
+
+namespace WinHTTP::Body {
+    // Size of the buffer chunks are read into when the body is streamed.
+    inline constexpr std::size_t ChunkSize = 64 * 1024;
+    // Most memory taken up front for a body on the server's word, its Content-Length. A bigger body
+    // grows as it actually arrives, so a bogus length can't allocate more than this.
+    inline constexpr std::size_t MaxPresize = 4 * 1024 * 1024;
+
+    // Anything the body can be read from. Read copies at most capacity bytes into dst and returns
+    // how many were copied, 0 once the body is finished, or std::nullopt when reading failed.
+    template<typename T_>
+    concept Source = requires(T_& source, char* dst, std::size_t capacity) {
+        { source.Read(dst, capacity) } -> std::same_as<std::optional<std::size_t>>;
+    };
+
+    // Receives the body chunk by chunk. Returning false stops the transfer.
+    // The chunk points into a reused buffer and is only valid during the call.
+    template<typename T_>
+    concept Sink = std::is_invocable_r_v<bool, T_&, std::string_view>;
+
+    // Moves the whole body from source into sink through buffer.
+    // Returns false if reading failed or sink asked to stop.
+    template<Source Source_, Sink Sink_>
+    bool Pump(Source_& source, std::span<char> buffer, Sink_&& sink) {
+        while(true) {
+            auto read = source.Read(buffer.data(), buffer.size());
+            if(not read)
+                return false;
+            if(*read == 0)
+                return true;
+            if(not sink(std::string_view(buffer.data(), *read)))
+                return false;
+        }
+    }
+
+    // Reads the whole body into out, straight into the string's own storage. With a known content
+    // length up to MaxPresize out is sized once; otherwise it grows geometrically.
+    template<Source Source_>
+    bool ReadAll(Source_& source, std::string& out, std::optional<std::uint64_t> contentLength = {}) {
+        std::size_t size = out.size();
+        if (contentLength && *contentLength > MaxPresize) {
+            contentLength.reset();
+            out.resize(size + MaxPresize);
+        } else {
+            out.resize(size + (contentLength ? static_cast<std::size_t>(*contentLength) : ChunkSize));
+        }
+        while(true) {
+            if(size == out.size() && contentLength) {
+                // All of Content-Length arrived, usually that's the end. Check without growing the string.
+                contentLength.reset();
+                char probe;
+                auto read = source.Read(&probe, 1);
+                if(not read)
+                    return false;
+                if(*read == 0)
+                    break;
+                out.push_back(probe);
+                ++size;
+            }
+            if(size == out.size())
+                out.resize(std::max(out.size() * 2, size + ChunkSize));
+            auto read = source.Read(out.data() + size, out.size() - size);
+            if(not read) {
+                out.resize(size);
+                return false;
+            }
+            if(*read == 0)
+                break;
+            size += *read;
+        }
+        out.resize(size);
+        return true;
+    }
+
+    // Fills out with the body. Returns the body size, or std::nullopt if reading failed
+    // or the body didn't fit.
+    template<Source Source_>
+    std::optional<std::size_t> ReadInto(Source_& source, std::span<char> out) {
+        std::size_t size = 0;
+        while(true) {
+            if(size == out.size()) {
+                // Full already, make sure nothing is left behind.
+                char probe;
+                auto read = source.Read(&probe, 1);
+                if(not read or *read != 0)
+                    return {};
+                return size;
+            }
+            auto read = source.Read(out.data() + size, out.size() - size);
+            if(not read)
+                return {};
+            if(*read == 0)
+                return size;
+            size += *read;
+        }
+    }
+}
+
+namespace WinHTTP::Compression {
+    enum class Encoding {
+        Identity,
+        Gzip,
+        Deflate,
+        Brotli
+    };
+
+    // The codings this build can decode, as sent in Accept-Encoding. gzip and deflate need zlib
+    // (define WINHTTP_ZLIB_SUPPORT and link it), br needs brotli (WINHTTP_BROTLI_SUPPORT, libbrotlidec).
+#if defined(WINHTTP_ZLIB_SUPPORT) && defined(WINHTTP_BROTLI_SUPPORT)
+    inline constexpr std::string_view AcceptEncoding = "gzip, deflate, br";
+#elif defined(WINHTTP_ZLIB_SUPPORT)
+    inline constexpr std::string_view AcceptEncoding = "gzip, deflate";
+#elif defined(WINHTTP_BROTLI_SUPPORT)
+    inline constexpr std::string_view AcceptEncoding = "br";
+#else
+    inline constexpr std::string_view AcceptEncoding = "";
+#endif
+
+    // Reads a Content-Encoding value. Codings this build can't decode, or more than one
+    // stacked, come back empty and the body is then handed over as it came.
+    inline std::optional<Encoding> Parse(std::string_view contentEncoding) {
+        if (contentEncoding.empty() || Util::iequals(contentEncoding, "identity"))
+            return Encoding::Identity;
+#ifdef WINHTTP_ZLIB_SUPPORT
+        if (Util::iequals(contentEncoding, "gzip") || Util::iequals(contentEncoding, "x-gzip"))
+            return Encoding::Gzip;
+        if (Util::iequals(contentEncoding, "deflate"))
+            return Encoding::Deflate;
+#endif
+#ifdef WINHTTP_BROTLI_SUPPORT
+        if (Util::iequals(contentEncoding, "br"))
+            return Encoding::Brotli;
+#endif
+        return {};
+    }
+
+    // Incremental decoder for one response body. Memory use is bounded by the codec's
+    // window and the input buffer, however big the body is.
+    class Decoder {
+        public:
+        // Compressed bytes buffered by Read.
+        static constexpr std::size_t InputSize = 16 * 1024;
+
+        explicit Decoder(Encoding encoding) : encoding(encoding) {
+#ifdef WINHTTP_ZLIB_SUPPORT
+            if (encoding == Encoding::Gzip || encoding == Encoding::Deflate) {
+                // 32 on top of the window bits detects gzip and zlib headers by themselves.
+                if (inflateInit2(&zlib, 15 + 32) != Z_OK)
+                    throw std::runtime_error("Decoder creation failed!");
+            }
+#endif
+#ifdef WINHTTP_BROTLI_SUPPORT
+            if (encoding == Encoding::Brotli) {
+                brotli = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+                if (not brotli)
+                    throw std::runtime_error("Decoder creation failed!");
+            }
+#endif
+        }
+        Decoder(const Decoder&) = delete;
+        ~Decoder() {
+#ifdef WINHTTP_ZLIB_SUPPORT
+            if (encoding == Encoding::Gzip || encoding == Encoding::Deflate)
+                inflateEnd(&zlib);
+#endif
+#ifdef WINHTTP_BROTLI_SUPPORT
+            if (brotli)
+                BrotliDecoderDestroyInstance(brotli);
+#endif
+        }
+
+        // Decodes as much of input as fits into out and drops what it consumed from input.
+        // Returns the decoded size, or std::nullopt if the data is corrupt.
+        std::optional<std::size_t> Decode(std::string_view& input, std::span<char> out) {
+            switch (encoding) {
+                case Encoding::Identity: {
+                    auto n = std::min(input.size(), out.size());
+                    std::memcpy(out.data(), input.data(), n);
+                    input.remove_prefix(n);
+                    return n;
+                }
+#ifdef WINHTTP_ZLIB_SUPPORT
+                case Encoding::Gzip:
+                case Encoding::Deflate:
+                    return inflate_some(input, out);
+#endif
+#ifdef WINHTTP_BROTLI_SUPPORT
+                case Encoding::Brotli:
+                    return brotli_some(input, out);
+#endif
+                default:
+                    return {};
+            }
+        }
+
+        // True once the compressed stream has ended. Identity ends with the body.
+        bool Done() const {
+            return done;
+        }
+
+        // Decodes input and hands the output to sink in pieces of at most buffer's size,
+        // for transports that are pushed the body. Returns false on corrupt data or if sink stopped.
+        template<typename Sink_> requires Body::Sink<Sink_>
+        bool Feed(std::string_view input, std::span<char> buffer, Sink_&& sink) {
+            while (true) {
+                auto before = input.size();
+                auto n = Decode(input, buffer);
+                if (not n)
+                    return false;
+                if (*n > 0 && not sink(std::string_view(buffer.data(), *n)))
+                    return false;
+                // A full buffer may mean more output is pending even without input.
+                if (*n < buffer.size() && (input.empty() || done || input.size() == before))
+                    return true;
+            }
+        }
+
+        // Pulls compressed bytes from raw through a bounded buffer and decodes them into dst.
+        // Same contract as Body::Source, so it stands in for raw wherever the body is read.
+        template<Body::Source Source_>
+        std::optional<std::size_t> Read(Source_& raw, char* dst, std::size_t capacity) {
+            if (encoding == Encoding::Identity)
+                return raw.Read(dst, capacity);
+            if (buffer.empty())
+                buffer.resize(InputSize);
+            while (true) {
+                if (done) {
+                    // Read on to the end of the body, so the connection can be reused.
+                    auto got = raw.Read(buffer.data(), buffer.size());
+                    if (got && *got > 0)
+                        continue;
+                    return got;
+                }
+                // A decoder that filled dst last time may hold more output without new input.
+                if (begin < end || pending) {
+                    std::string_view input(buffer.data() + begin, end - begin);
+                    auto n = Decode(input, std::span<char>(dst, capacity));
+                    if (not n)
+                        return {};
+                    bool progress = begin != end - input.size();
+                    begin = end - input.size();
+                    pending = *n == capacity;
+                    if (*n > 0)
+                        return n;
+                    if (done)
+                        continue;
+                    if (begin < end && not progress)
+                        return {};
+                }
+                auto got = raw.Read(buffer.data(), buffer.size());
+                if (not got)
+                    return {};
+                // The body ended in the middle of the compressed stream.
+                if (*got == 0)
+                    return {};
+                begin = 0;
+                end = *got;
+            }
+        }
+
+        private:
+#ifdef WINHTTP_ZLIB_SUPPORT
+        std::optional<std::size_t> inflate_some(std::string_view& input, std::span<char> out) {
+            if (done)
+                return 0;
+            zlib.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+            zlib.avail_in = static_cast<uInt>(std::min<std::size_t>(input.size(), UINT_MAX));
+            zlib.next_out = reinterpret_cast<Bytef*>(out.data());
+            zlib.avail_out = static_cast<uInt>(std::min<std::size_t>(out.size(), UINT_MAX));
+            auto rc = ::inflate(&zlib, Z_NO_FLUSH);
+            if (rc == Z_DATA_ERROR && encoding == Encoding::Deflate && zlib.total_out == 0 && not raw) {
+                // Some servers send deflate without the zlib wrapper, start over as raw deflate.
+                raw = true;
+                if (inflateReset2(&zlib, -15) != Z_OK)
+                    return {};
+                return inflate_some(input, out);
+            }
+            if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+                return {};
+            input.remove_prefix(input.size() - zlib.avail_in);
+            if (rc == Z_STREAM_END) {
+                // gzip bodies may hold several members back to back.
+                if (encoding == Encoding::Gzip && input.size() >= 2 && input[0] == '\x1f' && input[1] == '\x8b')
+                    inflateReset(&zlib);
+                else
+                    done = true;
+            }
+            return out.size() - zlib.avail_out;
+        }
+        z_stream zlib{};
+        bool raw = false;
+#endif
+#ifdef WINHTTP_BROTLI_SUPPORT
+        std::optional<std::size_t> brotli_some(std::string_view& input, std::span<char> out) {
+            if (done)
+                return 0;
+            auto available_in = input.size();
+            auto next_in = reinterpret_cast<const std::uint8_t*>(input.data());
+            auto available_out = out.size();
+            auto next_out = reinterpret_cast<std::uint8_t*>(out.data());
+            auto result = BrotliDecoderDecompressStream(brotli, &available_in, &next_in, &available_out, &next_out, nullptr);
+            if (result == BROTLI_DECODER_RESULT_ERROR)
+                return {};
+            input.remove_prefix(input.size() - available_in);
+            if (result == BROTLI_DECODER_RESULT_SUCCESS)
+                done = true;
+            return out.size() - available_out;
+        }
+        BrotliDecoderState* brotli = nullptr;
+#endif
+
+        Encoding encoding;
+        bool done = false, pending = false;
+        std::vector<char> buffer;
+        std::size_t begin = 0, end = 0;
+    };
+}
+
+namespace WinHTTP::Http1 {
+    // Status line and header fields of a response, as views into the raw head they came from,
+    // which has to outlive them. Nothing is parsed until the first lookup, which indexes the
+    // fields in one pass. Reset keeps the index's storage, so a reused instance doesn't allocate.
+    class Headers {
+        public:
+        struct Field {
+            std::string_view name, value;
+        };
+
+        Headers() = default;
+        explicit Headers(std::string_view head) : head(head) {}
+        void Reset(std::string_view head = {}) {
+            this->head = head;
+            fields.clear();
+            indexed = false;
+        }
+
+        // The head as received, status line included.
+        std::string_view Raw() const {
+            return head;
+        }
+        // Status code from the status line, 0 if there's none.
+        int Status() const {
+            auto line = status_line();
+            auto space = line.find(' ');
+            int status = 0;
+            if (space == std::string_view::npos || std::from_chars(line.data() + space + 1, line.data() + line.size(), status).ec != std::errc())
+                return 0;
+            return status;
+        }
+        std::string_view Reason() const {
+            auto line = status_line();
+            auto space = line.find(' ', line.find(' ') + 1);
+            return space == std::string_view::npos ? std::string_view{} : line.substr(space + 1);
+        }
+
+        // Value of the first field called name, case insensitive, whitespace trimmed.
+        std::optional<std::string_view> Find(std::string_view name) const {
+            index();
+            for (const auto& field : fields)
+                if (field.name.size() == name.size() && same_name(field.name, name))
+                    return field.value;
+            return {};
+        }
+        // Calls f with the value of every field called name, for the ones that repeat like Set-Cookie.
+        template<typename F_>
+        void ForEach(std::string_view name, F_&& f) const {
+            index();
+            for (const auto& field : fields)
+                if (field.name.size() == name.size() && same_name(field.name, name))
+                    f(field.value);
+        }
+        // Value of the first field called name as a number, empty if it's missing or isn't one.
+        template<std::integral T_ = std::uint64_t>
+        std::optional<T_> Number(std::string_view name) const {
+            auto value = Find(name);
+            T_ number{};
+            if (not value || value->empty())
+                return {};
+            // Out of range leaves number alone but still takes all the digits.
+            auto [end, error] = std::from_chars(value->data(), value->data() + value->size(), number);
+            if (error != std::errc() || end != value->data() + value->size())
+                return {};
+            return number;
+        }
+        // Every field in the order received.
+        std::span<const Field> Fields() const {
+            index();
+            return fields;
+        }
+
+        private:
+        std::string_view status_line() const {
+            return head.substr(0, head.find("\r\n"));
+        }
+        void index() const {
+            if (indexed)
+                return;
+            indexed = true;
+            auto pos = head.find("\r\n");
+            while (pos != std::string_view::npos) {
+                auto begin = pos + 2;
+                pos = head.find("\r\n", begin);
+                auto line = head.substr(begin, pos == std::string_view::npos ? std::string_view::npos : pos - begin);
+                if (line.empty())
+                    break;
+                auto colon = line.find(':');
+                if (colon == std::string_view::npos)
+                    continue;
+                auto value = line.substr(colon + 1);
+                while (not value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+                while (not value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+                fields.push_back({line.substr(0, colon), value});
+            }
+        }
+        // Compares names of the same size eight bytes at a time, with the ASCII capitals of
+        // every byte folded to lower case at once.
+        static bool same_name(std::string_view a, std::string_view b) {
+            auto fold = [](std::uint64_t x) {
+                auto low = x & 0x7F7F7F7F7F7F7F7FULL;
+                // The top bit of a byte ends up set at 'A' and above, and above 'Z'.
+                auto fromA = low + 0x3F3F3F3F3F3F3F3FULL;
+                auto pastZ = low + 0x2525252525252525ULL;
+                auto upper = fromA & ~pastZ & ~x & 0x8080808080808080ULL;
+                return x | (upper >> 2);
+            };
+            std::size_t i = 0;
+            for (; i + 8 <= a.size(); i += 8) {
+                std::uint64_t x, y;
+                std::memcpy(&x, a.data() + i, 8);
+                std::memcpy(&y, b.data() + i, 8);
+                if (fold(x) != fold(y))
+                    return false;
+            }
+            return Util::iequals(a.substr(i), b.substr(i));
+        }
+
+        std::string_view head;
+        mutable std::vector<Field> fields;
+        mutable bool indexed = false;
+    };
+
+    // Incremental HTTP/1.1 response parser, shared by the blocking and the event driven transports.
+    // It doesn't own the input: the caller passes what it has buffered, the parser drops what it
+    // consumed from the front, and the caller keeps the rest for the next round.
+    class ResponseParser {
+        public:
+        enum class Event {
+            NeedMore,   // Feed more input
+            Headers,    // Head() and Status() are ready
+            Body,       // body holds the next piece of the body
+            Done,       // The response is complete
+            Error,
+        };
+
+        // Starts a new response. Responses to HEAD never have a body.
+        void Reset(bool headRequest = false) {
+            state = State::Head;
+            this->headRequest = headRequest;
+            head.clear();
+            status = 0;
+            remaining = 0;
+            contentLength.reset();
+            keepAlive = false;
+        }
+
+        // Parses from the front of input. A Body piece points into input and is at most max bytes.
+        Event Parse(std::string_view& input, std::string_view& body, std::size_t max = std::string_view::npos) {
+            while (true) {
+                switch (state) {
+                    case State::Head: {
+                        auto eoh = input.find("\r\n\r\n");
+                        if (eoh == std::string_view::npos)
+                            return input.size() > MaxHead ? fail() : Event::NeedMore;
+                        head.assign(input.substr(0, eoh + 4));
+                        input.remove_prefix(eoh + 4);
+                        if (not parse_head())
+                            return fail();
+                        // Interim 1xx responses (100 Continue) come before the real one.
+                        if (status >= 100 && status < 200 && status != 101)
+                            continue;
+                        return Event::Headers;
+                    }
+                    case State::Length:
+                    case State::ChunkData:
+                    case State::UntilClose: {
+                        if (state != State::UntilClose && remaining == 0) {
+                            state = state == State::Length ? State::Done : State::ChunkEnd;
+                            continue;
+                        }
+                        if (input.empty())
+                            return Event::NeedMore;
+                        auto n = std::min(input.size(), max);
+                        if (state != State::UntilClose)
+                            n = static_cast<std::size_t>(std::min<std::uint64_t>(n, remaining));
+                        body = input.substr(0, n);
+                        input.remove_prefix(n);
+                        Advance(n);
+                        return Event::Body;
+                    }
+                    case State::ChunkSize: {
+                        auto eol = input.find("\r\n");
+                        if (eol == std::string_view::npos)
+                            return input.size() > MaxLine ? fail() : Event::NeedMore;
+                        std::size_t digits = 0;
+                        remaining = 0;
+                        for (char c : input.substr(0, eol)) {
+                            int digit = c >= '0' && c <= '9' ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : -1;
+                            if (digit < 0)
+                                break;
+                            // A size past 64 bits would wrap, maybe to 0 and the end of the body.
+                            if (remaining > (UINT64_MAX - static_cast<std::uint64_t>(digit)) / 16)
+                                return fail();
+                            remaining = remaining * 16 + digit;
+                            ++digits;
+                        }
+                        if (digits == 0)
+                            return fail();
+                        input.remove_prefix(eol + 2);
+                        state = remaining ? State::ChunkData : State::Trailers;
+                        continue;
+                    }
+                    case State::ChunkEnd:
+                        if (input.size() < 2)
+                            return Event::NeedMore;
+                        if (not input.starts_with("\r\n"))
+                            return fail();
+                        input.remove_prefix(2);
+                        state = State::ChunkSize;
+                        continue;
+                    case State::Trailers: {
+                        auto eol = input.find("\r\n");
+                        if (eol == std::string_view::npos)
+                            return input.size() > MaxLine ? fail() : Event::NeedMore;
+                        input.remove_prefix(eol + 2);
+                        if (eol == 0)
+                            state = State::Done;
+                        continue;
+                    }
+                    case State::Done:
+                        return Event::Done;
+                    case State::Failed:
+                        return Event::Error;
+                }
+            }
+        }
+
+        // The connection reached EOF. Done if that is how this body ends, Error otherwise.
+        Event Finish() {
+            if (state == State::UntilClose)
+                state = State::Done;
+            return state == State::Done ? Event::Done : fail();
+        }
+
+        // Body bytes the caller may read straight into its own buffer, bypassing the input buffer.
+        // Only meaningful while nothing is buffered. Report them with Advance.
+        std::uint64_t Direct() const {
+            if (state == State::UntilClose)
+                return UINT64_MAX;
+            return state == State::Length || state == State::ChunkData ? remaining : 0;
+        }
+        void Advance(std::size_t n) {
+            if (state == State::UntilClose)
+                return;
+            remaining -= n;
+            if (remaining == 0)
+                state = state == State::Length ? State::Done : State::ChunkEnd;
+        }
+
+        int Status() const {
+            return status;
+        }
+        // Raw response head, status line and headers up to the empty line.
+        const std::string& Head() const {
+            return head;
+        }
+        // Content-Length of the response, none if the server sent none.
+        std::optional<std::uint64_t> ContentLength() const {
+            return contentLength;
+        }
+        bool Complete() const {
+            return state == State::Done;
+        }
+        // Neither side asked to close and the body is delimited, so the connection can be reused.
+        bool KeepAlive() const {
+            return keepAlive;
+        }
+
+        private:
+        enum class State { Head, Length, ChunkSize, ChunkData, ChunkEnd, Trailers, UntilClose, Done, Failed };
+        static constexpr std::size_t MaxHead = 64 * 1024, MaxLine = 4096;
+
+        Event fail() {
+            state = State::Failed;
+            return Event::Error;
+        }
+        bool parse_head() {
+            // HTTP/1.1 200 OK
+            auto sp = head.find(' ');
+            if (not head.starts_with("HTTP/") || sp == std::string::npos || head.size() < sp + 4)
+                return false;
+            status = 0;
+            for (std::size_t i = sp + 1; i < sp + 4; ++i) {
+                if (head[i] < '0' || head[i] > '9')
+                    return false;
+                status = status * 10 + (head[i] - '0');
+            }
+            if (status < 200)
+                return true;
+
+            keepAlive = not head.starts_with("HTTP/1.0");
+            if (auto connection = Util::find_header(head, "Connection"))
+                keepAlive = Util::iequals(*connection, "keep-alive") || (keepAlive && not Util::iequals(*connection, "close"));
+
+            if (not parse_length())
+                return false;
+            auto transferEncoding = Util::find_header(head, "Transfer-Encoding");
+            if (headRequest || status == 204 || status == 304) {
+                state = State::Done;
+            } else if (transferEncoding && transferEncoding->find("chunked") != std::string_view::npos) {
+                state = State::ChunkSize;
+            } else if (contentLength) {
+                remaining = *contentLength;
+                state = remaining ? State::Length : State::Done;
+            } else {
+                state = State::UntilClose;
+                keepAlive = false;
+            }
+            return true;
+        }
+        // Reads Content-Length into contentLength. False if it isn't a number, doesn't fit in 64 bits, or
+        // the fields repeating it disagree (RFC 9112 6.3): the body's end can't be known then.
+        bool parse_length() {
+            std::size_t pos = head.find("\r\n");
+            while (pos != std::string::npos && pos + 2 < head.size()) {
+                auto begin = pos + 2;
+                pos = head.find("\r\n", begin);
+                auto line = std::string_view(head).substr(begin, pos == std::string::npos ? std::string::npos : pos - begin);
+                auto colon = line.find(':');
+                if (colon == std::string_view::npos || not Util::iequals(line.substr(0, colon), "Content-Length"))
+                    continue;
+                // "Content-Length: 42, 42" is a field repeated and then joined.
+                auto values = line.substr(colon + 1);
+                while (true) {
+                    auto comma = values.find(',');
+                    auto value = values.substr(0, comma);
+                    while (not value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+                    while (not value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+                    std::uint64_t length = 0;
+                    if (value.empty())
+                        return false;
+                    for (char c : value) {
+                        if (c < '0' || c > '9' || length > (UINT64_MAX - static_cast<std::uint64_t>(c - '0')) / 10)
+                            return false;
+                        length = length * 10 + static_cast<std::uint64_t>(c - '0');
+                    }
+                    if (contentLength && *contentLength != length)
+                        return false;
+                    contentLength = length;
+                    if (comma == std::string_view::npos)
+                        break;
+                    values.remove_prefix(comma + 1);
+                }
+            }
+            return true;
+        }
+
+        State state = State::Head;
+        bool headRequest = false, keepAlive = false;
+        std::string head;
+        int status = 0;
+        std::uint64_t remaining = 0;
+        std::optional<std::uint64_t> contentLength;
+    };
+
+    // Renders the header fields that depend on spec alone: Accept, Referer, Accept-Encoding and the extra headers.
+    template<typename String_>
+    void RequestFields(String_& request, const RequestSpec& spec) {
+        if (not spec.accept_types.empty()) {
+            request += "Accept: ";
+            for (std::size_t i = 0; i < spec.accept_types.size(); ++i) {
+                if (i)
+                    request += ", ";
+                Util::append_narrow(request, spec.accept_types[i]);
+            }
+            request += "\r\n";
+        }
+        if (not spec.referrer.empty()) {
+            request += "Referer: ";
+            Util::append_narrow(request, spec.referrer);
+            request += "\r\n";
+        }
+        if (spec.decompress && not Compression::AcceptEncoding.empty()) {
+            request += "Accept-Encoding: ";
+            request += Compression::AcceptEncoding;
+            request += "\r\n";
+        }
+        Util::append_narrow(request, spec.headers);
+        if (not spec.headers.empty() && not std::string_view(request).ends_with("\r\n"))
+            request += "\r\n";
+    }
+
+    // Renders the request line and headers onto the end of request. Content-Type and Content-Length
+    // of a form body are added when encoder is given. Builds no temporaries, request is the only
+    // storage used, so an arena backed string keeps it off the heap.
+    template<typename String_>
+    void RequestHead(String_& request, const RequestSpec& spec, std::string_view host, std::string_view userAgent, const Multipart::Encoder* encoder) {
+        Util::append_narrow(request, spec.verb);
+        request += ' ';
+        if (spec.objectName.empty() || spec.objectName.front() != L'/')
+            request += '/';
+        Util::append_narrow(request, spec.objectName);
+        request += ' ';
+        if (spec.version.empty())
+            request += "HTTP/1.1";
+        else
+            Util::append_narrow(request, spec.version);
+        request += "\r\nHost: ";
+        request += host;
+        request += "\r\n";
+        if (not userAgent.empty()) {
+            request += "User-Agent: ";
+            request += userAgent;
+            request += "\r\n";
+        }
+        RequestFields(request, spec);
+        if (encoder) {
+            request += "Content-Type: multipart/form-data; boundary=";
+            request += encoder->Boundary();
+            request += "\r\nContent-Length: ";
+            Util::append_number(request, encoder->ContentLength());
+            request += "\r\n";
+        } else if (spec.verb == L"POST" || spec.verb == L"PUT") {
+            request += "Content-Length: 0\r\n";
+        }
+        request += "\r\n";
+    }
+}
+
+namespace WinHTTP::Http2 {
+    // What a client sends first on a connection it knows speaks HTTP/2, before its SETTINGS. RFC 9113 3.4.
+    inline constexpr std::string_view Preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    // Largest frame payload every peer takes, and the flow control window every stream and connection starts with.
+    inline constexpr std::size_t DefaultFrameSize = 16384;
+    inline constexpr std::int64_t DefaultWindow = 65535;
+
+    enum class Frame : std::uint8_t {
+        Data = 0x0,
+        Headers = 0x1,
+        Priority = 0x2,
+        ResetStream = 0x3,
+        Settings = 0x4,
+        PushPromise = 0x5,
+        Ping = 0x6,
+        GoAway = 0x7,
+        WindowUpdate = 0x8,
+        Continuation = 0x9,
+    };
+    namespace Flag {
+        inline constexpr std::uint8_t EndStream = 0x1, Ack = 0x1, EndHeaders = 0x4, Padded = 0x8, Priority = 0x20;
+    }
+    enum class Setting : std::uint16_t {
+        HeaderTableSize = 0x1,
+        EnablePush = 0x2,
+        MaxConcurrentStreams = 0x3,
+        InitialWindowSize = 0x4,
+        MaxFrameSize = 0x5,
+        MaxHeaderListSize = 0x6,
+    };
+    enum class ErrorCode : std::uint32_t {
+        None = 0x0,
+        Protocol = 0x1,
+        FlowControl = 0x3,
+        FrameSize = 0x6,
+        Cancel = 0x8,
+        Compression = 0x9,
+    };
+
+    // The 9 bytes in front of every frame.
+    struct FrameHead {
+        static constexpr std::size_t Size = 9;
+        std::uint32_t length = 0;
+        Frame type{};
+        std::uint8_t flags = 0;
+        std::uint32_t stream = 0;
+
+        static FrameHead Parse(const char* data) {
+            auto byte = [&](std::size_t i) {
+                return static_cast<std::uint32_t>(static_cast<unsigned char>(data[i]));
+            };
+            return {byte(0) << 16 | byte(1) << 8 | byte(2), static_cast<Frame>(byte(3)), static_cast<std::uint8_t>(byte(4)),
+                (byte(5) << 24 | byte(6) << 16 | byte(7) << 8 | byte(8)) & 0x7fffffff};
+        }
+    };
+
+    // Big endian, as every number on the wire is.
+    inline void AppendUint(std::string& out, std::uint32_t value, std::size_t bytes = 4) {
+        while (bytes--)
+            out += static_cast<char>(value >> (8 * bytes));
+    }
+    inline std::uint32_t ReadUint(std::string_view data, std::size_t bytes = 4) {
+        std::uint32_t value = 0;
+        for (std::size_t i = 0; i < bytes; ++i)
+            value = value << 8 | static_cast<unsigned char>(data[i]);
+        return value;
+    }
+    inline void AppendFrame(std::string& out, Frame type, std::uint8_t flags, std::uint32_t stream, std::string_view payload = {}) {
+        AppendUint(out, static_cast<std::uint32_t>(payload.size()), 3);
+        out += static_cast<char>(type);
+        out += static_cast<char>(flags);
+        AppendUint(out, stream);
+        out += payload;
+    }
+    inline void AppendSetting(std::string& payload, Setting setting, std::uint32_t value) {
+        AppendUint(payload, static_cast<std::uint32_t>(setting), 2);
+        AppendUint(payload, value);
+    }
+    inline void AppendWindowUpdate(std::string& out, std::uint32_t stream, std::uint32_t increment) {
+        std::string payload;
+        AppendUint(payload, increment);
+        AppendFrame(out, Frame::WindowUpdate, 0, stream, payload);
+    }
+    inline void AppendReset(std::string& out, std::uint32_t stream, ErrorCode error) {
+        std::string payload;
+        AppendUint(payload, static_cast<std::uint32_t>(error));
+        AppendFrame(out, Frame::ResetStream, 0, stream, payload);
+    }
+    // A header block as a HEADERS frame, with CONTINUATIONs behind it if it's larger than frameSize.
+    inline void AppendHeaders(std::string& out, std::uint32_t stream, std::string_view block, bool endStream, std::size_t frameSize) {
+        auto type = Frame::Headers;
+        std::uint8_t flags = endStream ? Flag::EndStream : 0;
+        do {
+            auto piece = block.substr(0, frameSize);
+            block.remove_prefix(piece.size());
+            AppendFrame(out, type, static_cast<std::uint8_t>(flags | (block.empty() ? Flag::EndHeaders : 0)), stream, piece);
+            type = Frame::Continuation;
+            flags = 0;
+        } while (not block.empty());
+    }
+    // What's left of a DATA or HEADERS payload once its padding is taken off, nothing if the padding doesn't fit.
+    inline std::optional<std::string_view> Unpad(std::string_view payload, std::uint8_t flags) {
+        if (not (flags & Flag::Padded))
+            return payload;
+        if (payload.empty())
+            return {};
+        auto padding = static_cast<unsigned char>(payload.front());
+        if (padding >= payload.size())
+            return {};
+        return payload.substr(1, payload.size() - 1 - padding);
+    }
+}
+
+namespace WinHTTP::Http2::Hpack {
+    // RFC 7541 Appendix A, index 1 is the first entry.
+    inline constexpr std::pair<std::string_view, std::string_view> StaticTable[] = {
+        {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+        {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+        {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+        {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+        {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+        {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+        {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""}, {"date", ""},
+        {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+        {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""},
+        {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+        {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""},
+        {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+        {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""},
+    };
+    inline constexpr std::size_t StaticSize = std::size(StaticTable);
+    // The table size both sides start with, SETTINGS_HEADER_TABLE_SIZE's default.
+    inline constexpr std::size_t DefaultTableSize = 4096;
+
+    // Decodes a Huffman coded string onto the end of out, RFC 7541 5.2 and Appendix B. The code is
+    // canonical, so the lengths are enough to rebuild it. False if in isn't a valid coding.
+    inline bool DecodeHuffman(std::string_view in, std::string& out) {
+        static constexpr std::uint8_t Lengths[257] = {
+            13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+            6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+            13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+            15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5, 6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+            20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23, 24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+            22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23, 21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+            26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25, 19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+            20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23, 26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+            30,
+        };
+        static constexpr std::size_t MaxLength = 30;
+        // Per length the first code and where its symbols start in the symbols sorted by length.
+        struct Code {
+            std::array<std::uint32_t, MaxLength + 1> first{}, count{}, offset{};
+            std::array<std::uint16_t, 257> symbols{};
+        };
+        static const Code code = [] {
+            Code code;
+            for (auto length : Lengths)
+                ++code.count[length];
+            std::uint32_t next = 0, offset = 0;
+            for (std::size_t length = 1; length <= MaxLength; ++length) {
+                code.first[length] = next;
+                code.offset[length] = offset;
+                next = (next + code.count[length]) << 1;
+                offset += code.count[length];
+            }
+            auto position = code.offset;
+            for (std::uint16_t symbol = 0; symbol < 257; ++symbol)
+                code.symbols[position[Lengths[symbol]]++] = symbol;
+            return code;
+        }();
+
+        std::uint32_t bits = 0;
+        std::size_t length = 0;
+        for (unsigned char byte : in) {
+            for (int bit = 7; bit >= 0; --bit) {
+                bits = bits << 1 | ((byte >> bit) & 1);
+                ++length;
+                if (bits - code.first[length] < code.count[length]) {
+                    auto symbol = code.symbols[code.offset[length] + bits - code.first[length]];
+                    // EOS never appears in a string.
+                    if (symbol == 256)
+                        return false;
+                    out += static_cast<char>(symbol);
+                    bits = 0;
+                    length = 0;
+                } else if (length == MaxLength) {
+                    return false;
+                }
+            }
+        }
+        // Padding is the start of EOS, all ones and shorter than a byte.
+        return length < 8 && bits == (1u << length) - 1;
+    }
+
+    // Integers with an N bit prefix, RFC 7541 5.1.
+    inline void AppendInteger(std::string& out, std::uint8_t pattern, int prefix, std::uint64_t value) {
+        std::uint64_t limit = (1u << prefix) - 1;
+        if (value < limit) {
+            out += static_cast<char>(pattern | value);
+            return;
+        }
+        out += static_cast<char>(pattern | limit);
+        value -= limit;
+        for (; value >= 128; value >>= 7)
+            out += static_cast<char>(value % 128 + 128);
+        out += static_cast<char>(value);
+    }
+    inline bool ReadInteger(std::string_view& in, int prefix, std::uint64_t& value) {
+        if (in.empty())
+            return false;
+        std::uint64_t limit = (1u << prefix) - 1;
+        value = static_cast<unsigned char>(in.front()) & limit;
+        in.remove_prefix(1);
+        if (value < limit)
+            return true;
+        for (int shift = 0; shift <= 28; shift += 7) {
+            if (in.empty())
+                return false;
+            auto byte = static_cast<unsigned char>(in.front());
+            in.remove_prefix(1);
+            value += static_cast<std::uint64_t>(byte & 127) << shift;
+            if (not (byte & 128))
+                return true;
+        }
+        return false;
+    }
+    // Raw strings only, the few bytes Huffman saves on a request aren't worth the time.
+    inline void AppendString(std::string& out, std::string_view value) {
+        AppendInteger(out, 0, 7, value.size());
+        out += value;
+    }
+    inline bool ReadString(std::string_view& in, std::string& out) {
+        if (in.empty())
+            return false;
+        bool huffman = static_cast<unsigned char>(in.front()) & 0x80;
+        std::uint64_t length;
+        if (not ReadInteger(in, 7, length) || length > in.size())
+            return false;
+        auto value = in.substr(0, static_cast<std::size_t>(length));
+        in.remove_prefix(value.size());
+        out.clear();
+        if (huffman)
+            return DecodeHuffman(value, out);
+        out = value;
+        return true;
+    }
+
+    // The dynamic table, newest entry first, RFC 7541 2.3.2 and 4.
+    class Table {
+        public:
+        struct Entry {
+            std::string name, value;
+        };
+
+        // The entry at index, counted from 1 across the static table and this one. Null past the end.
+        const std::pair<std::string_view, std::string_view>* Static(std::uint64_t index) const {
+            return index >= 1 && index <= StaticSize ? &StaticTable[index - 1] : nullptr;
+        }
+        const Entry* Dynamic(std::uint64_t index) const {
+            return index > StaticSize && index - StaticSize <= entries.size() ? &entries[static_cast<std::size_t>(index - StaticSize - 1)] : nullptr;
+        }
+        // Index of the entry with name and value, or else of one with name, 0 if none. exact tells which.
+        std::uint64_t Find(std::string_view name, std::string_view value, bool& exact) const {
+            std::uint64_t named = 0;
+            for (std::size_t i = 0; i < StaticSize; ++i) {
+                if (StaticTable[i].first != name)
+                    continue;
+                if (StaticTable[i].second == value) {
+                    exact = true;
+                    return i + 1;
+                }
+                if (not named)
+                    named = i + 1;
+            }
+            for (std::size_t i = 0; i < entries.size(); ++i) {
+                if (entries[i].name != name)
+                    continue;
+                if (entries[i].value == value) {
+                    exact = true;
+                    return StaticSize + i + 1;
+                }
+                if (not named)
+                    named = StaticSize + i + 1;
+            }
+            exact = false;
+            return named;
+        }
+        void Add(std::string_view name, std::string_view value) {
+            auto size = Size(name, value);
+            evict(size > capacity ? 0 : capacity - size);
+            if (size <= capacity) {
+                entries.push_front({std::string(name), std::string(value)});
+                used += size;
+            }
+        }
+        void Resize(std::size_t size) {
+            capacity = size;
+            evict(capacity);
+        }
+        std::size_t Capacity() const {
+            return capacity;
+        }
+        // An entry's share of the table, RFC 7541 4.1.
+        static std::size_t Size(std::string_view name, std::string_view value) {
+            return name.size() + value.size() + 32;
+        }
+
+        private:
+        void evict(std::size_t room) {
+            while (used > room) {
+                used -= Size(entries.back().name, entries.back().value);
+                entries.pop_back();
+            }
+        }
+        std::deque<Entry> entries;
+        std::size_t used = 0, capacity = DefaultTableSize;
+    };
+
+    // Turns header blocks back into fields. One per connection and direction, blocks have to come in the order sent.
+    class Decoder {
+        public:
+        // Calls field(name, value) for every field of block. False if it's malformed, which breaks the connection.
+        template<typename F_>
+        bool Decode(std::string_view block, F_&& field) {
+            while (not block.empty()) {
+                auto byte = static_cast<unsigned char>(block.front());
+                std::uint64_t index;
+                if (byte & 0x80) {
+                    // Indexed field
+                    if (not ReadInteger(block, 7, index))
+                        return false;
+                    if (auto entry = table.Static(index))
+                        field(entry->first, entry->second);
+                    else if (auto entry = table.Dynamic(index))
+                        field(std::string_view(entry->name), std::string_view(entry->value));
+                    else
+                        return false;
+                    continue;
+                }
+                if ((byte & 0xe0) == 0x20) {
+                    // Table size update, at most what we allow.
+                    if (not ReadInteger(block, 5, index) || index > DefaultTableSize)
+                        return false;
+                    table.Resize(static_cast<std::size_t>(index));
+                    continue;
+                }
+                // Literal, added to the table, not indexed or never indexed.
+                bool add = byte & 0x40;
+                if (not ReadInteger(block, add ? 6 : 4, index))
+                    return false;
+                if (index == 0) {
+                    if (not ReadString(block, name))
+                        return false;
+                } else if (auto entry = table.Static(index)) {
+                    name = entry->first;
+                } else if (auto entry = table.Dynamic(index)) {
+                    name = entry->name;
+                } else {
+                    return false;
+                }
+                if (not ReadString(block, value))
+                    return false;
+                field(std::string_view(name), std::string_view(value));
+                if (add)
+                    table.Add(name, value);
+            }
+            return true;
+        }
+
+        private:
+        Table table;
+        std::string name, value;
+    };
+
+    // Turns HTTP/1.1 request heads into header blocks. Fields that repeat from request to request, like
+    // User-Agent, go into the dynamic table and cost a byte or two after the first time.
+    class Encoder {
+        public:
+        // The peer's SETTINGS_HEADER_TABLE_SIZE. The table doesn't grow past the default either way.
+        void Limit(std::size_t size) {
+            size = std::min(size, DefaultTableSize);
+            if (size != table.Capacity()) {
+                table.Resize(size);
+                resized = true;
+            }
+        }
+
+        // Encodes the head onto the end of block. The request line and Host turn into pseudo-headers,
+        // names are lower cased and the fields HTTP/2 does without are dropped, RFC 9113 8.2.2 and 8.3.1.
+        void Request(std::string& block, std::string_view head, std::string_view scheme) {
+            if (resized) {
+                AppendInteger(block, 0x20, 5, table.Capacity());
+                resized = false;
+            }
+            auto end = head.find("\r\n");
+            auto line = head.substr(0, end);
+            auto space = line.find(' ');
+            auto target = line.substr(space + 1, line.rfind(' ') - space - 1);
+            field(block, ":method", line.substr(0, space));
+            field(block, ":scheme", scheme);
+            field(block, ":path", target);
+            std::string name;
+            while (end != std::string_view::npos) {
+                auto begin = end + 2;
+                end = head.find("\r\n", begin);
+                line = head.substr(begin, end == std::string_view::npos ? std::string_view::npos : end - begin);
+                auto colon = line.find(':');
+                if (colon == std::string_view::npos)
+                    continue;
+                name.assign(line.substr(0, colon));
+                for (auto& c : name)
+                    if (c >= 'A' && c <= 'Z')
+                        c = static_cast<char>(c + ('a' - 'A'));
+                auto value = line.substr(colon + 1);
+                while (not value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+                while (not value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+                if (name == "host")
+                    field(block, ":authority", value);
+                else if (name != "connection" && name != "keep-alive" && name != "proxy-connection" && name != "transfer-encoding" && name != "upgrade" && name != "te")
+                    field(block, name, value);
+            }
+        }
+
+        private:
+        void field(std::string& block, std::string_view name, std::string_view value) {
+            bool exact = false;
+            auto index = table.Find(name, value, exact);
+            if (exact) {
+                AppendInteger(block, 0x80, 7, index);
+                return;
+            }
+            // Credentials are never indexed, by anyone on the way either. Fields that change with
+            // every request would only push the others out.
+            bool secret = name == "authorization" || name == "proxy-authorization" || name == "cookie";
+            bool changing = name == ":path" || name == "content-length" || name == "content-type" || name == "range" || name == "if-range" ||
+                            name == "if-none-match" || name == "if-modified-since";
+            if (not secret && not changing) {
+                AppendInteger(block, 0x40, 6, index);
+                table.Add(name, value);
+            } else {
+                AppendInteger(block, secret ? 0x10 : 0x00, 4, index);
+            }
+            if (not index)
+                AppendString(block, name);
+            AppendString(block, value);
+        }
+
+        Table table;
+        bool resized = false;
+    };
+}
+
+namespace WinHTTP::Multipart {
+    // The boundary parameter of a multipart Content-Type, empty if there's none.
+    inline std::string_view BoundaryOf(std::string_view contentType) {
+        for (auto pos = contentType.find(';'); pos != std::string_view::npos; pos = contentType.find(';', pos + 1)) {
+            auto parameter = contentType.substr(pos + 1);
+            while (not parameter.empty() && (parameter.front() == ' ' || parameter.front() == '\t'))
+                parameter.remove_prefix(1);
+            if (parameter.size() < 9 || not Util::iequals(parameter.substr(0, 9), "boundary="))
+                continue;
+            auto value = parameter.substr(9);
+            if (value.starts_with('"'))
+                return value.substr(1, value.find('"', 1) - 1);
+            value = value.substr(0, value.find(';'));
+            while (not value.empty() && (value.back() == ' ' || value.back() == '\t'))
+                value.remove_suffix(1);
+            return value;
+        }
+        return {};
+    }
+
+    // Incremental parser for multipart/* bodies. Like Http1::ResponseParser it doesn't own the input:
+    // it drops what it handled from the front and leaves the rest, at most a delimiter's worth, to be
+    // passed again with more behind it. Part bodies come out as views into the input, part headers
+    // are copied into the parser since they're small.
+    class Parser {
+        public:
+        enum class Event {
+            NeedMore,   // Feed more input
+            Headers,    // Headers() of the next part are ready
+            Data,       // data holds the next piece of the part's body
+            PartEnd,    // The part's body is complete
+            Done,       // The closing delimiter was seen, the rest is ignored
+            Error,
+        };
+        // Longest part head accepted.
+        static constexpr std::size_t MaxHead = 16 * 1024;
+
+        explicit Parser(std::string_view boundary) : delimiter("\r\n--") {
+            delimiter += boundary;
+        }
+
+        Event Parse(std::string_view& input, std::string_view& data) {
+            while (true) {
+                switch (state) {
+                    case State::Preamble: {
+                        // The first delimiter can open the body without the CRLF in front.
+                        auto opening = std::string_view(delimiter).substr(2);
+                        if (at_start) {
+                            if (input.size() < opening.size() && opening.starts_with(input))
+                                return Event::NeedMore;
+                            if (input.starts_with(opening)) {
+                                auto line = delimits(input.substr(opening.size()));
+                                if (line == Line::Unknown)
+                                    return Event::NeedMore;
+                                if (line == Line::Delimiter) {
+                                    at_start = false;
+                                    input.remove_prefix(opening.size());
+                                    state = State::Delimiter;
+                                    break;
+                                }
+                            }
+                            at_start = false;
+                        }
+                        bool pending = false;
+                        auto at = find_delimiter(input, pending);
+                        if (at == std::string_view::npos) {
+                            input.remove_prefix(input.size() - std::min(input.size(), delimiter.size() - 1));
+                            return Event::NeedMore;
+                        }
+                        if (pending) {
+                            input.remove_prefix(at);
+                            return Event::NeedMore;
+                        }
+                        input.remove_prefix(at + delimiter.size());
+                        state = State::Delimiter;
+                        break;
+                    }
+                    case State::Delimiter: {
+                        // "--" closes the body, otherwise optional whitespace and CRLF start a part.
+                        while (not input.empty() && (input.front() == ' ' || input.front() == '\t'))
+                            input.remove_prefix(1);
+                        if (input.size() < 2)
+                            return Event::NeedMore;
+                        if (input.starts_with("--")) {
+                            input.remove_prefix(2);
+                            state = State::Epilogue;
+                            return Event::Done;
+                        }
+                        if (not input.starts_with("\r\n"))
+                            return Event::Error;
+                        input.remove_prefix(2);
+                        // Headers expects a status line, an empty one takes its place.
+                        head = "\r\n";
+                        headers.Reset();
+                        state = State::Head;
+                        break;
+                    }
+                    case State::Head: {
+                        // The end may straddle the last input, search from three bytes back.
+                        // Copies no more than the longest head allows, the body stays where it is.
+                        auto searched = head.size() > 3 ? head.size() - 3 : 0;
+                        auto taken = std::min(input.size(), MaxHead + 1 - std::min(head.size(), MaxHead + 1));
+                        head.append(input.substr(0, taken));
+                        auto end = head.find("\r\n\r\n", searched);
+                        if (end == std::string::npos) {
+                            input.remove_prefix(taken);
+                            return head.size() > MaxHead ? Event::Error : Event::NeedMore;
+                        }
+                        end += 4;
+                        input.remove_prefix(taken - (head.size() - end));
+                        head.resize(end);
+                        headers.Reset(head);
+                        state = State::Body;
+                        return Event::Headers;
+                    }
+                    case State::Body: {
+                        bool pending = false;
+                        auto at = find_delimiter(input, pending);
+                        if (at == 0 && pending)
+                            return Event::NeedMore;
+                        if (at == 0) {
+                            input.remove_prefix(delimiter.size());
+                            state = State::Delimiter;
+                            return Event::PartEnd;
+                        }
+                        std::size_t cut = at;
+                        if (at == std::string_view::npos) {
+                            // Keep back what could be the start of a delimiter, from the first CR on.
+                            cut = input.size() - std::min(input.size(), delimiter.size() - 1);
+                            cut = std::min(input.find('\r', cut), input.size());
+                        }
+                        if (cut == 0)
+                            return Event::NeedMore;
+                        data = input.substr(0, cut);
+                        input.remove_prefix(cut);
+                        return Event::Data;
+                    }
+                    case State::Epilogue:
+                        input.remove_prefix(input.size());
+                        return Event::Done;
+                }
+            }
+        }
+
+        // Headers of the current part, valid until the next part starts.
+        const Http1::Headers& Headers() const {
+            return headers;
+        }
+
+        private:
+        enum class State { Preamble, Delimiter, Head, Body, Epilogue };
+        enum class Line { Delimiter, Data, Unknown };
+
+        // Whether what follows a delimiter match makes it a delimiter line: "--", or optional
+        // whitespace and CRLF. Anything else is part of the body.
+        static Line delimits(std::string_view rest) {
+            while (not rest.empty() && (rest.front() == ' ' || rest.front() == '\t'))
+                rest.remove_prefix(1);
+            if (rest.size() < 2)
+                return Line::Unknown;
+            return rest.starts_with("--") || rest.starts_with("\r\n") ? Line::Delimiter : Line::Data;
+        }
+
+        // Offset of the next delimiter line, pending if the input ends before it can be told apart.
+        std::size_t find_delimiter(std::string_view input, bool& pending) const {
+            Finder finder(delimiter);
+            for (std::size_t at = 0; (at = finder.Find(input, at)) != std::string_view::npos; ++at) {
+                auto line = delimits(input.substr(at + delimiter.size()));
+                if (line != Line::Data) {
+                    pending = line == Line::Unknown;
+                    return at;
+                }
+            }
+            return std::string_view::npos;
+        }
+
+        State state = State::Preamble;
+        bool at_start = true;
+        // CRLF, "--" and the boundary.
+        std::string delimiter;
+        std::string head;
+        Http1::Headers headers;
+    };
+
+    // Calls part(headers, body) for every part of a whole multipart body, the body a view into it.
+    // False if the body is malformed or cut short.
+    template<typename Part_>
+    bool Split(std::string_view body, std::string_view boundary, Part_&& part) {
+        Parser parser(boundary);
+        const char* begin = nullptr;
+        const char* end = nullptr;
+        while (true) {
+            std::string_view data;
+            switch (parser.Parse(body, data)) {
+                case Parser::Event::Headers:
+                    begin = end = body.data();
+                    break;
+                case Parser::Event::Data:
+                    end = data.data() + data.size();
+                    break;
+                case Parser::Event::PartEnd:
+                    part(parser.Headers(), std::string_view(begin, static_cast<std::size_t>(end - begin)));
+                    break;
+                case Parser::Event::Done:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+    }
+}
+
+namespace WinHTTP::Streaming {
+    struct Options {
+        // Longest line or event accepted, a longer one fails the transfer. Up to 64 KiB the
+        // connection's own buffer holds what's not handed out yet, a bigger one is allocated.
+        std::size_t maxRecord = Body::ChunkSize;
+        // Stops the transfer from another thread: a read blocked on the connection fails right away,
+        // the receive returns false and the connection is closed.
+        std::stop_token stop;
+    };
+
+    // Cuts lines out of a body as it arrives. Like Multipart::Parser it drops what it handled from the
+    // front of input and leaves an incomplete line to be passed again with more behind it. Lines are
+    // views into the input, without their line break.
+    class Lines {
+        public:
+        enum class Event {
+            NeedMore,   // Feed more input
+            Line,       // line holds the next line
+        };
+        // Lines end in \n or \r\n, with cr also in a lone \r as in Server-Sent Events.
+        explicit Lines(bool cr = false) : breaks(cr ? "\r\n" : "\n") {}
+
+        // With eof, input is the end of the body and a last line without a line break counts.
+        Event Parse(std::string_view& input, std::string_view& line, bool eof = false) {
+            // A \r at the end of the last input may have had its \n in this one.
+            if (skipLf && not input.empty()) {
+                if (input.front() == '\n')
+                    input.remove_prefix(1);
+                skipLf = false;
+            }
+            // What was searched already comes back in front, the search goes on behind it.
+            auto end = input.find_first_of(breaks, std::min(scanned, input.size()));
+            if (end == std::string_view::npos) {
+                scanned = input.size();
+                if (not eof || input.empty())
+                    return Event::NeedMore;
+                end = input.size();
+            }
+            scanned = 0;
+            line = input.substr(0, end);
+            if (end == input.size()) {
+                input = {};
+            } else if (input[end] == '\r') {
+                skipLf = end + 1 == input.size();
+                input.remove_prefix(end + (not skipLf && input[end + 1] == '\n' ? 2 : 1));
+            } else {
+                input.remove_prefix(end + 1);
+                if (line.ends_with('\r'))
+                    line.remove_suffix(1);
+            }
+            return Event::Line;
+        }
+
+        private:
+        std::string_view breaks;
+        std::size_t scanned = 0;
+        bool skipLf = false;
+    };
+
+    // A Server-Sent Event. Views into the parser, valid until the next event.
+    struct Event {
+        // "message" unless the event named its type.
+        std::string_view type;
+        // The event's data lines, joined with \n.
+        std::string_view data;
+        // The last event ID so far, it carries over to events without one.
+        std::string_view id;
+        // The reconnection time the server asked for last, if it did.
+        std::optional<std::chrono::milliseconds> retry;
+    };
+
+    // Parses a text/event-stream body into events, as the HTML standard's EventSource does: fields
+    // until an empty line, comments skipped, and an event cut short by the end of the body dropped.
+    class Events {
+        public:
+        enum class Result {
+            NeedMore,   // Feed more input
+            Event,      // Current() holds the next event
+            TooLong,    // The event's data outgrew the limit
+        };
+        explicit Events(std::size_t maxData = Body::ChunkSize) : lines(true), maxData(maxData) {}
+
+        Result Parse(std::string_view& input) {
+            if (dispatched) {
+                dispatched = false;
+                type.clear();
+                data.clear();
+            }
+            std::string_view line;
+            while (lines.Parse(input, line) == Lines::Event::Line) {
+                if (first) {
+                    first = false;
+                    if (line.starts_with("\xEF\xBB\xBF"))
+                        line.remove_prefix(3);
+                }
+                if (line.empty()) {
+                    if (data.empty()) {
+                        type.clear();
+                        continue;
+                    }
+                    data.pop_back();
+                    current = {type.empty() ? std::string_view("message") : std::string_view(type), data, id, retry};
+                    dispatched = true;
+                    return Result::Event;
+                }
+                if (line.front() == ':')
+                    continue;
+                auto colon = line.find(':');
+                auto field = line.substr(0, colon);
+                auto value = colon == std::string_view::npos ? std::string_view() : line.substr(colon + 1);
+                if (value.starts_with(' '))
+                    value.remove_prefix(1);
+                if (field == "event") {
+                    type.assign(value);
+                } else if (field == "data") {
+                    if (data.size() + value.size() + 1 > maxData)
+                        return Result::TooLong;
+                    data.append(value);
+                    data.push_back('\n');
+                } else if (field == "id") {
+                    if (value.find('\0') == std::string_view::npos)
+                        id.assign(value);
+                } else if (field == "retry") {
+                    std::uint64_t ms = 0;
+                    auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), ms);
+                    if (error == std::errc() && end == value.data() + value.size() && not value.empty())
+                        retry = std::chrono::milliseconds(ms);
+                }
+            }
+            return Result::NeedMore;
+        }
+        const Event& Current() const {
+            return current;
+        }
+
+        private:
+        Lines lines;
+        std::size_t maxData;
+        // Kept between events, so their capacity is reused.
+        std::string type, data, id;
+        std::optional<std::chrono::milliseconds> retry;
+        Event current;
+        bool first = true, dispatched = false;
+    };
+
+    enum class Outcome { Ended, Stopped, Failed, TooLong };
+
+    // Reads source into buffer and hands what's there to parse(input, eof), which takes whole records
+    // off the front of input and returns false to stop. Only the tail it leaves stays, moved to the
+    // front once the buffer's end is reached, so memory is the buffer whatever the body's length.
+    template<Body::Source Source_, typename Parse_>
+    Outcome Pump(Source_& source, std::span<char> buffer, std::size_t maxRecord, Parse_&& parse) {
+        std::size_t begin = 0, end = 0;
+        bool eof = false;
+        while (true) {
+            std::string_view input(buffer.data() + begin, end - begin);
+            bool more = parse(input, eof);
+            begin = end - input.size();
+            if (not more)
+                return Outcome::Stopped;
+            if (eof)
+                return Outcome::Ended;
+            if (end - begin > maxRecord || end - begin == buffer.size())
+                return Outcome::TooLong;
+            if (begin == end) {
+                begin = end = 0;
+            } else if (end == buffer.size()) {
+                std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+                end -= begin;
+                begin = 0;
+            }
+            auto read = source.Read(buffer.data() + end, buffer.size() - end);
+            if (not read)
+                return Outcome::Failed;
+            eof = *read == 0;
+            end += *read;
+        }
+    }
+}
+
+namespace WinHTTP {
+    // A request sent over and over with only its path parameters and form payloads changing.
+    // The request line, header fields and multipart framing are rendered once, a call copies them
+    // and fills in the blanks. Placeholders in the target are written as {name} and filled in order,
+    // the values go in as given, so escape them beforehand. Payloads replace the data of the form
+    // parts, whose names and types stay. File parts can't be prepared.
+    class PreparedRequest {
+        public:
+        explicit PreparedRequest(RequestSpec spec) : spec(std::move(spec)) {
+            for (const auto& data : this->spec.formData)
+                if (data.content.type == FormContentType::File)
+                    throw std::runtime_error("File parts can't be prepared!");
+            std::string line;
+            Util::append_narrow(line, this->spec.verb);
+            line += ' ';
+            if (this->spec.objectName.empty() || this->spec.objectName.front() != L'/')
+                line += '/';
+            std::size_t pos = line.size();
+            Util::append_narrow(line, this->spec.objectName);
+            // Split the target at its placeholders.
+            for (std::size_t open; (open = line.find('{', pos)) != std::string::npos;) {
+                auto close = line.find('}', open);
+                if (close == std::string::npos)
+                    break;
+                pieces.push_back(line.substr(0, open));
+                line.erase(0, close + 1);
+                pos = 0;
+            }
+            line += ' ';
+            if (this->spec.version.empty())
+                line += "HTTP/1.1";
+            else
+                Util::append_narrow(line, this->spec.version);
+            line += "\r\n";
+            pieces.push_back(std::move(line));
+
+            Http1::RequestFields(fields, this->spec);
+            if (not this->spec.formData.empty()) {
+                encoder.emplace(this->spec.formData);
+                fields += "Content-Type: multipart/form-data; boundary=";
+                fields += encoder->Boundary();
+                fields += "\r\n";
+            } else if (this->spec.verb == L"POST" || this->spec.verb == L"PUT") {
+                fields += "Content-Length: 0\r\n";
+            }
+        }
+        // The encoder points into spec, which a move keeps in place but a copy wouldn't.
+        PreparedRequest(PreparedRequest&&) = default;
+        PreparedRequest(const PreparedRequest&) = delete;
+
+        const RequestSpec& Spec() const {
+            return spec;
+        }
+        // Placeholders in the target.
+        std::size_t Parameters() const {
+            return pieces.size() - 1;
+        }
+        std::size_t Parts() const {
+            return spec.formData.size();
+        }
+        // Throws unless there's a parameter per placeholder, and a payload per part or none. Parameters
+        // go into the request line as they are, so they have to be escaped already: visible ASCII only.
+        // Head copies their bytes while Resolve widens them, and only on ASCII do both agree.
+        void Check(std::span<const std::string_view> parameters, std::span<const std::string_view> payloads) const {
+            if (parameters.size() != Parameters())
+                throw std::runtime_error("Prepared request takes " + std::to_string(Parameters()) + " parameters!");
+            for (auto parameter : parameters)
+                for (unsigned char c : parameter)
+                    if (c <= 0x20 || c >= 0x7F)
+                        throw std::runtime_error("Prepared request parameters must be escaped, visible ASCII only!");
+            if (not payloads.empty() && payloads.size() != Parts())
+                throw std::runtime_error("Prepared request takes " + std::to_string(Parts()) + " payloads!");
+        }
+
+        // True if a payload holds the boundary rendered into the head, the call has to be resolved then.
+        bool Collides(std::span<const std::string_view> payloads) const {
+            return encoder && encoder->Collides(payloads);
+        }
+
+        // Renders the head of one call onto the end of request, like Http1::RequestHead.
+        template<typename String_>
+        void Head(String_& request, std::string_view host, std::string_view userAgent, std::span<const std::string_view> parameters, std::span<const std::string_view> payloads) const {
+            request += pieces.front();
+            for (std::size_t i = 0; i < parameters.size(); ++i) {
+                request += parameters[i];
+                request += pieces[i + 1];
+            }
+            request += "Host: ";
+            request += host;
+            request += "\r\n";
+            if (not userAgent.empty()) {
+                request += "User-Agent: ";
+                request += userAgent;
+                request += "\r\n";
+            }
+            request += fields;
+            if (encoder) {
+                request += "Content-Length: ";
+                Util::append_number(request, encoder->ContentLength(payloads));
+                request += "\r\n";
+            }
+            request += "\r\n";
+        }
+        // Pushes the body of one call into sink, see Multipart::Encoder::Write.
+        template<typename Sink_>
+        bool Write(Sink_&& sink, std::span<char> buffer, std::span<const std::string_view> payloads) const {
+            return not encoder || encoder->Write(sink, buffer, payloads);
+        }
+
+        // The plain request one call amounts to, for transports that render their own.
+        RequestSpec Resolve(std::span<const std::string_view> parameters, std::span<const std::string_view> payloads) const {
+            RequestSpec resolved = spec;
+            if (not parameters.empty()) {
+                resolved.objectName.clear();
+                std::wstring_view target = spec.objectName;
+                for (auto parameter : parameters) {
+                    auto open = target.find(L'{');
+                    resolved.objectName += target.substr(0, open);
+                    for (unsigned char c : parameter)
+                        resolved.objectName += static_cast<wchar_t>(c);
+                    target.remove_prefix(target.find(L'}', open) + 1);
+                }
+                resolved.objectName += target;
+            }
+            if (not payloads.empty()) {
+                resolved.formData.clear();
+                for (std::size_t i = 0; i < payloads.size(); ++i) {
+                    const auto& data = spec.formData[i];
+                    resolved.formData.push_back({data.name, {std::string(payloads[i]), data.content.type, data.content.additionalData}});
+                }
+            }
+            return resolved;
+        }
+
+        private:
+        RequestSpec spec;
+        // The request line cut at the placeholders, the last piece ends with the version.
+        std::vector<std::string> pieces;
+        // Everything from Accept to Content-Type.
+        std::string fields;
+        std::optional<Multipart::Encoder> encoder;
+    };
+}
+
+#ifdef _WIN32
+namespace WinHTTP {
+    class WinHTTP {
+        public: 
+        #pragma region TYPES
+        enum class ProxyType {
+            DefaultProxy = WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
+            NoProxy = WINHTTP_ACCESS_TYPE_NO_PROXY,
+            NamedProxy = WINHTTP_ACCESS_TYPE_NAMED_PROXY,
+            AutomaticProxy = WINHTTP_ACCESS_TYPE_AUTOMATIC_PROXY,
+        };
+        enum class Error {
+            None = 0,
+
+            SessionCreationFailed,
+            SessionNotAvailable,
+
+            ConnectionFailed,
+            ConnectionNotAvailable,
+
+            RequestFailed,
+            RequestNotAvailable,
+
+            HeaderAddFailed,
+        };
+        using wstring_vector = ::WinHTTP::wstring_vector;
+        using FormContentType = ::WinHTTP::FormContentType;
+        using FormContent = ::WinHTTP::FormContent;
+        using FormData = ::WinHTTP::FormData;
+        #pragma endregion
+
+        #pragma region CLASS_CONSTRUCTORS
+        explicit WinHTTP(const std::wstring& userAgent, ProxyType AccessType = ProxyType::DefaultProxy, const std::wstring& proxyName = L"", const std::wstring& proxyBypass = L"", DWORD flags = 0):
+        requestSent(false), allowMultiThread(false), error(Error::None), ownerThreadId(std::this_thread::get_id()) {
+            hSession = WinHttpOpen(userAgent.c_str(), 
+                                to_underlying(AccessType), 
+                                proxyName.empty() ? WINHTTP_NO_PROXY_NAME : proxyName.c_str(), 
+                            proxyBypass.empty() ? WINHTTP_NO_PROXY_BYPASS : proxyName.c_str(), 
+                                    flags);
+            if(not hSession)
+                SetError(Error::SessionCreationFailed);
+        }
+        // Works on a session owned by someone else, which must outlive this object.
+        // Lets many connections share one session and with it WinHTTP's keep-alive socket pool.
+        explicit WinHTTP(HINTERNET sharedSession):
+        hSession(sharedSession), ownsSession(false), requestSent(false), allowMultiThread(false), error(Error::None), ownerThreadId(std::this_thread::get_id()) {
+            if(not hSession)
+                SetError(Error::SessionNotAvailable);
+        }
+
+        WinHTTP(WinHTTP& other)  = delete;
+        WinHTTP(WinHTTP&& other) = delete; 
+
+        ~WinHTTP() {
+            if(hRequest && not cancelled.exchange(false))    WinHttpCloseHandle(hRequest);
+            if(hConnect)    WinHttpCloseHandle(hConnect);
+            if(hSession && ownsSession)    WinHttpCloseHandle(hSession);
+        }
+        #pragma endregion
+
+        // Connects to the given server.
+        void Connect(const std::wstring& serverName, INTERNET_PORT port = INTERNET_DEFAULT_HTTP_PORT, DWORD Reserved = WINHTTP_DEFAULT_ACCEPT_TYPES) {
+            check_thread();
+            if_session_available<void>([&] {
+                hConnect = WinHttpConnect(hSession, serverName.c_str(), port, WINHTTP_DEFAULT_ACCEPT_TYPES);
+                if(not hConnect) {
+                SetError(Error::ConnectionFailed);
+                return;
+                }
+                error = Error::None; 
+            });
+        }
+
+        // Opens a request to the server. 
+        // When object is destroyed, request is also closed. No need to close it manually. 
+        // Opening another request closes the previous one, the connection stays.
+        void OpenRequest(const std::wstring& verb, const std::wstring& objectName, const std::wstring& version = L"", const std::wstring& referrer = L"", const wstring_vector& accept_types = {}, DWORD flags = 0) {
+            check_thread();
+            if_connection_available<void>([&] {
+                if(hRequest) {
+                    if (not cancelled.exchange(false))
+                        WinHttpCloseHandle(hRequest);
+                    requestSent = false;
+                }
+                responseHeaders.Reset();
+                if(not accept_types.empty())
+                    accept_types.to_lpcwstr(acceptTypes);
+                hRequest = WinHttpOpenRequest(hConnect, verb.c_str(), objectName.c_str(), version.c_str(), 
+                referrer.empty() ? NULL : referrer.c_str(), accept_types.empty() ? NULL : acceptTypes.data(), flags);
+            });
+        }
+        // Offers gzip and deflate and has WinHTTP decode the response body, see WINHTTP_OPTION_DECOMPRESSION.
+        // Needs an open request and Windows 8.1 or later. ContentLength then counts the compressed bytes.
+        bool EnableDecompression() {
+            check_thread();
+            return if_request_available<bool>([&]() -> bool {
+                DWORD flags = WINHTTP_DECOMPRESSION_FLAG_ALL;
+                return WinHttpSetOption(hRequest, WINHTTP_OPTION_DECOMPRESSION, &flags, sizeof(flags));
+            });
+        }
+        // Offers HTTP/2 for the open request, see WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL. WinHTTP negotiates it
+        // over TLS where the server agrees (Windows 10 1607 and later), and runs the session's requests
+        // to that server as streams of one connection.
+        bool EnableHttp2() {
+            check_thread();
+            return if_request_available<bool>([&]() -> bool {
+#ifdef WINHTTP_PROTOCOL_FLAG_HTTP2
+                DWORD flags = WINHTTP_PROTOCOL_FLAG_HTTP2;
+                return WinHttpSetOption(hRequest, WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL, &flags, sizeof(flags));
+#else
+                return false;
+#endif
+            });
+        }
+        // HTTP version the response of the open request came over.
+        Protocol ProtocolUsed() {
+            check_thread();
+            return if_request_available<Protocol>([&]() -> Protocol {
+#ifdef WINHTTP_PROTOCOL_FLAG_HTTP2
+                DWORD flags = 0, size = sizeof(flags);
+                if (WinHttpQueryOption(hRequest, WINHTTP_OPTION_HTTP_PROTOCOL_USED, &flags, &size) && (flags & WINHTTP_PROTOCOL_FLAG_HTTP2))
+                    return Protocol::Http2;
+#endif
+                return Protocol::Http1;
+            });
+        }
+        // Limits each step of the open request, in milliseconds, see WinHttpSetTimeouts.
+        bool SetTimeouts(int resolve, int connect, int send, int receive) {
+            check_thread();
+            return if_request_available<bool>([&]() -> bool {
+                return WinHttpSetTimeouts(hRequest, resolve, connect, send, receive);
+            });
+        }
+        // Closes the open request from another thread, which makes a send, receive or read blocked on it
+        // fail right away. The request can't be used after that, open another one.
+        void CancelRequest() {
+            if (hRequest && not cancelled.exchange(true))
+                WinHttpCloseHandle(hRequest);
+        }
+        // Reports progress of the open request to callback, see WinHttpSetStatusCallback.
+        // The callback gets the context given to the send call.
+        bool SetStatusCallback(WINHTTP_STATUS_CALLBACK callback, DWORD notifications) {
+            check_thread();
+            return if_request_available<bool>([&]() -> bool {
+                return WinHttpSetStatusCallback(hRequest, callback, notifications, 0) != WINHTTP_INVALID_STATUS_CALLBACK;
+            });
+        }
+        // Sends a request to the server.
+        // Need an open request first. 
+        bool SendRequest(const std::wstring& additional_headers = L"", DWORD headersLength = 0, LPVOID optional = WINHTTP_NO_REQUEST_DATA, DWORD optionalLength = 0, DWORD total_length = 0, DWORD_PTR context = NULL) {
+            check_thread();
+            if_request_available<void>([&] {
+                requestSent = WinHttpSendRequest(hRequest, additional_headers.empty() ? WINHTTP_NO_ADDITIONAL_HEADERS : additional_headers.c_str(), headersLength, optional, optionalLength, total_length, context);
+            }, [&] {
+                SetError(Error::RequestNotAvailable);
+            });
+            return requestSent; 
+        }
+        // Sends a multipart form data to the server.
+        // Needs an open request first.
+        // The body is streamed with WinHttpWriteData, File parts are never loaded into memory as a whole.
+        bool SendMultiPartFormRequest(const std::vector<FormData>& form_data, const std::wstring& additional_headers = L"", DWORD headersLength = 0, DWORD_PTR context = NULL) {
+            check_thread();
+            return if_request_available<bool>([&]() -> bool {
+                arena.Release();
+                Multipart::Encoder encoder(form_data, &arena);
+                std::pmr::wstring headers(L"Content-Type: multipart/form-data; boundary=", &arena);
+                headers.append(encoder.Boundary().begin(), encoder.Boundary().end());
+                headers += L"\r\n";
+                // WinHttpSendRequest takes the total length as a DWORD, bigger bodies need the header set by hand.
+                DWORD totalLength = (DWORD)encoder.ContentLength();
+                if (encoder.ContentLength() > MAXDWORD) {
+                    headers += L"Content-Length: ";
+                    Util::append_number(headers, encoder.ContentLength());
+                    headers += L"\r\n";
+                    totalLength = WINHTTP_IGNORE_REQUEST_TOTAL_LENGTH;
+                }
+                if (not WinHttpAddRequestHeaders(hRequest, headers.c_str(), (ULONG)-1L, WINHTTP_ADDREQ_FLAG_ADD)) {
+                    SetError(Error::HeaderAddFailed);
+                    return false; 
+                }
+
+                if (not WinHttpSendRequest(hRequest, additional_headers.empty() ? WINHTTP_NO_ADDITIONAL_HEADERS : additional_headers.c_str(), headersLength, WINHTTP_NO_REQUEST_DATA, 0, totalLength, context)) {
+                    SetError(Error::RequestFailed);
+                    return false; 
+                }
+
+                if (buffer.empty()) {
+                    buffer.resize(Multipart::ChunkSize);
+                }
+                bool written = encoder.Write([&](std::string_view chunk) -> bool {
+                    DWORD dwWritten = 0;
+                    return WinHttpWriteData(hRequest, chunk.data(), (DWORD)chunk.size(), &dwWritten) && dwWritten == chunk.size();
+                }, buffer);
+                if (not written) {
+                    SetError(Error::RequestFailed);
+                    return false; 
+                }
+
+                return true; 
+            }, []{ return false; });
+        }
+
+        static std::pair<DWORD, std::string> GetLastErrorMessage() {
+            DWORD errorCode = GetLastError();
+            LPSTR errorBuffer = nullptr;
+
+            FormatMessageA(
+                FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+                nullptr,
+                errorCode,
+                MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+                (LPSTR)&errorBuffer,
+                0,
+                nullptr
+            );
+
+            std::string errorMessage = errorBuffer ? errorBuffer : "Unknown error";
+            LocalFree(errorBuffer);
+            return {errorCode, errorMessage.substr(0, errorMessage.length() - 2)};
+        }
+        // Receives a response from server. Needs an open request
+        // and a request must be sent already.
+        // The body is read straight into the returned string, sized once from Content-Length when the server sends it.
+        std::optional<std::string> ReceiveResponse(LPVOID reserved = NULL) {
+            if (not ReceiveResponseHeaders(reserved)) {
+                return {};
+            }
+            ReadSource source{this};
+            std::string ret;
+            if (not Body::ReadAll(source, ret, ContentLength())) {
+                return {};
+            }
+            return ret;
+        }
+        // Receives a response and hands the body to sink chunk by chunk.
+        // Chunks are read into a buffer that is reused for the whole transfer, the body is never held as a whole.
+        template<typename Sink_> requires Body::Sink<Sink_>
+        bool ReceiveResponse(Sink_&& sink, LPVOID reserved = NULL) {
+            if (not ReceiveResponseHeaders(reserved)) {
+                return false;
+            }
+            if (buffer.empty()) {
+                buffer.resize(Body::ChunkSize);
+            }
+            ReadSource source{this};
+            return Body::Pump(source, buffer, sink);
+        }
+        // Receives a response into the caller's buffer. Returns the body size,
+        // or nothing if receiving failed or the body doesn't fit.
+        std::optional<std::size_t> ReceiveResponse(std::span<char> out, LPVOID reserved = NULL) {
+            if (not ReceiveResponseHeaders(reserved)) {
+                return {};
+            }
+            ReadSource source{this};
+            return Body::ReadInto(source, out);
+        }
+        // Receives a response and writes the body to the stream, e.g. an std::ofstream.
+        bool ReceiveResponse(std::ostream& out, LPVOID reserved = NULL) {
+            return ReceiveResponse([&](std::string_view chunk) -> bool {
+                return static_cast<bool>(out.write(chunk.data(), (std::streamsize)chunk.size()));
+            }, reserved);
+        }
+
+        // Lower level half of ReceiveResponse: waits for the response headers.
+        // The body can then be pulled with ReadData.
+        bool ReceiveResponseHeaders(LPVOID reserved = NULL) {
+            check_thread();
+            return if_request_available<bool>([&]() -> bool {
+                return WinHttpReceiveResponse(hRequest, reserved);
+            });
+        }
+        // Reads the next piece of the body into dst. Returns 0 at the end of the body, nothing on failure.
+        std::optional<std::size_t> ReadData(char* dst, std::size_t capacity) {
+            DWORD dwDownloaded = 0;
+            if (not WinHttpReadData(hRequest, dst, (DWORD)std::min<std::size_t>(capacity, MAXDWORD), &dwDownloaded)) {
+                return {};
+            }
+            return dwDownloaded;
+        }
+        // Reads what has arrived, up to capacity. Waits in WinHttpQueryDataAvailable while nothing has,
+        // rather than in WinHttpReadData until capacity is filled.
+        std::optional<std::size_t> ReadAvailable(char* dst, std::size_t capacity) {
+            DWORD available = 0;
+            if (not WinHttpQueryDataAvailable(hRequest, &available)) {
+                return {};
+            }
+            if (available == 0) {
+                return 0;
+            }
+            return ReadData(dst, std::min<std::size_t>(capacity, available));
+        }
+        // Status code of the received response, 0 if there's none.
+        DWORD StatusCode() {
+            DWORD status = 0;
+            DWORD size = sizeof(status);
+            WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX, &status, &size, WINHTTP_NO_HEADER_INDEX);
+            return status;
+        }
+        // Value of the first response header called name, if the server sent it.
+        std::optional<std::wstring> QueryHeader(const std::wstring& name) {
+            DWORD size = 0;
+            WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_CUSTOM, name.c_str(), WINHTTP_NO_OUTPUT_BUFFER, &size, WINHTTP_NO_HEADER_INDEX);
+            if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+                return {};
+            }
+            std::wstring value(size / sizeof(wchar_t), L'\0');
+            if (not WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_CUSTOM, name.c_str(), value.data(), &size, WINHTTP_NO_HEADER_INDEX)) {
+                return {};
+            }
+            value.resize(size / sizeof(wchar_t));
+            return value;
+        }
+        // Status line and headers of the received response. They're fetched from WinHTTP once, the first
+        // time they're asked for, and stay valid until the next request is opened.
+        const Http1::Headers& ResponseHeaders() {
+            if (responseHeaders.Raw().empty() && hRequest) {
+                DWORD size = 0;
+                WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_RAW_HEADERS_CRLF, WINHTTP_HEADER_NAME_BY_INDEX, WINHTTP_NO_OUTPUT_BUFFER, &size, WINHTTP_NO_HEADER_INDEX);
+                if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+                    return responseHeaders;
+                wideHeaders.resize(size / sizeof(wchar_t));
+                if (not WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_RAW_HEADERS_CRLF, WINHTTP_HEADER_NAME_BY_INDEX, wideHeaders.data(), &size, WINHTTP_NO_HEADER_INDEX))
+                    return responseHeaders;
+                wideHeaders.resize(size / sizeof(wchar_t));
+                rawHeaders.clear();
+                Util::append_narrow(rawHeaders, wideHeaders);
+                responseHeaders.Reset(rawHeaders);
+            }
+            return responseHeaders;
+        }
+        // Content-Length of the received response, if the server sent one.
+        std::optional<std::uint64_t> ContentLength() {
+            ULONGLONG length = 0;
+            DWORD size = sizeof(length);
+            if (not WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_CONTENT_LENGTH | WINHTTP_QUERY_FLAG_NUMBER64, WINHTTP_HEADER_NAME_BY_INDEX, &length, &size, WINHTTP_NO_HEADER_INDEX)) {
+                return {};
+            }
+            return length;
+        }
+
+        bool SessionAvailable() {
+            return hSession; 
+        }
+        bool ConnectionAvailable() {
+            return hConnect;
+        }
+        bool RequestAvailable() {
+            return hRequest; 
+        }
+        void SetError(Error e) {
+            check_thread();
+            error = e; 
+        }
+        bool ErrorSet() {
+            return error != Error::None;
+        }
+        Error GetError() const {
+            return error;
+        }
+        std::string GetError(bool) {
+            switch(error) {
+                case Error::ConnectionFailed:
+                    return "Connection failed!";
+                case Error::ConnectionNotAvailable:
+                    return "Connection not available!";
+                case Error::RequestNotAvailable: 
+                    return "Request not available!";
+                case Error::RequestFailed: 
+                    return "Request failed!";
+                case Error::SessionCreationFailed: 
+                    return "Session creation failed!"; 
+                case Error::SessionNotAvailable: 
+                    return "Session not available!";
+                case Error::HeaderAddFailed:
+                    return "Headers add failed!"; 
+                case Error::None:
+                    return "None";
+            }
+            return "";
+        }
+        bool MultiThreadAllowed() {
+            return allowMultiThread;
+        }
+        void AllowMultiThread() {
+            check_thread();
+            allowMultiThread = true; 
+        }
+        void DisallowMultiThread() {
+            allowMultiThread = false; 
+        }
+        private: 
+        // The guards run _if when the handle is there, otherwise they set the error and run _else,
+        // or return Ret_{} without one. Templates rather than std::function, so nothing is allocated.
+        struct no_else {};
+        template<typename Ret_, typename Else_>
+        static Ret_ otherwise(Else_& _else) {
+            if constexpr (std::is_same_v<std::remove_cvref_t<Else_>, no_else>) {
+                return Ret_();
+            } else {
+                return _else();
+            }
+        }
+        template<typename Ret_, typename If_, typename Else_ = no_else>
+        Ret_ if_session_available(If_&& _if, Else_&& _else = {}) {
+            if(not SessionAvailable()) {
+                SetError(Error::SessionNotAvailable);
+                return otherwise<Ret_>(_else);
+            }
+            return _if();
+        }
+        template<typename Ret_, typename If_, typename Else_ = no_else>
+        Ret_ if_connection_available(If_&& _if, Else_&& _else = {}) {
+            return if_session_available<Ret_>([&]() -> Ret_ {
+                if(not ConnectionAvailable()) {
+                    SetError(Error::ConnectionNotAvailable);
+                    return otherwise<Ret_>(_else);
+                }
+                return _if();
+            });
+        }
+        template<typename Ret_, typename If_, typename Else_ = no_else>
+        Ret_ if_request_available(If_&& _if, Else_&& _else = {}) {
+            return if_connection_available<Ret_>([&]() -> Ret_ {
+                if(not RequestAvailable()) {
+                    SetError(Error::RequestNotAvailable);
+                    return otherwise<Ret_>(_else);
+                }
+                return _if();
+            }); 
+        }
+        // Adapts ReadData to Body::Source.
+        class ReadSource {
+            public:
+            WinHTTP* session;
+            std::optional<std::size_t> Read(char* dst, std::size_t capacity) {
+                return session->ReadData(dst, capacity);
+            }
+        };
+        void check_thread() const {
+            if(allowMultiThread)
+                return; 
+            if (std::this_thread::get_id() != ownerThreadId) {
+                throw std::runtime_error("Attempt to use WinHTTP class from a different thread. If you know what you are doing, you can suppress this error with AllowMultiThread() method.");
+            }
+        }
+
+        template <typename T_>
+        constexpr std::underlying_type_t<T_> to_underlying(T_ obj) noexcept {
+            return static_cast<std::underlying_type_t<T_>>(obj);
+        }
+        HINTERNET hSession = nullptr, hConnect = nullptr, hRequest = nullptr;
+        // Set once CancelRequest closed hRequest, so it isn't closed twice.
+        std::atomic<bool> cancelled{false};
+        bool ownsSession = true;
+        bool requestSent, allowMultiThread; 
+        Error error;
+        std::thread::id ownerThreadId;
+        std::vector<char> buffer;
+        std::vector<const wchar_t*> acceptTypes;
+        Util::Arena<4096> arena;
+        std::wstring wideHeaders;
+        std::string rawHeaders;
+        Http1::Headers responseHeaders;
+    };
+    
+}
+#endif
+
+#ifndef _WIN32
+namespace WinHTTP::Dns {
+    // A socket address a name resolved to, as getaddrinfo hands it out.
+    struct Address {
+        sockaddr_storage storage{};
+        socklen_t length = 0;
+
+        const sockaddr* Get() const {
+            return reinterpret_cast<const sockaddr*>(&storage);
+        }
+    };
+    using Addresses = std::vector<Address>;
+
+    // Looks host up with getaddrinfo. Throws std::runtime_error if it doesn't resolve.
+    inline Addresses System(const std::string& host, std::uint16_t port) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result = nullptr;
+        if (int rc = ::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result); rc != 0)
+            throw std::runtime_error("Connection failed! " + std::string(::gai_strerror(rc)));
+        Addresses addresses;
+        for (auto* ai = result; ai; ai = ai->ai_next) {
+            Address address;
+            std::memcpy(&address.storage, ai->ai_addr, ai->ai_addrlen);
+            address.length = static_cast<socklen_t>(ai->ai_addrlen);
+            addresses.push_back(address);
+        }
+        ::freeaddrinfo(result);
+        return addresses;
+    }
+
+    struct Options {
+        // How long a lookup is reused. getaddrinfo doesn't tell the record's TTL, so it's the same for
+        // every name. Zero looks the name up for every new connection.
+        std::chrono::milliseconds ttl = std::chrono::seconds(60);
+        // How long past its TTL a lookup is still used when looking the name up again fails, RFC 8767.
+        std::chrono::milliseconds stale = std::chrono::minutes(10);
+        // Does the lookups, e.g. with a delay or fixed answers in tests.
+        std::function<Addresses(const std::string& host, std::uint16_t port)> lookup = System;
+    };
+
+    // Keeps lookups per host and port for options.ttl. A name is looked up once at a time, callers
+    // that want it meanwhile wait for that lookup. Thread safe.
+    class Cache {
+        public:
+        explicit Cache(Options options = {}) : options(std::move(options)) {}
+        Cache(const Cache&) = delete;
+
+        // The addresses of host, from the cache while they're fresh. Throws if the lookup fails
+        // and there's no stale entry to fall back to.
+        std::shared_ptr<const Addresses> Resolve(const std::string& host, std::uint16_t port) {
+            if (options.ttl.count() <= 0) {
+                ++lookups;
+                return std::make_shared<const Addresses>(options.lookup(host, port));
+            }
+            std::unique_lock lock(mutex);
+            auto& entry = entries[{host, port}];
+            resolved.wait(lock, [&] { return not entry.resolving; });
+            if (entry.addresses && std::chrono::steady_clock::now() < entry.expires) {
+                ++hits;
+                return entry.addresses;
+            }
+            entry.resolving = true;
+            lock.unlock();
+            std::shared_ptr<const Addresses> addresses;
+            std::exception_ptr error;
+            try {
+                ++lookups;
+                addresses = std::make_shared<const Addresses>(options.lookup(host, port));
+            } catch (...) {
+                error = std::current_exception();
+            }
+            lock.lock();
+            entry.resolving = false;
+            resolved.notify_all();
+            auto now = std::chrono::steady_clock::now();
+            if (error) {
+                if (entry.addresses && now < entry.expires + options.stale)
+                    return entry.addresses;
+                std::rethrow_exception(error);
+            }
+            entry.addresses = addresses;
+            entry.expires = now + options.ttl;
+            return addresses;
+        }
+        // The addresses of host while the cache has them fresh. Never looks the name up or waits for a
+        // lookup, none if that would be needed.
+        std::shared_ptr<const Addresses> Cached(const std::string& host, std::uint16_t port) {
+            if (options.ttl.count() <= 0)
+                return {};
+            std::lock_guard lock(mutex);
+            auto it = entries.find({host, port});
+            if (it == entries.end() || it->second.resolving || not it->second.addresses || std::chrono::steady_clock::now() >= it->second.expires)
+                return {};
+            ++hits;
+            return it->second.addresses;
+        }
+        // Drops what host resolved to, e.g. once none of its addresses could be connected to.
+        void Forget(const std::string& host, std::uint16_t port) {
+            std::lock_guard lock(mutex);
+            // Entries stay, a lookup in progress holds on to its own.
+            if (auto it = entries.find({host, port}); it != entries.end())
+                it->second.addresses.reset();
+        }
+
+        // Names looked up, and answered from the cache.
+        std::size_t Lookups() const {
+            return lookups;
+        }
+        std::size_t Hits() const {
+            return hits;
+        }
+
+        private:
+        struct Entry {
+            std::shared_ptr<const Addresses> addresses;
+            std::chrono::steady_clock::time_point expires;
+            bool resolving = false;
+        };
+
+        Options options;
+        std::mutex mutex;
+        std::condition_variable resolved;
+        std::map<std::pair<std::string, std::uint16_t>, Entry> entries;
+        std::atomic<std::size_t> lookups{0}, hits{0};
+    };
+}
+#endif
+
+namespace WinHTTP::Transport {
+    // One connection to an endpoint, carrying one request at a time.
+    // A request goes Send, Receive, then Read until it returns 0.
+    class Connection {
+        public:
+        virtual ~Connection() = default;
+
+        // Sends the request line, headers and body.
+        virtual bool Send(const RequestSpec& spec) = 0;
+        // Sends a prepared request with its blanks filled in. By default as the spec it resolves to,
+        // transports that can use the rendered head override it.
+        virtual bool Send(const PreparedRequest& request, std::span<const std::string_view> parameters, std::span<const std::string_view> payloads) {
+            return Send(request.Resolve(parameters, payloads));
+        }
+        // Waits for the response headers.
+        virtual bool Receive() = 0;
+        // Content-Length of the received response, if the server sent one.
+        virtual std::optional<std::uint64_t> ContentLength() = 0;
+        // Reads the next piece of the body, satisfies Body::Source.
+        virtual std::optional<std::size_t> Read(char* dst, std::size_t capacity) = 0;
+        // Like Read, but only waits while nothing has arrived, so a streamed record isn't held back to
+        // fill dst. Transports whose Read works that way already don't override it.
+        virtual std::optional<std::size_t> ReadSome(char* dst, std::size_t capacity) {
+            return Read(dst, capacity);
+        }
+        // True if the connection can carry another request: the body was read to
+        // the end, nothing failed and neither side asked to close.
+        virtual bool Reusable() const = 0;
+        // Cheap check on an idle connection that the server hasn't closed it.
+        virtual bool Alive() = 0;
+        // Aborts the request from another thread: whatever it's blocked in fails right away and the
+        // connection can't be reused. Transports that can't do that let the request run its course.
+        virtual void Cancel() {}
+        // HTTP version of the received response.
+        virtual Protocol Negotiated() const {
+            return Protocol::Http1;
+        }
+
+        // Sending, receiving and reading fail once deadline passes, until the next call.
+        void SetDeadline(std::optional<std::chrono::steady_clock::time_point> deadline) {
+            this->deadline = deadline;
+        }
+        // True if the deadline has passed, so a failure was the deadline's doing.
+        bool Expired() const {
+            return deadline && std::chrono::steady_clock::now() >= *deadline;
+        }
+
+        // Status line and headers of the received response, valid until the next request.
+        const Http1::Headers& Headers() const {
+            return headers;
+        }
+        int Status() const {
+            return headers.Status();
+        }
+        // Value of the first response header called name.
+        std::optional<std::string_view> Header(std::string_view name) const {
+            return headers.Find(name);
+        }
+
+        // Scratch buffer for streaming bodies, allocated once per connection.
+        std::span<char> Buffer() {
+            if (buffer.empty())
+                buffer.resize(Body::ChunkSize);
+            return buffer;
+        }
+
+        // Times the phases of the next request, until TakeTiming. The first request on a
+        // connection also gets the setup phases the backend recorded while connecting.
+        void StartTiming() {
+            timing = std::exchange(setup, {});
+            timed = true;
+            last = Metrics::Clock::now();
+        }
+        Metrics::Timing TakeTiming() {
+            timed = false;
+            return timing;
+        }
+
+        protected:
+        // Charges the time since the previous mark to phase. A single branch while not timed.
+        void Mark(Metrics::Phase phase) {
+            if (not timed)
+                return;
+            auto now = Metrics::Clock::now();
+            timing[phase] += now - last;
+            last = now;
+        }
+        bool Timed() const {
+            return timed;
+        }
+        // Phases spent opening the connection, set by the backend.
+        Metrics::Timing setup;
+        // Set by Receive, over a head the connection keeps until the next request.
+        Http1::Headers headers;
+        std::optional<std::chrono::steady_clock::time_point> deadline;
+
+        private:
+        std::vector<char> buffer;
+        Metrics::Timing timing;
+        Metrics::Clock::time_point last;
+        bool timed = false;
+    };
+
+    // Opens connections. Throws std::runtime_error if the server can't be reached.
+    class Backend {
+        public:
+        virtual ~Backend() = default;
+        virtual std::unique_ptr<Connection> Connect(const Endpoint& endpoint) = 0;
+        // Looks the server's name up ahead of the first connection, where the backend keeps lookups.
+        // Throws std::runtime_error if it doesn't resolve.
+        virtual void Resolve(const Endpoint&) {}
+    };
+
+#ifdef _WIN32
+    // Runs requests through the WinHTTP class. Every connection shares the backend's session,
+    // so WinHTTP keeps the sockets alive and reuses them underneath.
+    class WinHTTPConnection : public Connection {
+        public:
+        WinHTTPConnection(HINTERNET hSession, const Endpoint& endpoint, bool http2 = false) : session(hSession), secure(endpoint.secure), http2(http2) {
+            // Pooled connections are handed from thread to thread, one at a time.
+            session.AllowMultiThread();
+            session.Connect(endpoint.host, endpoint.port);
+            if (not session.ConnectionAvailable())
+                throw std::runtime_error("Connection not available! Error code: " + std::to_string(WinHTTP::GetLastErrorMessage().first));
+        }
+        bool Send(const RequestSpec& spec) override {
+            complete = false;
+            session.OpenRequest(spec.verb, spec.objectName, spec.version, spec.referrer, spec.accept_types, spec.flags | (secure ? WINHTTP_FLAG_SECURE : 0));
+            if (not session.RequestAvailable())
+                return false;
+            // WinHTTP decodes gzip and deflate itself, br isn't offered.
+            decompress = spec.decompress && session.EnableDecompression();
+            if (http2)
+                session.EnableHttp2();
+            // WinHTTP times each step on its own, they all get what's left of the deadline.
+            if (deadline) {
+                auto left = std::chrono::ceil<std::chrono::milliseconds>(*deadline - std::chrono::steady_clock::now()).count();
+                auto timeout = static_cast<int>(std::clamp<std::int64_t>(left, 1, INT_MAX));
+                session.SetTimeouts(timeout, timeout, timeout, timeout);
+            }
+            // WinHTTP resolves, connects and handshakes inside the send, its status callback tells the phases apart.
+            DWORD_PTR context = 0;
+            if (Timed()) {
+                connected = false;
+                context = reinterpret_cast<DWORD_PTR>(this);
+                session.SetStatusCallback(&WinHTTPConnection::status, WINHTTP_CALLBACK_FLAG_RESOLVE_NAME | WINHTTP_CALLBACK_FLAG_CONNECT_TO_SERVER | WINHTTP_CALLBACK_FLAG_SEND_REQUEST);
+            }
+            bool sent = spec.formData.empty()
+                ? session.SendRequest(spec.headers, (DWORD)-1L, WINHTTP_NO_REQUEST_DATA, 0, 0, context)
+                : session.SendMultiPartFormRequest(spec.formData, spec.headers, (DWORD)-1L, context);
+            if (sent)
+                Mark(Metrics::Phase::Send);
+            return sent;
+        }
+        bool Receive() override {
+            headers.Reset();
+            if (not session.ReceiveResponseHeaders())
+                return false;
+            headers.Reset(session.ResponseHeaders().Raw());
+            Mark(Metrics::Phase::Wait);
+            return true;
+        }
+        std::optional<std::uint64_t> ContentLength() override {
+            if (decompress)
+                return {};
+            return session.ContentLength();
+        }
+        std::optional<std::size_t> Read(char* dst, std::size_t capacity) override {
+            return finish_read(session.ReadData(dst, capacity));
+        }
+        std::optional<std::size_t> ReadSome(char* dst, std::size_t capacity) override {
+            return finish_read(session.ReadAvailable(dst, capacity));
+        }
+        bool Reusable() const override {
+            return complete;
+        }
+        bool Alive() override {
+            // WinHTTP checks the sockets under the connection handle itself.
+            return true;
+        }
+        void Cancel() override {
+            session.CancelRequest();
+        }
+        Protocol Negotiated() const override {
+            return session.ProtocolUsed();
+        }
+
+        private:
+        std::optional<std::size_t> finish_read(std::optional<std::size_t> read) {
+            if (read && *read == 0) {
+                complete = true;
+                Mark(Metrics::Phase::Download);
+            }
+            return read;
+        }
+        // Only installed on timed requests. On a reused socket WinHTTP skips straight to sending.
+        static void CALLBACK status(HINTERNET, DWORD_PTR context, DWORD status, LPVOID, DWORD) {
+            auto* connection = reinterpret_cast<WinHTTPConnection*>(context);
+            if (not connection)
+                return;
+            switch (status) {
+                case WINHTTP_CALLBACK_STATUS_NAME_RESOLVED:
+                    connection->Mark(Metrics::Phase::Dns);
+                    break;
+                case WINHTTP_CALLBACK_STATUS_CONNECTED_TO_SERVER:
+                    connection->Mark(Metrics::Phase::Connect);
+                    connection->connected = true;
+                    break;
+                case WINHTTP_CALLBACK_STATUS_SENDING_REQUEST:
+                    // The handshake sits between connecting and sending the first request.
+                    if (connection->connected && connection->secure)
+                        connection->Mark(Metrics::Phase::Tls);
+                    break;
+            }
+        }
+
+        // ProtocolUsed queries the handle, which doesn't change it.
+        mutable WinHTTP session;
+        bool secure, http2, complete = false, connected = false, decompress = false;
+    };
+
+    class WinHTTPBackend : public Backend {
+        public:
+        // With Protocol::Http2 requests offer HTTP/2, which WinHTTP uses over TLS where the server agrees.
+        explicit WinHTTPBackend(const std::wstring& userAgent, Protocol protocol = Protocol::Http1) : http2(protocol == Protocol::Http2) {
+            hSession = WinHttpOpen(userAgent.c_str(), WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
+            if (not hSession)
+                throw std::runtime_error("Session creation failed!");
+        }
+        WinHTTPBackend(const WinHTTPBackend&) = delete;
+        ~WinHTTPBackend() override {
+            WinHttpCloseHandle(hSession);
+        }
+        std::unique_ptr<Connection> Connect(const Endpoint& endpoint) override {
+            return std::make_unique<WinHTTPConnection>(hSession, endpoint, http2);
+        }
+
+        private:
+        HINTERNET hSession = nullptr;
+        bool http2;
+    };
+
+    using DefaultBackend = WinHTTPBackend;
+#else
+    // Plain HTTP/1.1 over a blocking POSIX socket, kept alive between requests.
+    // Handles Content-Length, chunked and close-delimited bodies. No TLS.
+    class PosixConnection : public Connection {
+        public:
+        PosixConnection(int fd, std::string host, std::string userAgent, const Metrics::Timing& setup = {}) : fd(fd), host(std::move(host)), userAgent(std::move(userAgent)), in(16 * 1024) {
+            this->setup = setup;
+        }
+        PosixConnection(const PosixConnection&) = delete;
+        ~PosixConnection() override {
+            ::close(fd);
+        }
+
+        // The head and the form framing are built in the connection's arena, so a request
+        // without file parts doesn't touch the heap.
+        bool Send(const RequestSpec& spec) override {
+            start(spec);
+            std::optional<Multipart::Encoder> encoder;
+            if (not spec.formData.empty())
+                encoder.emplace(spec.formData, &arena);
+            std::pmr::string head(&arena);
+            Http1::RequestHead(head, spec, host, userAgent, encoder ? &*encoder : nullptr);
+            if (not send_all(head))
+                return false;
+            if (encoder && not encoder->Write([&](std::string_view chunk) { return send_all(chunk); }, Buffer()))
+                return false;
+            failed = false;
+            Mark(Metrics::Phase::Send);
+            return true;
+        }
+        // Only the parameters and the Content-Length are rendered, the rest is copied from request.
+        bool Send(const PreparedRequest& request, std::span<const std::string_view> parameters, std::span<const std::string_view> payloads) override {
+            start(request.Spec());
+            std::pmr::string head(&arena);
+            request.Head(head, host, userAgent, parameters, payloads);
+            if (not send_all(head))
+                return false;
+            if (not request.Write([&](std::string_view chunk) { return send_all(chunk); }, Buffer(), payloads))
+                return false;
+            failed = false;
+            Mark(Metrics::Phase::Send);
+            return true;
+        }
+
+        bool Receive() override {
+            failed = true;
+            while (true) {
+                std::string_view input(in.data() + begin, end - begin), body;
+                auto event = parser.Parse(input, body);
+                begin = end - input.size();
+                if (event == Http1::ResponseParser::Event::Headers)
+                    break;
+                if (event != Http1::ResponseParser::Event::NeedMore)
+                    return false;
+                auto got = fill();
+                if (not got || *got == 0)
+                    return false;
+            }
+            failed = false;
+            headers.Reset(parser.Head());
+            if (decompress && not parser.Complete()) {
+                auto encoding = Compression::Parse(headers.Find("Content-Encoding").value_or(""));
+                if (encoding && *encoding != Compression::Encoding::Identity)
+                    decoder.emplace(*encoding);
+            }
+            Mark(Metrics::Phase::Wait);
+            return true;
+        }
+
+        // Unknown when the body is decoded, the header counts the compressed bytes.
+        std::optional<std::uint64_t> ContentLength() override {
+            if (decoder)
+                return {};
+            return parser.ContentLength();
+        }
+
+        std::optional<std::size_t> Read(char* dst, std::size_t capacity) override {
+            Raw raw{*this};
+            auto read = decoder ? decoder->Read(raw, dst, capacity) : read_some(dst, capacity);
+            if (read && *read == 0)
+                Mark(Metrics::Phase::Download);
+            return read;
+        }
+
+        bool Reusable() const override {
+            return parser.Complete() && parser.KeepAlive() && not failed && begin == end;
+        }
+
+        bool Alive() override {
+            // Anything readable on an idle connection is either EOF or garbage, both mean it's done.
+            if (begin != end)
+                return false;
+            pollfd pfd{fd, POLLIN, 0};
+            return ::poll(&pfd, 1, 0) == 0;
+        }
+
+        // Wakes a blocked send or recv, the socket stays open until the connection is destroyed.
+        // Should the request finish anyway, the pool finds the socket shut on its next Alive().
+        void Cancel() override {
+            ::shutdown(fd, SHUT_RDWR);
+        }
+
+        private:
+        // The body as it comes off the wire, for the decoder to pull from.
+        struct Raw {
+            PosixConnection& connection;
+            std::optional<std::size_t> Read(char* dst, std::size_t capacity) {
+                return connection.read_some(dst, capacity);
+            }
+        };
+        // Body bytes into dst, 0 at the end of the body.
+        std::optional<std::size_t> read_some(char* dst, std::size_t capacity) {
+            using Event = Http1::ResponseParser::Event;
+            while (true) {
+                if (parser.Complete())
+                    return 0;
+                std::optional<std::size_t> got;
+                if (begin == end) {
+                    // Nothing buffered, read the body straight into dst.
+                    if (auto direct = parser.Direct()) {
+                        got = recv_some(dst, static_cast<std::size_t>(std::min<std::uint64_t>(capacity, direct)));
+                        if (got && *got > 0) {
+                            parser.Advance(*got);
+                            return got;
+                        }
+                    } else {
+                        got = fill();
+                    }
+                    // A socket error, a cancel or the deadline.
+                    if (not got) {
+                        failed = true;
+                        return {};
+                    }
+                    if (*got == 0 && parser.Finish() == Event::Done)
+                        return 0;
+                    if (*got == 0) {
+                        failed = true;
+                        return {};
+                    }
+                }
+                std::string_view input(in.data() + begin, end - begin), body;
+                auto event = parser.Parse(input, body, capacity);
+                begin = end - input.size();
+                switch (event) {
+                    case Event::Body:
+                        std::memcpy(dst, body.data(), body.size());
+                        return body.size();
+                    case Event::Done:
+                        return 0;
+                    case Event::NeedMore:
+                        if (begin == end)
+                            continue;
+                        got = fill();
+                        if (got && *got > 0)
+                            continue;
+                        if (got && parser.Finish() == Event::Done)
+                            return 0;
+                        [[fallthrough]];
+                    default:
+                        failed = true;
+                        return {};
+                }
+            }
+        }
+        // Resets the per-request state before spec goes out.
+        void start(const RequestSpec& spec) {
+            failed = true;
+            headers.Reset();
+            parser.Reset(spec.verb == L"HEAD");
+            decompress = spec.decompress;
+            decoder.reset();
+            arena.Release();
+        }
+        // Waits until the socket is ready for events, false once the deadline passes. Without a
+        // deadline the send or recv just blocks, no poll in front of it.
+        bool ready(short events) {
+            if (not deadline)
+                return true;
+            while (true) {
+                auto left = std::chrono::ceil<std::chrono::milliseconds>(*deadline - std::chrono::steady_clock::now()).count();
+                if (left <= 0)
+                    return false;
+                pollfd pfd{fd, events, 0};
+                auto rc = ::poll(&pfd, 1, static_cast<int>(std::min<std::int64_t>(left, INT_MAX)));
+                if (rc > 0)
+                    return true;
+                if (rc < 0 && errno != EINTR)
+                    return false;
+            }
+        }
+        bool send_all(std::string_view data) {
+            while (not data.empty()) {
+                if (not ready(POLLOUT))
+                    return false;
+                auto sent = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+                if (sent < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                data.remove_prefix(static_cast<std::size_t>(sent));
+            }
+            return true;
+        }
+        // Reads from the socket into dst, 0 on EOF.
+        std::optional<std::size_t> recv_some(char* dst, std::size_t capacity) {
+            while (true) {
+                if (not ready(POLLIN))
+                    return {};
+                auto got = ::recv(fd, dst, capacity, 0);
+                if (got >= 0)
+                    return static_cast<std::size_t>(got);
+                if (errno != EINTR)
+                    return {};
+            }
+        }
+        // Appends more socket data to the input buffer. Returns the bytes read, 0 on EOF.
+        std::optional<std::size_t> fill() {
+            if (begin == end)
+                begin = end = 0;
+            if (end == in.size()) {
+                if (begin > 0) {
+                    std::memmove(in.data(), in.data() + begin, end - begin);
+                    end -= begin;
+                    begin = 0;
+                } else {
+                    in.resize(in.size() * 2);
+                }
+            }
+            auto got = recv_some(in.data() + end, in.size() - end);
+            if (got)
+                end += *got;
+            return got;
+        }
+
+        int fd;
+        std::string host, userAgent;
+        std::vector<char> in;
+        std::size_t begin = 0, end = 0;
+        Http1::ResponseParser parser;
+        bool failed = false, decompress = false;
+        std::optional<Compression::Decoder> decoder;
+        Util::Arena<4096> arena;
+    };
+
+    // HTTP/2 without TLS to a server known to speak it, "prior knowledge" h2c (RFC 9113 3.3). One session
+    // carries the requests of every Http2Connection to the server at once, each on a stream of its own.
+    // A reader thread takes frames off the socket and hands them to their streams, a writer thread
+    // sends what the streams queue, so a request never waits on another one's socket call.
+    class Http2Session {
+        public:
+        using Deadline = std::optional<std::chrono::steady_clock::time_point>;
+        // Flow control windows offered to the server. The connection's is topped up as data arrives,
+        // a stream's as its body is read, so a stream nobody reads holds up only itself.
+        static constexpr std::uint32_t StreamWindow = 1024 * 1024, ConnectionWindow = 16 * 1024 * 1024;
+
+        // A request and its response, owned by the Http2Connection that sent it.
+        struct Stream {
+            std::uint32_t id = 0;
+            std::condition_variable changed;
+            // "HTTP/2 <status>" and the fields, once the response headers are in.
+            std::string head;
+            bool answered = false, ended = false, failed = false;
+            // Body received and not read yet, from offset on.
+            std::string data;
+            std::size_t offset = 0;
+            // How much more the request may send, and what was read since the last WINDOW_UPDATE.
+            std::int64_t window = 0;
+            std::uint32_t consumed = 0;
+        };
+
+        Http2Session(int fd, std::string authority, const Metrics::Timing& setup) : fd(fd), authority(std::move(authority)), setup(setup) {
+            outbox = Http2::Preface;
+            std::string settings;
+            Http2::AppendSetting(settings, Http2::Setting::EnablePush, 0);
+            Http2::AppendSetting(settings, Http2::Setting::InitialWindowSize, StreamWindow);
+            Http2::AppendFrame(outbox, Http2::Frame::Settings, 0, 0, settings);
+            Http2::AppendWindowUpdate(outbox, 0, ConnectionWindow - Http2::DefaultWindow);
+            reader = std::thread([this] { read_loop(); });
+            writer = std::thread([this] { write_loop(); });
+        }
+        Http2Session(const Http2Session&) = delete;
+        ~Http2Session() {
+            {
+                std::lock_guard lock(mutex);
+                closing = true;
+            }
+            writable.notify_all();
+            ::shutdown(fd, SHUT_RDWR);
+            reader.join();
+            writer.join();
+            ::close(fd);
+        }
+
+        const std::string& Authority() const {
+            return authority;
+        }
+        // True while new streams can be opened: the socket works and the server didn't send GOAWAY.
+        bool Usable() {
+            std::lock_guard lock(mutex);
+            return usable;
+        }
+        // DNS and connect time of the session, for the first request it carries only.
+        Metrics::Timing TakeSetup() {
+            std::lock_guard lock(mutex);
+            return std::exchange(setup, {});
+        }
+
+        // Opens stream with an HTTP/1.1 request head. The body follows with Data, unless last.
+        // Waits for a free stream if the server's limit is reached. False if the session failed or
+        // the deadline passed first.
+        bool Open(Stream& stream, std::string_view head, bool last, Deadline deadline) {
+            std::unique_lock lock(mutex);
+            if (not wait(lock, slots, deadline, [&] { return not usable || streams.size() < maxStreams; }) || not usable)
+                return false;
+            stream.id = next;
+            stream.window = peerWindow;
+            next += 2;
+            // Stream ids run out at 2^31, the next request goes on a new session.
+            if (next > 0x7fffffff)
+                usable = false;
+            streams.emplace(stream.id, &stream);
+            block.clear();
+            encoder.Request(block, head, "http");
+            Http2::AppendHeaders(outbox, stream.id, block, last, peerFrameSize);
+            writable.notify_one();
+            return true;
+        }
+        // Sends the next piece of the request body, as much as flow control allows at a time.
+        bool Data(Stream& stream, std::string_view data, bool last, Deadline deadline) {
+            if (data.empty() && not last)
+                return true;
+            std::unique_lock lock(mutex);
+            do {
+                if (not wait(lock, stream.changed, deadline, [&] { return stream.failed || stream.ended || data.empty() || std::min(stream.window, window) > 0; }))
+                    return false;
+                if (stream.failed)
+                    return false;
+                // The server answered before the whole body was sent, it doesn't want the rest.
+                if (stream.ended)
+                    return true;
+                auto size = static_cast<std::size_t>(std::max<std::int64_t>(0, std::min<std::int64_t>({static_cast<std::int64_t>(data.size()), stream.window, window, static_cast<std::int64_t>(peerFrameSize)})));
+                bool end = last && size == data.size();
+                Http2::AppendFrame(outbox, Http2::Frame::Data, end ? Http2::Flag::EndStream : 0, stream.id, data.substr(0, size));
+                stream.window -= static_cast<std::int64_t>(size);
+                window -= static_cast<std::int64_t>(size);
+                data.remove_prefix(size);
+                writable.notify_one();
+            } while (not data.empty());
+            return true;
+        }
+        // Waits for the response headers of stream.
+        bool Receive(Stream& stream, Deadline deadline) {
+            std::unique_lock lock(mutex);
+            return wait(lock, stream.changed, deadline, [&] { return stream.answered || stream.failed; }) && stream.answered && not stream.failed;
+        }
+        // Takes up to capacity bytes of the body of stream, 0 at its end.
+        std::optional<std::size_t> Read(Stream& stream, char* dst, std::size_t capacity, Deadline deadline) {
+            std::unique_lock lock(mutex);
+            if (not wait(lock, stream.changed, deadline, [&] { return stream.offset < stream.data.size() || stream.ended || stream.failed; }) || stream.failed)
+                return {};
+            auto size = std::min(capacity, stream.data.size() - stream.offset);
+            if (size == 0)
+                return 0;
+            std::memcpy(dst, stream.data.data() + stream.offset, size);
+            stream.offset += size;
+            if (stream.offset == stream.data.size()) {
+                stream.data.clear();
+                stream.offset = 0;
+            } else if (stream.offset > StreamWindow / 2) {
+                stream.data.erase(0, stream.offset);
+                stream.offset = 0;
+            }
+            stream.consumed += static_cast<std::uint32_t>(size);
+            replenish(stream);
+            return size;
+        }
+        // Forgets stream, and resets it unless it's closed already. With cancel its waits fail right away.
+        void Close(Stream& stream, bool cancel = false) {
+            std::lock_guard lock(mutex);
+            if (stream.id && streams.erase(stream.id)) {
+                Http2::AppendReset(outbox, stream.id, Http2::ErrorCode::Cancel);
+                writable.notify_one();
+                slots.notify_one();
+            }
+            if (cancel) {
+                stream.failed = true;
+                stream.changed.notify_all();
+            }
+        }
+
+        private:
+        template<typename Predicate_>
+        static bool wait(std::unique_lock<std::mutex>& lock, std::condition_variable& cv, Deadline deadline, Predicate_&& predicate) {
+            if (not deadline) {
+                cv.wait(lock, predicate);
+                return true;
+            }
+            return cv.wait_until(lock, *deadline, predicate);
+        }
+        // Gives the server back the window a stream's reader freed, half a window at a time.
+        void replenish(Stream& stream) {
+            if (stream.ended || stream.consumed < StreamWindow / 2)
+                return;
+            Http2::AppendWindowUpdate(outbox, stream.id, std::exchange(stream.consumed, 0));
+            writable.notify_one();
+        }
+        // Ends stream with ended or failed, the server is done with it either way.
+        void finish(Stream& stream, bool failed) {
+            (failed ? stream.failed : stream.ended) = true;
+            streams.erase(stream.id);
+            stream.changed.notify_all();
+            slots.notify_one();
+        }
+        // The socket broke or the server broke the protocol: every stream fails.
+        void fail() {
+            usable = false;
+            for (auto& [id, stream] : streams) {
+                stream->failed = true;
+                stream->changed.notify_all();
+            }
+            streams.clear();
+            slots.notify_all();
+        }
+
+        void write_loop() {
+            std::string sending;
+            std::unique_lock lock(mutex);
+            while (true) {
+                writable.wait(lock, [&] { return closing || not outbox.empty(); });
+                if (closing)
+                    return;
+                // Whatever the streams queued meanwhile goes out in one send.
+                sending.swap(outbox);
+                lock.unlock();
+                std::string_view data = sending;
+                bool sent = true;
+                while (sent && not data.empty()) {
+                    auto written = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+                    if (written < 0 && errno == EINTR)
+                        continue;
+                    sent = written > 0;
+                    if (sent)
+                        data.remove_prefix(static_cast<std::size_t>(written));
+                }
+                sending.clear();
+                lock.lock();
+                if (not sent) {
+                    fail();
+                    return;
+                }
+            }
+        }
+
+        void read_loop() {
+            std::vector<char> in(64 * 1024);
+            std::size_t begin = 0, end = 0;
+            // Buffers until at least size bytes are in.
+            auto fill = [&](std::size_t size) {
+                if (in.size() - begin < size) {
+                    std::memmove(in.data(), in.data() + begin, end - begin);
+                    end -= begin;
+                    begin = 0;
+                }
+                while (end - begin < size) {
+                    auto got = ::recv(fd, in.data() + end, in.size() - end, 0);
+                    if (got < 0 && errno == EINTR)
+                        continue;
+                    if (got <= 0)
+                        return false;
+                    end += static_cast<std::size_t>(got);
+                }
+                return true;
+            };
+            while (true) {
+                if (not fill(Http2::FrameHead::Size))
+                    break;
+                auto frame = Http2::FrameHead::Parse(in.data() + begin);
+                // Nothing larger was allowed, it won't fit the buffer either.
+                if (frame.length > Http2::DefaultFrameSize || not fill(Http2::FrameHead::Size + frame.length))
+                    break;
+                std::string_view payload(in.data() + begin + Http2::FrameHead::Size, frame.length);
+                begin += Http2::FrameHead::Size + frame.length;
+                std::lock_guard lock(mutex);
+                if (not handle(frame, payload)) {
+                    std::string reason;
+                    Http2::AppendUint(reason, 0);
+                    Http2::AppendUint(reason, static_cast<std::uint32_t>(Http2::ErrorCode::Protocol));
+                    Http2::AppendFrame(outbox, Http2::Frame::GoAway, 0, 0, reason);
+                    writable.notify_one();
+                    fail();
+                    return;
+                }
+            }
+            std::lock_guard lock(mutex);
+            fail();
+        }
+
+        // One frame from the server, under the lock. False if it broke the protocol.
+        bool handle(const Http2::FrameHead& frame, std::string_view payload) {
+            using Http2::Frame;
+            // Header blocks can't be interleaved with anything, RFC 9113 6.10.
+            if (continuing != (frame.type == Frame::Continuation))
+                return false;
+            auto found = streams.find(frame.stream);
+            Stream* stream = found == streams.end() ? nullptr : found->second;
+            switch (frame.type) {
+                case Frame::Data: {
+                    if (frame.stream == 0)
+                        return false;
+                    auto data = Http2::Unpad(payload, frame.flags);
+                    if (not data)
+                        return false;
+                    // Data of a stream that's gone still counts against the connection's window.
+                    received += frame.length;
+                    if (received >= ConnectionWindow / 2) {
+                        Http2::AppendWindowUpdate(outbox, 0, std::exchange(received, 0));
+                        writable.notify_one();
+                    }
+                    if (not stream)
+                        return true;
+                    stream->data += *data;
+                    stream->consumed += static_cast<std::uint32_t>(frame.length - data->size());
+                    if (frame.flags & Http2::Flag::EndStream)
+                        finish(*stream, false);
+                    else
+                        stream->changed.notify_all();
+                    return true;
+                }
+                case Frame::Headers: {
+                    if (frame.stream == 0)
+                        return false;
+                    auto fragment = Http2::Unpad(payload, frame.flags);
+                    if (not fragment || ((frame.flags & Http2::Flag::Priority) && fragment->size() < 5))
+                        return false;
+                    if (frame.flags & Http2::Flag::Priority)
+                        fragment->remove_prefix(5);
+                    block.assign(*fragment);
+                    blockStream = frame.stream;
+                    blockEnds = frame.flags & Http2::Flag::EndStream;
+                    continuing = not (frame.flags & Http2::Flag::EndHeaders);
+                    return continuing || headers();
+                }
+                case Frame::Continuation:
+                    if (frame.stream != blockStream)
+                        return false;
+                    block += payload;
+                    continuing = not (frame.flags & Http2::Flag::EndHeaders);
+                    return continuing || headers();
+                case Frame::ResetStream:
+                    if (frame.stream == 0 || payload.size() != 4)
+                        return false;
+                    if (stream)
+                        finish(*stream, true);
+                    return true;
+                case Frame::Settings: {
+                    if (frame.stream != 0 || payload.size() % 6 != 0)
+                        return false;
+                    if (frame.flags & Http2::Flag::Ack)
+                        return true;
+                    for (; not payload.empty(); payload.remove_prefix(6)) {
+                        auto value = Http2::ReadUint(payload.substr(2));
+                        switch (static_cast<Http2::Setting>(Http2::ReadUint(payload, 2))) {
+                            case Http2::Setting::HeaderTableSize:
+                                encoder.Limit(value);
+                                break;
+                            case Http2::Setting::MaxConcurrentStreams:
+                                maxStreams = value;
+                                break;
+                            case Http2::Setting::InitialWindowSize: {
+                                if (value > 0x7fffffff)
+                                    return false;
+                                // Applies to the streams already open too, RFC 9113 6.9.2.
+                                auto delta = static_cast<std::int64_t>(value) - peerWindow;
+                                peerWindow = value;
+                                for (auto& [id, open] : streams) {
+                                    open->window += delta;
+                                    open->changed.notify_all();
+                                }
+                                break;
+                            }
+                            case Http2::Setting::MaxFrameSize:
+                                if (value < Http2::DefaultFrameSize || value > 0xffffff)
+                                    return false;
+                                peerFrameSize = value;
+                                break;
+                            default:
+                                break;
+                        }
+                    }
+                    Http2::AppendFrame(outbox, Frame::Settings, Http2::Flag::Ack, 0);
+                    writable.notify_one();
+                    slots.notify_all();
+                    return true;
+                }
+                case Frame::Ping:
+                    if (frame.stream != 0 || payload.size() != 8)
+                        return false;
+                    if (not (frame.flags & Http2::Flag::Ack)) {
+                        Http2::AppendFrame(outbox, Frame::Ping, Http2::Flag::Ack, 0, payload);
+                        writable.notify_one();
+                    }
+                    return true;
+                case Frame::GoAway: {
+                    if (frame.stream != 0 || payload.size() < 8)
+                        return false;
+                    // Streams up to the last one the server took are still answered, the others never will be.
+                    usable = false;
+                    auto lastStream = Http2::ReadUint(payload) & 0x7fffffff;
+                    for (auto it = streams.begin(); it != streams.end();) {
+                        auto open = (it++)->second;
+                        if (open->id > lastStream)
+                            finish(*open, true);
+                    }
+                    slots.notify_all();
+                    return true;
+                }
+                case Frame::WindowUpdate: {
+                    if (payload.size() != 4)
+                        return false;
+                    auto increment = static_cast<std::int64_t>(Http2::ReadUint(payload) & 0x7fffffff);
+                    if (frame.stream == 0) {
+                        window += increment;
+                        for (auto& [id, open] : streams)
+                            open->changed.notify_all();
+                    } else if (stream) {
+                        stream->window += increment;
+                        stream->changed.notify_all();
+                    }
+                    return true;
+                }
+                case Frame::PushPromise:
+                    // Turned off in the SETTINGS sent first.
+                    return false;
+                default:
+                    // PRIORITY and frame types from extensions are ignored.
+                    return true;
+            }
+        }
+        // A complete header block. Decoded even for a stream that's gone, the decoder's table depends on it.
+        bool headers() {
+            auto found = streams.find(blockStream);
+            Stream* stream = found == streams.end() || found->second->answered ? nullptr : found->second;
+            int status = 0;
+            if (stream) {
+                stream->head = "HTTP/2 ";
+                stream->head.reserve(block.size() * 2);
+            }
+            bool decoded = decoder.Decode(block, [&](std::string_view name, std::string_view value) {
+                if (name == ":status")
+                    std::from_chars(value.data(), value.data() + value.size(), status);
+                if (not stream)
+                    return;
+                if (name == ":status") {
+                    stream->head.insert(7, value);
+                } else if (not name.starts_with(':')) {
+                    stream->head += "\r\n";
+                    stream->head += name;
+                    stream->head += ": ";
+                    stream->head += value;
+                }
+            });
+            if (not decoded)
+                return false;
+            if (not stream) {
+                // Trailers, or a stream that's gone. Trailers can end the stream.
+                if (blockEnds && found != streams.end())
+                    finish(*found->second, false);
+                return true;
+            }
+            // An informational response, the real one follows.
+            if (status >= 100 && status < 200 && not blockEnds) {
+                stream->head.clear();
+                return true;
+            }
+            stream->head += "\r\n\r\n";
+            stream->answered = true;
+            if (blockEnds)
+                finish(*stream, false);
+            else
+                stream->changed.notify_all();
+            return true;
+        }
+
+        int fd;
+        std::string authority;
+        Metrics::Timing setup;
+        std::mutex mutex;
+        std::condition_variable writable, slots;
+        // Frames waiting for the writer.
+        std::string outbox;
+        std::unordered_map<std::uint32_t, Stream*> streams;
+        std::uint32_t next = 1;
+        std::size_t maxStreams = std::numeric_limits<std::uint32_t>::max(), peerFrameSize = Http2::DefaultFrameSize;
+        // Send windows: the connection's and the one new streams start with.
+        std::int64_t window = Http2::DefaultWindow, peerWindow = Http2::DefaultWindow;
+        std::uint32_t received = 0;
+        Http2::Hpack::Encoder encoder;
+        Http2::Hpack::Decoder decoder;
+        // The header block being received, and the request block being encoded.
+        std::string block;
+        std::uint32_t blockStream = 0;
+        bool blockEnds = false, continuing = false;
+        bool usable = true, closing = false;
+        std::thread reader, writer;
+    };
+
+    // A request at a time over a shared Http2Session, so the pool hands out streams rather than sockets:
+    // as many leases to one server as the pool allows share a single connection.
+    class Http2Connection : public Connection {
+        public:
+        Http2Connection(std::shared_ptr<Http2Session> session, std::string userAgent) : session(std::move(session)), userAgent(std::move(userAgent)) {
+            setup = this->session->TakeSetup();
+        }
+        Http2Connection(const Http2Connection&) = delete;
+        ~Http2Connection() override {
+            if (stream)
+                session->Close(*stream);
+        }
+
+        bool Send(const RequestSpec& spec) override {
+            start(spec);
+            std::optional<Multipart::Encoder> encoder;
+            if (not spec.formData.empty())
+                encoder.emplace(spec.formData, &arena);
+            return transmit([&](auto& head) {
+                Http1::RequestHead(head, spec, session->Authority(), userAgent, encoder ? &*encoder : nullptr);
+            }, encoder.has_value(), [&](auto&& sink) {
+                return encoder->Write(sink, Buffer());
+            });
+        }
+        bool Send(const PreparedRequest& request, std::span<const std::string_view> parameters, std::span<const std::string_view> payloads) override {
+            start(request.Spec());
+            return transmit([&](auto& head) {
+                request.Head(head, session->Authority(), userAgent, parameters, payloads);
+            }, not request.Spec().formData.empty(), [&](auto&& sink) {
+                return request.Write(sink, Buffer(), payloads);
+            });
+        }
+
+        bool Receive() override {
+            headers.Reset();
+            if (not session->Receive(*stream, deadline))
+                return false;
+            headers.Reset(stream->head);
+            if (decompress) {
+                auto encoding = Compression::Parse(headers.Find("Content-Encoding").value_or(""));
+                if (encoding && *encoding != Compression::Encoding::Identity)
+                    decoder.emplace(*encoding);
+            }
+            Mark(Metrics::Phase::Wait);
+            return true;
+        }
+        std::optional<std::uint64_t> ContentLength() override {
+            if (decoder || head)
+                return {};
+            return headers.Number("Content-Length");
+        }
+        std::optional<std::size_t> Read(char* dst, std::size_t capacity) override {
+            Raw raw{*this};
+            auto read = decoder ? decoder->Read(raw, dst, capacity) : raw.Read(dst, capacity);
+            if (read && *read == 0) {
+                complete = true;
+                Mark(Metrics::Phase::Download);
+            }
+            return read;
+        }
+        bool Reusable() const override {
+            return complete && session->Usable();
+        }
+        bool Alive() override {
+            return session->Usable();
+        }
+        void Cancel() override {
+            if (stream)
+                session->Close(*stream, true);
+        }
+        Protocol Negotiated() const override {
+            return Protocol::Http2;
+        }
+
+        private:
+        struct Raw {
+            Http2Connection& connection;
+            std::optional<std::size_t> Read(char* dst, std::size_t capacity) {
+                return connection.session->Read(*connection.stream, dst, capacity, connection.deadline);
+            }
+        };
+        // Resets the per-request state before spec goes out. The last stream is closed before
+        // a new one starts, the object is reused.
+        void start(const RequestSpec& spec) {
+            if (stream)
+                session->Close(*stream);
+            stream = std::make_unique<Http2Session::Stream>();
+            complete = false;
+            head = spec.verb == L"HEAD";
+            decompress = spec.decompress;
+            decoder.reset();
+            arena.Release();
+        }
+        // Sends the head render writes as a HEADERS frame, then the body write pushes into its sink if there's one.
+        template<typename Render_, typename Write_>
+        bool transmit(Render_&& render, bool body, Write_&& write) {
+            std::pmr::string rendered(&arena);
+            render(rendered);
+            if (not session->Open(*stream, rendered, not body, deadline))
+                return false;
+            if (body && not (write([&](std::string_view chunk) { return session->Data(*stream, chunk, false, deadline); }) && session->Data(*stream, {}, true, deadline)))
+                return false;
+            Mark(Metrics::Phase::Send);
+            return true;
+        }
+
+        std::shared_ptr<Http2Session> session;
+        std::string userAgent;
+        std::unique_ptr<Http2Session::Stream> stream;
+        bool complete = false, head = false, decompress = false;
+        std::optional<Compression::Decoder> decoder;
+        Util::Arena<4096> arena;
+    };
+
+    class PosixBackend : public Backend {
+        public:
+        // With Protocol::Http2 every connection to a server is a stream on one h2c session to it.
+        explicit PosixBackend(const std::wstring& userAgent, Protocol protocol = Protocol::Http1, Dns::Options dns = {}) : userAgent(Util::narrow(userAgent)), protocol(protocol), dns(std::move(dns)) {}
+        std::unique_ptr<Connection> Connect(const Endpoint& endpoint) override {
+            if (endpoint.secure)
+                throw std::runtime_error("HTTPS is not supported by the POSIX transport.");
+            if (protocol == Protocol::Http2)
+                return std::make_unique<Http2Connection>(session(endpoint), userAgent);
+            auto socket = open(endpoint);
+            return std::make_unique<PosixConnection>(socket.fd, std::move(socket.host), userAgent, socket.setup);
+        }
+        void Resolve(const Endpoint& endpoint) override {
+            dns.Resolve(Util::narrow(endpoint.host), endpoint.port);
+        }
+        // Where the backend keeps what names resolved to.
+        Dns::Cache& GetDns() {
+            return dns;
+        }
+
+        private:
+        struct Socket {
+            int fd;
+            // Host header value, with the port unless it's 80.
+            std::string host;
+            Metrics::Timing setup;
+        };
+        Socket open(const Endpoint& endpoint) {
+            auto host = Util::narrow(endpoint.host);
+            // Two clock reads per new connection, cheap enough to always take.
+            Metrics::Timing setup;
+            auto started = Metrics::Clock::now();
+            auto addresses = dns.Resolve(host, endpoint.port);
+            auto resolved = Metrics::Clock::now();
+            setup[Metrics::Phase::Dns] = resolved - started;
+            int fd = -1, err = 0;
+            for (const auto& address : *addresses) {
+                fd = ::socket(address.storage.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (fd < 0) {
+                    err = errno;
+                    continue;
+                }
+                if (::connect(fd, address.Get(), address.length) == 0)
+                    break;
+                err = errno;
+                ::close(fd);
+                fd = -1;
+            }
+            if (fd < 0) {
+                // The server may have moved, the next connection looks it up again.
+                dns.Forget(host, endpoint.port);
+                throw std::runtime_error("Connection failed! " + std::string(std::strerror(err)));
+            }
+            setup[Metrics::Phase::Connect] = Metrics::Clock::now() - resolved;
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (endpoint.port != 80)
+                host += ':' + std::to_string(endpoint.port);
+            return {fd, std::move(host), setup};
+        }
+        // The session to endpoint, a new one if there's none or it can't take more streams. Connects
+        // under the lock, so callers racing for the first stream end up on the same session.
+        std::shared_ptr<Http2Session> session(const Endpoint& endpoint) {
+            std::lock_guard lock(mutex);
+            auto& shared = sessions[endpoint];
+            auto current = shared.lock();
+            if (not current || not current->Usable()) {
+                auto socket = open(endpoint);
+                current = std::make_shared<Http2Session>(socket.fd, std::move(socket.host), socket.setup);
+                shared = current;
+            }
+            return current;
+        }
+
+        std::string userAgent;
+        Protocol protocol;
+        Dns::Cache dns;
+        std::mutex mutex;
+        std::map<Endpoint, std::weak_ptr<Http2Session>> sessions;
+    };
+
+    using DefaultBackend = PosixBackend;
+#endif
+
+    // Responses kept in memory, looked up by the request they answer: its method and target, as
+    // in "GET /path?query". Filled by a RecordingBackend or by hand, served by a ReplayBackend.
+    // Thread safe.
+    class Recording {
+        public:
+        // Adds response, the bytes a server sends. Responses to the same request are served in
+        // the order they were added, starting over after the last.
+        void Add(std::string request, std::string response) {
+            auto stored = std::make_shared<const std::string>(std::move(response));
+            std::lock_guard lock(mutex);
+            entries[std::move(request)].responses.push_back(std::move(stored));
+        }
+        // The next response to request, none if there's no response to it.
+        std::shared_ptr<const std::string> Next(std::string_view request) {
+            std::lock_guard lock(mutex);
+            auto it = entries.find(request);
+            if (it == entries.end())
+                return {};
+            auto& entry = it->second;
+            auto& response = entry.responses[entry.next];
+            entry.next = (entry.next + 1) % entry.responses.size();
+            return response;
+        }
+        // Responses in the recording.
+        std::size_t Size() const {
+            std::lock_guard lock(mutex);
+            std::size_t size = 0;
+            for (const auto& [request, entry] : entries)
+                size += entry.responses.size();
+            return size;
+        }
+
+        // Writes the responses to path, for a later run to Load. False if it couldn't be written.
+        bool Save(const std::filesystem::path& path) const {
+            std::lock_guard lock(mutex);
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            out << "WinHTTP-recording-1\n";
+            for (const auto& [request, entry] : entries)
+                for (const auto& response : entry.responses)
+                    out << std::quoted(request) << ' ' << response->size() << '\n' << *response;
+            return static_cast<bool>(out);
+        }
+        // Adds the responses Save wrote to path. False if there's none or it's damaged.
+        bool Load(const std::filesystem::path& path) {
+            std::ifstream in(path, std::ios::binary);
+            std::string magic;
+            if (not std::getline(in, magic) || magic != "WinHTTP-recording-1")
+                return false;
+            std::string request;
+            std::size_t size = 0;
+            while (in >> std::quoted(request) >> size && in.get() == '\n') {
+                std::string response(size, '\0');
+                if (not in.read(response.data(), static_cast<std::streamsize>(size)))
+                    return false;
+                Add(std::move(request), std::move(response));
+            }
+            return in.eof();
+        }
+
+        // The request a spec amounts to, as the responses to it are looked up.
+        static std::string Request(const RequestSpec& spec) {
+            std::string request;
+            Util::append_narrow(request, spec.verb);
+            request += ' ';
+            if (spec.objectName.empty() || spec.objectName.front() != L'/')
+                request += '/';
+            Util::append_narrow(request, spec.objectName);
+            return request;
+        }
+
+        private:
+        struct Entry {
+            std::vector<std::shared_ptr<const std::string>> responses;
+            std::size_t next = 0;
+        };
+        mutable std::mutex mutex;
+        std::map<std::string, Entry, std::less<>> entries;
+    };
+
+    // Passes requests through to another transport's connection and adds every response that's read
+    // to the end to a Recording. The body is kept as it was handed out, so a body the transport decoded
+    // is recorded decoded, and the head is rewritten to say so with a Content-Length.
+    class RecordingConnection : public Connection {
+        public:
+        RecordingConnection(std::unique_ptr<Connection> connection, std::shared_ptr<Recording> recording) : connection(std::move(connection)), recording(std::move(recording)) {}
+
+        bool Send(const RequestSpec& spec) override {
+            start(spec);
+            connection->SetDeadline(deadline);
+            return mark(connection->Send(spec), Metrics::Phase::Send);
+        }
+        bool Send(const PreparedRequest& request, std::span<const std::string_view> parameters, std::span<const std::string_view> payloads) override {
+            start(request.Resolve(parameters, payloads));
+            connection->SetDeadline(deadline);
+            return mark(connection->Send(request, parameters, payloads), Metrics::Phase::Send);
+        }
+        bool Receive() override {
+            connection->SetDeadline(deadline);
+            if (not connection->Receive())
+                return false;
+            head.assign(connection->Headers().Raw());
+            headers.Reset(head);
+            body.clear();
+            return mark(true, Metrics::Phase::Wait);
+        }
+        std::optional<std::uint64_t> ContentLength() override {
+            return connection->ContentLength();
+        }
+        std::optional<std::size_t> Read(char* dst, std::size_t capacity) override {
+            connection->SetDeadline(deadline);
+            return keep(dst, connection->Read(dst, capacity));
+        }
+        std::optional<std::size_t> ReadSome(char* dst, std::size_t capacity) override {
+            connection->SetDeadline(deadline);
+            return keep(dst, connection->ReadSome(dst, capacity));
+        }
+        bool Reusable() const override {
+            return connection->Reusable();
+        }
+        bool Alive() override {
+            return connection->Alive();
+        }
+        void Cancel() override {
+            connection->Cancel();
+        }
+        Protocol Negotiated() const override {
+            return connection->Negotiated();
+        }
+
+        private:
+        void start(const RequestSpec& spec) {
+            request = Recording::Request(spec);
+            headRequest = spec.verb == L"HEAD";
+            decompress = spec.decompress;
+            headers.Reset();
+        }
+        bool mark(bool done, Metrics::Phase phase) {
+            if (done)
+                Mark(phase);
+            return done;
+        }
+        std::optional<std::size_t> keep(const char* dst, std::optional<std::size_t> read) {
+            if (not read)
+                return read;
+            if (*read > 0) {
+                body.append(dst, *read);
+                return read;
+            }
+            Mark(Metrics::Phase::Download);
+            recording->Add(request, response());
+            return read;
+        }
+        // The head with the body's framing swapped for the length of the body as recorded.
+        std::string response() const {
+            if (headRequest)
+                return head;
+            std::string response;
+            std::string_view rest = head;
+            auto eol = rest.find("\r\n");
+            response.append(rest.substr(0, eol));
+            response += "\r\n";
+            rest.remove_prefix(std::min(rest.size(), eol + 2));
+            while (not rest.empty()) {
+                eol = rest.find("\r\n");
+                auto line = rest.substr(0, eol);
+                rest.remove_prefix(std::min(rest.size(), eol + 2));
+                auto name = line.substr(0, line.find(':'));
+                if (line.empty() || Util::iequals(name, "Content-Length") || Util::iequals(name, "Transfer-Encoding"))
+                    continue;
+                // The transport decoded what it can decode.
+                if (decompress && Util::iequals(name, "Content-Encoding")) {
+                    auto encoding = Compression::Parse(headers.Find("Content-Encoding").value_or(""));
+                    if (encoding && *encoding != Compression::Encoding::Identity)
+                        continue;
+                }
+                response.append(line);
+                response += "\r\n";
+            }
+            response += "Content-Length: ";
+            Util::append_number(response, body.size());
+            response += "\r\n\r\n";
+            response += body;
+            return response;
+        }
+
+        std::unique_ptr<Connection> connection;
+        std::shared_ptr<Recording> recording;
+        std::string request, head, body;
+        bool headRequest = false, decompress = false;
+    };
+
+    // Records what another backend's connections receive, e.g. to replay a session against a real
+    // server later with the server out of the picture.
+    class RecordingBackend : public Backend {
+        public:
+        RecordingBackend(std::unique_ptr<Backend> backend, std::shared_ptr<Recording> recording) : backend(std::move(backend)), recording(std::move(recording)) {}
+        std::unique_ptr<Connection> Connect(const Endpoint& endpoint) override {
+            return std::make_unique<RecordingConnection>(backend->Connect(endpoint), recording);
+        }
+        void Resolve(const Endpoint& endpoint) override {
+            backend->Resolve(endpoint);
+        }
+
+        private:
+        std::unique_ptr<Backend> backend;
+        std::shared_ptr<Recording> recording;
+    };
+
+    // Answers requests from a Recording instead of a server. The request is rendered and its form body
+    // encoded as for the wire, and the response goes through the same parser and decoder as one off a
+    // socket, just without the socket: what's left is the library's own cost. A request with nothing
+    // recorded for it fails to send.
+    class ReplayConnection : public Connection {
+        public:
+        ReplayConnection(std::shared_ptr<Recording> recording, std::string host, std::string userAgent) : recording(std::move(recording)), host(std::move(host)), userAgent(std::move(userAgent)) {}
+
+        bool Send(const RequestSpec& spec) override {
+            start(spec);
+            std::optional<Multipart::Encoder> encoder;
+            if (not spec.formData.empty())
+                encoder.emplace(spec.formData, &arena);
+            std::pmr::string head(&arena);
+            Http1::RequestHead(head, spec, host, userAgent, encoder ? &*encoder : nullptr);
+            if (encoder && not encoder->Write([](std::string_view) { return true; }, Buffer()))
+                return false;
+            return answer(head);
+        }
+        bool Send(const PreparedRequest& request, std::span<const std::string_view> parameters, std::span<const std::string_view> payloads) override {
+            start(request.Spec());
+            std::pmr::string head(&arena);
+            request.Head(head, host, userAgent, parameters, payloads);
+            if (not request.Write([](std::string_view) { return true; }, Buffer(), payloads))
+                return false;
+            return answer(head);
+        }
+
+        bool Receive() override {
+            failed = true;
+            if (not response || cancelled || Expired())
+                return false;
+            std::string_view input = remaining(), body;
+            auto event = parser.Parse(input, body);
+            offset = response->size() - input.size();
+            if (event != Http1::ResponseParser::Event::Headers)
+                return false;
+            failed = false;
+            headers.Reset(parser.Head());
+            if (decompress && not parser.Complete()) {
+                auto encoding = Compression::Parse(headers.Find("Content-Encoding").value_or(""));
+                if (encoding && *encoding != Compression::Encoding::Identity)
+                    decoder.emplace(*encoding);
+            }
+            Mark(Metrics::Phase::Wait);
+            return true;
+        }
+        std::optional<std::uint64_t> ContentLength() override {
+            if (decoder)
+                return {};
+            return parser.ContentLength();
+        }
+        std::optional<std::size_t> Read(char* dst, std::size_t capacity) override {
+            Raw raw{*this};
+            auto read = decoder ? decoder->Read(raw, dst, capacity) : read_some(dst, capacity);
+            if (read && *read == 0)
+                Mark(Metrics::Phase::Download);
+            return read;
+        }
+
+        bool Reusable() const override {
+            return parser.Complete() && parser.KeepAlive() && not failed && not cancelled && remaining().empty();
+        }
+        bool Alive() override {
+            return not cancelled;
+        }
+        void Cancel() override {
+            cancelled = true;
+        }
+
+        private:
+        // The recorded body, for the decoder to pull from.
+        struct Raw {
+            ReplayConnection& connection;
+            std::optional<std::size_t> Read(char* dst, std::size_t capacity) {
+                return connection.read_some(dst, capacity);
+            }
+        };
+        std::optional<std::size_t> read_some(char* dst, std::size_t capacity) {
+            using Event = Http1::ResponseParser::Event;
+            if (parser.Complete())
+                return 0;
+            if (cancelled || Expired()) {
+                failed = true;
+                return {};
+            }
+            std::string_view input = remaining(), body;
+            auto event = parser.Parse(input, body, capacity);
+            offset = response->size() - input.size();
+            switch (event) {
+                case Event::Body:
+                    std::memcpy(dst, body.data(), body.size());
+                    return body.size();
+                case Event::Done:
+                    return 0;
+                // The recording ends here, as a connection the server closed.
+                case Event::NeedMore:
+                    if (parser.Finish() == Event::Done)
+                        return 0;
+                    [[fallthrough]];
+                default:
+                    failed = true;
+                    return {};
+            }
+        }
+        void start(const RequestSpec& spec) {
+            failed = true;
+            headers.Reset();
+            parser.Reset(spec.verb == L"HEAD");
+            decompress = spec.decompress;
+            decoder.reset();
+            response.reset();
+            offset = 0;
+            arena.Release();
+        }
+        // Picks the response to the request line head starts with.
+        bool answer(std::string_view head) {
+            auto line = head.substr(0, head.find("\r\n"));
+            response = recording->Next(line.substr(0, line.rfind(' ')));
+            if (not response)
+                return false;
+            failed = false;
+            Mark(Metrics::Phase::Send);
+            return true;
+        }
+        std::string_view remaining() const {
+            return response ? std::string_view(*response).substr(offset) : std::string_view();
+        }
+
+        std::shared_ptr<Recording> recording;
+        std::string host, userAgent;
+        std::shared_ptr<const std::string> response;
+        std::size_t offset = 0;
+        Http1::ResponseParser parser;
+        bool failed = false, decompress = false;
+        std::atomic<bool> cancelled{false};
+        std::optional<Compression::Decoder> decoder;
+        Util::Arena<4096> arena;
+    };
+
+    // Connects to nothing, every connection answers from recording. Any endpoint will do.
+    class ReplayBackend : public Backend {
+        public:
+        explicit ReplayBackend(std::shared_ptr<Recording> recording, const std::wstring& userAgent = L"") : recording(std::move(recording)), userAgent(Util::narrow(userAgent)) {}
+        std::unique_ptr<Connection> Connect(const Endpoint& endpoint) override {
+            auto host = Util::narrow(endpoint.host);
+            if (endpoint.port != (endpoint.secure ? 443 : 80))
+                host += ':' + std::to_string(endpoint.port);
+            return std::make_unique<ReplayConnection>(recording, std::move(host), userAgent);
+        }
+
+        private:
+        std::shared_ptr<Recording> recording;
+        std::string userAgent;
+    };
+}
+
+namespace WinHTTP::Retry {
+    // Thrown when a request runs past its deadline, see Request::Timeout.
+    class DeadlineExceeded : public std::runtime_error {
+        public:
+        using std::runtime_error::runtime_error;
+    };
+}
+
+namespace WinHTTP::Async {
+    template<typename T_>
+    class Promise;
+
+    // Result of an asynchronous request. Wait for it like an std::future, or co_await it
+    // from a coroutine, which is then resumed on the thread that completed the request.
+    template<typename T_>
+    class Future {
+        public:
+        Future() = default;
+
+        bool Valid() const {
+            return static_cast<bool>(state);
+        }
+        bool Ready() const {
+            std::lock_guard lock(state->mutex);
+            return state->done;
+        }
+        void Wait() const {
+            std::unique_lock lock(state->mutex);
+            state->completed.wait(lock, [&] { return state->done; });
+        }
+        // Waits for the result and returns it, or rethrows the request's error. Call once.
+        T_ Get() {
+            Wait();
+            if (state->error)
+                std::rethrow_exception(state->error);
+            return std::move(*state->value);
+        }
+
+        bool await_ready() const {
+            return Ready();
+        }
+        bool await_suspend(std::coroutine_handle<> waiter) {
+            std::lock_guard lock(state->mutex);
+            if (state->done)
+                return false;
+            state->waiter = waiter;
+            return true;
+        }
+        T_ await_resume() {
+            return Get();
+        }
+
+        private:
+        friend class Promise<T_>;
+        struct State {
+            std::mutex mutex;
+            std::condition_variable completed;
+            bool done = false;
+            std::optional<T_> value;
+            std::exception_ptr error;
+            std::coroutine_handle<> waiter;
+        };
+        explicit Future(std::shared_ptr<State> state) : state(std::move(state)) {}
+        std::shared_ptr<State> state;
+    };
+
+    template<typename T_>
+    class Promise {
+        public:
+        Promise() : state(std::make_shared<typename Future<T_>::State>()) {}
+        Future<T_> GetFuture() const {
+            return Future<T_>{state};
+        }
+        void SetValue(T_ value) {
+            complete([&] { state->value.emplace(std::move(value)); });
+        }
+        void SetError(std::exception_ptr error) {
+            complete([&] { state->error = error; });
+        }
+
+        private:
+        template<typename Fill_>
+        void complete(Fill_ fill) {
+            std::coroutine_handle<> waiter;
+            {
+                std::lock_guard lock(state->mutex);
+                fill();
+                state->done = true;
+                waiter = std::exchange(state->waiter, {});
+            }
+            state->completed.notify_all();
+            if (waiter)
+                waiter.resume();
+        }
+        std::shared_ptr<typename Future<T_>::State> state;
+    };
+
+    struct Options {
+        // Event loop threads. Each drives any number of requests. Not used with WinHTTP, which has its own pool.
+        std::size_t threads = 1;
+        // Connections per host and loop, busy or idle. Requests beyond that wait for one to free up.
+        std::size_t maxPerHost = 64;
+    };
+
+#ifdef _WIN32
+    // Requests on an asynchronous WinHTTP session. Nothing blocks: each step is started from
+    // WinHTTP's status callback when the previous one completes.
+    class Engine {
+        public:
+        explicit Engine(const std::wstring& userAgent, Options options = {}) {
+            hSession = WinHttpOpen(userAgent.c_str(), WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, WINHTTP_FLAG_ASYNC);
+            if (not hSession)
+                throw std::runtime_error("Session creation failed!");
+            WinHttpSetStatusCallback(hSession, &Engine::callback, WINHTTP_CALLBACK_FLAG_ALL_COMPLETIONS | WINHTTP_CALLBACK_FLAG_HANDLES, 0);
+        }
+        Engine(const Engine&) = delete;
+        ~Engine() {
+            // Requests still running are cancelled and fail through their callbacks.
+            for (auto& [endpoint, hConnect] : connections)
+                WinHttpCloseHandle(hConnect);
+            WinHttpCloseHandle(hSession);
+        }
+
+        Future<std::string> Send(const Endpoint& endpoint, RequestSpec spec) {
+            auto operation = std::make_unique<Operation>();
+            if (spec.timeout)
+                operation->deadline = std::chrono::steady_clock::now() + *spec.timeout;
+            operation->spec = std::move(spec);
+            auto future = operation->promise.GetFuture();
+            const auto& request = operation->spec;
+
+            auto accept_types = request.accept_types.to_lpcwstr();
+            accept_types.push_back(nullptr);
+            operation->hRequest = WinHttpOpenRequest(connect(endpoint), request.verb.c_str(), request.objectName.c_str(), request.version.empty() ? NULL : request.version.c_str(),
+                request.referrer.empty() ? WINHTTP_NO_REFERER : request.referrer.c_str(), request.accept_types.empty() ? WINHTTP_DEFAULT_ACCEPT_TYPES : accept_types.data(), request.flags | (endpoint.secure ? WINHTTP_FLAG_SECURE : 0));
+            if (not operation->hRequest)
+                throw std::runtime_error("Request failed! Error code: " + std::to_string(GetLastError()));
+
+            std::wstring headers = request.headers;
+            DWORD totalLength = 0;
+            if (not request.formData.empty()) {
+                operation->encoder.emplace(request.formData);
+                operation->cursor.emplace(*operation->encoder);
+                auto boundary = operation->encoder->Boundary();
+                headers += L"Content-Type: multipart/form-data; boundary=" + std::wstring(boundary.begin(), boundary.end()) + L"\r\n";
+                totalLength = (DWORD)operation->encoder->ContentLength();
+                if (operation->encoder->ContentLength() > MAXDWORD) {
+                    headers += L"Content-Length: " + std::to_wstring(operation->encoder->ContentLength()) + L"\r\n";
+                    totalLength = WINHTTP_IGNORE_REQUEST_TOTAL_LENGTH;
+                }
+            }
+
+            if (request.decompress) {
+                DWORD flags = WINHTTP_DECOMPRESSION_FLAG_ALL;
+                WinHttpSetOption(operation->hRequest, WINHTTP_OPTION_DECOMPRESSION, &flags, sizeof(flags));
+            }
+
+            // From here on the callback owns the operation, it's deleted when its handle closes.
+            auto* raw = operation.release();
+            DWORD_PTR context = (DWORD_PTR)raw;
+            WinHttpSetOption(raw->hRequest, WINHTTP_OPTION_CONTEXT_VALUE, &context, sizeof(context));
+            if (not raw->arm())
+                return future;
+            if (not WinHttpSendRequest(raw->hRequest, headers.empty() ? WINHTTP_NO_ADDITIONAL_HEADERS : headers.c_str(), (DWORD)-1L, WINHTTP_NO_REQUEST_DATA, 0, totalLength, context))
+                raw->fail(GetLastError());
+            return future;
+        }
+
+        private:
+        struct Operation {
+            RequestSpec spec;
+            Promise<std::string> promise;
+            std::optional<std::chrono::steady_clock::time_point> deadline;
+            HINTERNET hRequest = nullptr;
+            std::optional<Multipart::Encoder> encoder;
+            std::optional<Multipart::Encoder::Cursor> cursor;
+            std::vector<char> scratch;
+            std::string_view pending;
+            std::string body;
+            std::size_t received = 0;
+            bool done = false;
+
+            // Writes the next piece of the form body, or waits for the response once it's all out.
+            void write_next() {
+                if (pending.empty() && cursor) {
+                    if (scratch.empty())
+                        scratch.resize(Multipart::ChunkSize);
+                    // A file part that can't be read, or has the boundary in it, fails the request.
+                    try {
+                        pending = cursor->Next(scratch);
+                    } catch (...) {
+                        return fail(std::current_exception());
+                    }
+                }
+                if (not arm())
+                    return;
+                if (pending.empty()) {
+                    if (not WinHttpReceiveResponse(hRequest, NULL))
+                        fail(GetLastError());
+                    return;
+                }
+                auto size = std::min<std::size_t>(pending.size(), 1u << 30);
+                auto piece = pending.substr(0, size);
+                pending.remove_prefix(size);
+                if (not WinHttpWriteData(hRequest, piece.data(), (DWORD)piece.size(), NULL))
+                    fail(GetLastError());
+            }
+            void headers_available() {
+                ULONGLONG length = 0;
+                DWORD size = sizeof(length);
+                if (WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_CONTENT_LENGTH | WINHTTP_QUERY_FLAG_NUMBER64, WINHTTP_HEADER_NAME_BY_INDEX, &length, &size, WINHTTP_NO_HEADER_INDEX))
+                    body.reserve((std::size_t)std::min<ULONGLONG>(length, Body::MaxPresize));
+                read_next();
+            }
+            // Reads straight into the body string, no intermediate buffer.
+            void read_next() {
+                if (body.size() - received < Body::ChunkSize)
+                    body.resize(std::max(body.capacity(), received + Body::ChunkSize));
+                if (not arm())
+                    return;
+                if (not WinHttpReadData(hRequest, body.data() + received, (DWORD)std::min<std::size_t>(body.size() - received, MAXDWORD), NULL))
+                    fail(GetLastError());
+            }
+            void read_complete(DWORD read) {
+                if (read == 0) {
+                    body.resize(received);
+                    done = true;
+                    promise.SetValue(std::move(body));
+                    WinHttpCloseHandle(hRequest);
+                    return;
+                }
+                received += read;
+                read_next();
+            }
+            // Limits the next step to what's left of the deadline, WinHTTP times it out then. False
+            // and failed if nothing is left.
+            bool arm() {
+                if (not deadline)
+                    return true;
+                auto left = std::chrono::ceil<std::chrono::milliseconds>(*deadline - std::chrono::steady_clock::now()).count();
+                if (left <= 0) {
+                    fail(ERROR_WINHTTP_TIMEOUT);
+                    return false;
+                }
+                auto timeout = static_cast<int>(std::min<std::int64_t>(left, INT_MAX));
+                WinHttpSetTimeouts(hRequest, timeout, timeout, timeout, timeout);
+                return true;
+            }
+            void fail(DWORD error) {
+                if (deadline && error == ERROR_WINHTTP_TIMEOUT)
+                    fail(std::make_exception_ptr(Retry::DeadlineExceeded("Request failed! The deadline passed.")));
+                else
+                    fail(std::make_exception_ptr(std::runtime_error("Request failed! Error code: " + std::to_string(error))));
+            }
+            void fail(std::exception_ptr error) {
+                if (std::exchange(done, true))
+                    return;
+                promise.SetError(error);
+                WinHttpCloseHandle(hRequest);
+            }
+        };
+
+        static void CALLBACK callback(HINTERNET, DWORD_PTR context, DWORD status, LPVOID info, DWORD infoLength) {
+            auto* operation = reinterpret_cast<Operation*>(context);
+            if (not operation)
+                return;
+            switch (status) {
+                case WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE:
+                case WINHTTP_CALLBACK_STATUS_WRITE_COMPLETE:
+                    operation->write_next();
+                    break;
+                case WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE:
+                    operation->headers_available();
+                    break;
+                case WINHTTP_CALLBACK_STATUS_READ_COMPLETE:
+                    operation->read_complete(infoLength);
+                    break;
+                case WINHTTP_CALLBACK_STATUS_REQUEST_ERROR:
+                    operation->fail(static_cast<WINHTTP_ASYNC_RESULT*>(info)->dwError);
+                    break;
+                case WINHTTP_CALLBACK_STATUS_HANDLE_CLOSING:
+                    delete operation;
+                    break;
+            }
+        }
+
+        HINTERNET connect(const Endpoint& endpoint) {
+            std::lock_guard lock(mutex);
+            auto& hConnect = connections[endpoint];
+            if (not hConnect) {
+                hConnect = WinHttpConnect(hSession, endpoint.host.c_str(), endpoint.port, 0);
+                if (not hConnect)
+                    throw std::runtime_error("Connection failed! Error code: " + std::to_string(GetLastError()));
+            }
+            return hConnect;
+        }
+
+        HINTERNET hSession = nullptr;
+        std::mutex mutex;
+        std::map<Endpoint, HINTERNET> connections;
+    };
+#else
+    // Non-blocking HTTP/1.1 on epoll. Each loop thread drives any number of requests as
+    // small state machines and keeps its own idle keep-alive connections.
+    class Engine {
+        public:
+        explicit Engine(const std::wstring& userAgent, Options options = {}) : userAgent(Util::narrow(userAgent)), options(options) {
+            for (std::size_t i = 0; i < std::max<std::size_t>(options.threads, 1); ++i)
+                loops.push_back(std::make_unique<Loop>(*this));
+        }
+        Engine(const Engine&) = delete;
+
+        Future<std::string> Send(const Endpoint& endpoint, RequestSpec spec) {
+            auto operation = std::make_unique<Operation>();
+            operation->target = &resolve(endpoint);
+            operation->port = endpoint.port;
+            if (spec.timeout)
+                operation->deadline = std::chrono::steady_clock::now() + *spec.timeout;
+            operation->spec = std::move(spec);
+            // Encoded here, so a form that can't be sent throws on the caller's thread like Send does.
+            if (not operation->spec.formData.empty())
+                operation->encoder.emplace(operation->spec.formData);
+            auto future = operation->promise.GetFuture();
+            auto& loop = *loops[next++ % loops.size()];
+            // A name the cache can't answer is looked up on the resolver's thread, not the caller's.
+            operation->addresses = dns.Cached(operation->target->name, endpoint.port);
+            if (operation->addresses)
+                loop.Submit(std::move(operation));
+            else
+                resolver.Submit(std::move(operation), loop);
+            return future;
+        }
+
+        private:
+        // An endpoint's name, and its Host header value with the port unless it's 80.
+        struct Target {
+            std::string name, host;
+        };
+
+        struct Connection {
+            explicit Connection(int fd) : fd(fd), in(4096) {}
+            Connection(const Connection&) = delete;
+            ~Connection() {
+                ::close(fd);
+            }
+            int fd;
+            std::vector<char> in;
+            std::size_t begin = 0, end = 0;
+            Http1::ResponseParser parser;
+        };
+
+        struct Operation {
+            enum class Phase { Connecting, Writing, Reading };
+            const Target* target = nullptr;
+            std::uint16_t port = 80;
+            std::optional<std::chrono::steady_clock::time_point> deadline;
+            std::shared_ptr<const Dns::Addresses> addresses;
+            RequestSpec spec;
+            Promise<std::string> promise;
+            std::unique_ptr<Connection> connection;
+            Phase phase = Phase::Writing;
+            std::string head;
+            std::optional<Multipart::Encoder> encoder;
+            std::optional<Multipart::Encoder::Cursor> cursor;
+            std::vector<char> scratch;
+            std::string_view pending;
+            std::string body;
+            std::optional<Compression::Decoder> decoder;
+            bool reused = false, retried = false, received = false, finished = false;
+        };
+
+        class Loop {
+            public:
+            explicit Loop(Engine& engine) : engine(engine) {
+                epfd = ::epoll_create1(EPOLL_CLOEXEC);
+                wakefd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if (epfd < 0 || wakefd < 0)
+                    throw std::runtime_error("Event loop creation failed!");
+                epoll_event event{};
+                event.events = EPOLLIN;
+                event.data.ptr = nullptr;
+                ::epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &event);
+                thread = std::thread([this] { run(); });
+            }
+            Loop(const Loop&) = delete;
+            ~Loop() {
+                stopping = true;
+                wake();
+                thread.join();
+                ::close(wakefd);
+                ::close(epfd);
+            }
+
+            void Submit(std::unique_ptr<Operation> operation) {
+                {
+                    std::lock_guard lock(mutex);
+                    submitted.push_back(std::move(operation));
+                }
+                wake();
+            }
+
+            private:
+            void wake() {
+                std::uint64_t one = 1;
+                [[maybe_unused]] auto written = ::write(wakefd, &one, sizeof(one));
+            }
+
+            void run() {
+                epoll_event events[64];
+                while (not stopping) {
+                    int n = ::epoll_wait(epfd, events, 64, timeout());
+                    for (int i = 0; i < n; ++i) {
+                        if (events[i].data.ptr == nullptr) {
+                            std::uint64_t count;
+                            [[maybe_unused]] auto read = ::read(wakefd, &count, sizeof(count));
+                            std::vector<std::unique_ptr<Operation>> batch;
+                            {
+                                std::lock_guard lock(mutex);
+                                batch.swap(submitted);
+                            }
+                            for (auto& operation : batch) {
+                                if (operation->deadline)
+                                    deadlines.emplace(*operation->deadline, operation.get());
+                                start(operation.release());
+                            }
+                        } else if (auto* operation = static_cast<Operation*>(events[i].data.ptr); not operation->finished) {
+                            step(operation);
+                        }
+                    }
+                    expire();
+                    // Only now, the batch may still have had events for them.
+                    finished.clear();
+                }
+                // Shutting down, fail whatever is still running.
+                std::lock_guard lock(mutex);
+                for (auto& operation : submitted)
+                    operation->promise.SetError(std::make_exception_ptr(std::runtime_error("Request failed! Engine stopped.")));
+                for (auto* operation : running) {
+                    operation->promise.SetError(std::make_exception_ptr(std::runtime_error("Request failed! Engine stopped.")));
+                    delete operation;
+                }
+                for (auto& [target, host] : hosts)
+                    for (auto* operation : host.waiting) {
+                        operation->promise.SetError(std::make_exception_ptr(std::runtime_error("Request failed! Engine stopped.")));
+                        delete operation;
+                    }
+            }
+
+            // Milliseconds to the next deadline, -1 to wait for events alone.
+            int timeout() const {
+                if (deadlines.empty())
+                    return -1;
+                auto left = std::chrono::ceil<std::chrono::milliseconds>(deadlines.begin()->first - std::chrono::steady_clock::now()).count();
+                return static_cast<int>(std::clamp<std::int64_t>(left, 0, INT_MAX));
+            }
+            // Fails the operations whose deadline passed, waiting for a connection or underway. An
+            // underway one's connection is closed, its response may be half read.
+            void expire() {
+                auto now = std::chrono::steady_clock::now();
+                while (not deadlines.empty() && deadlines.begin()->first <= now) {
+                    auto* operation = deadlines.begin()->second;
+                    auto error = std::make_exception_ptr(Retry::DeadlineExceeded("Request failed! The deadline passed."));
+                    auto& waiting = hosts[operation->target].waiting;
+                    if (auto it = std::find(waiting.begin(), waiting.end(), operation); it != waiting.end()) {
+                        waiting.erase(it);
+                        deadlines.erase(deadlines.begin());
+                        operation->finished = true;
+                        finished.emplace_back(operation);
+                        operation->promise.SetError(error);
+                    } else {
+                        finish(operation, false, error);
+                    }
+                }
+            }
+
+            void start(Operation* operation) {
+                auto& host = hosts[operation->target];
+                if (host.idle.empty() && host.open >= engine.options.maxPerHost) {
+                    host.waiting.push_back(operation);
+                    return;
+                }
+                running.push_back(operation);
+                while (not host.idle.empty()) {
+                    auto connection = std::move(host.idle.back());
+                    host.idle.pop_back();
+                    // A live idle connection has nothing to read yet.
+                    char probe;
+                    if (::recv(connection->fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN) {
+                        operation->connection = std::move(connection);
+                        operation->reused = true;
+                        begin_request(operation, EPOLL_CTL_ADD);
+                        return;
+                    }
+                    --host.open;
+                }
+                ++host.open;
+                connect(operation);
+            }
+
+            void connect(Operation* operation) {
+                for (const auto& address : *operation->addresses) {
+                    int fd = ::socket(address.storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                    if (fd < 0)
+                        continue;
+                    int one = 1;
+                    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    if (::connect(fd, address.Get(), address.length) == 0 || errno == EINPROGRESS) {
+                        operation->connection = std::make_unique<Connection>(fd);
+                        operation->phase = Operation::Phase::Connecting;
+                        watch(operation, EPOLL_CTL_ADD, EPOLLOUT);
+                        return;
+                    }
+                    ::close(fd);
+                }
+                finish(operation, false);
+            }
+
+            void begin_request(Operation* operation, int op) {
+                operation->phase = Operation::Phase::Writing;
+                operation->received = false;
+                operation->body.clear();
+                operation->decoder.reset();
+                operation->cursor.reset();
+                if (operation->encoder)
+                    operation->cursor.emplace(*operation->encoder);
+                operation->head.clear();
+                Http1::RequestHead(operation->head, operation->spec, operation->target->host, engine.userAgent, operation->encoder ? &*operation->encoder : nullptr);
+                operation->pending = operation->head;
+                operation->connection->parser.Reset(operation->spec.verb == L"HEAD");
+                watch(operation, op, EPOLLOUT);
+                step(operation);
+            }
+
+            void watch(Operation* operation, int op, std::uint32_t events) {
+                epoll_event event{};
+                event.events = events;
+                event.data.ptr = operation;
+                ::epoll_ctl(epfd, op, operation->connection->fd, &event);
+            }
+
+            void step(Operation* operation) {
+                auto& connection = *operation->connection;
+                switch (operation->phase) {
+                    case Operation::Phase::Connecting: {
+                        int error = 0;
+                        socklen_t length = sizeof(error);
+                        ::getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                        if (error != 0)
+                            return retry_or_fail(operation);
+                        return begin_request(operation, EPOLL_CTL_MOD);
+                    }
+                    case Operation::Phase::Writing:
+                        while (true) {
+                            if (operation->pending.empty() && operation->cursor) {
+                                if (operation->scratch.empty())
+                                    operation->scratch.resize(Multipart::ChunkSize);
+                                // A file part that can't be read, or has the boundary in it, fails the request.
+                                try {
+                                    operation->pending = operation->cursor->Next(operation->scratch);
+                                } catch (...) {
+                                    return finish(operation, false, std::current_exception());
+                                }
+                            }
+                            if (operation->pending.empty())
+                                break;
+                            auto sent = ::send(connection.fd, operation->pending.data(), operation->pending.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                            if (sent < 0) {
+                                if (errno == EAGAIN || errno == EINTR)
+                                    return;
+                                return retry_or_fail(operation);
+                            }
+                            operation->pending.remove_prefix(static_cast<std::size_t>(sent));
+                        }
+                        operation->phase = Operation::Phase::Reading;
+                        watch(operation, EPOLL_CTL_MOD, EPOLLIN);
+                        [[fallthrough]];
+                    case Operation::Phase::Reading:
+                        read(operation);
+                        return;
+                }
+            }
+
+            void read(Operation* operation) {
+                using Event = Http1::ResponseParser::Event;
+                auto& connection = *operation->connection;
+                while (true) {
+                    std::string_view input(connection.in.data() + connection.begin, connection.end - connection.begin), piece;
+                    auto event = connection.parser.Parse(input, piece);
+                    connection.begin = connection.end - input.size();
+                    switch (event) {
+                        case Event::Headers:
+                            if (auto length = connection.parser.ContentLength())
+                                operation->body.reserve(static_cast<std::size_t>(std::min<std::uint64_t>(*length, Body::MaxPresize)));
+                            if (operation->spec.decompress && not connection.parser.Complete()) {
+                                auto encoding = Compression::Parse(Util::find_header(connection.parser.Head(), "Content-Encoding").value_or(""));
+                                if (encoding && *encoding != Compression::Encoding::Identity)
+                                    operation->decoder.emplace(*encoding);
+                            }
+                            continue;
+                        case Event::Body:
+                            if (not operation->decoder) {
+                                operation->body.append(piece);
+                                continue;
+                            }
+                            // Decoded through the scratch buffer, the form body is out by now.
+                            if (operation->scratch.empty())
+                                operation->scratch.resize(Multipart::ChunkSize);
+                            if (not operation->decoder->Feed(piece, operation->scratch, [&](std::string_view chunk) {
+                                operation->body.append(chunk);
+                                return true;
+                            }))
+                                return finish(operation, false);
+                            continue;
+                        case Event::Done:
+                            return finish(operation, not operation->decoder || operation->decoder->Done());
+                        case Event::Error:
+                            return finish(operation, false);
+                        case Event::NeedMore:
+                            break;
+                    }
+                    if (connection.begin == connection.end)
+                        connection.begin = connection.end = 0;
+                    if (connection.end == connection.in.size()) {
+                        if (connection.begin > 0) {
+                            std::memmove(connection.in.data(), connection.in.data() + connection.begin, connection.end - connection.begin);
+                            connection.end -= connection.begin;
+                            connection.begin = 0;
+                        } else {
+                            connection.in.resize(connection.in.size() * 2);
+                        }
+                    }
+                    auto got = ::recv(connection.fd, connection.in.data() + connection.end, connection.in.size() - connection.end, MSG_DONTWAIT);
+                    if (got < 0) {
+                        if (errno == EAGAIN || errno == EINTR)
+                            return;
+                        return retry_or_fail(operation);
+                    }
+                    if (got == 0) {
+                        if (not operation->received)
+                            return retry_or_fail(operation);
+                        return finish(operation, connection.parser.Finish() == Event::Done && (not operation->decoder || operation->decoder->Done()));
+                    }
+                    operation->received = true;
+                    connection.end += static_cast<std::size_t>(got);
+                }
+            }
+
+            // A reused connection the server closed in the meantime gets one retry on a new one.
+            void retry_or_fail(Operation* operation) {
+                if (operation->reused && not operation->received && not operation->retried) {
+                    operation->retried = true;
+                    operation->reused = false;
+                    ::epoll_ctl(epfd, EPOLL_CTL_DEL, operation->connection->fd, nullptr);
+                    operation->connection.reset();
+                    return connect(operation);
+                }
+                finish(operation, false);
+            }
+
+            // Completes the operation and hands its connection slot to the next waiting request, if any.
+            // A failure without error of its own is a plain "Request failed!".
+            void finish(Operation* operation, bool ok, std::exception_ptr error = {}) {
+                running.erase(std::find(running.begin(), running.end(), operation));
+                if (operation->deadline)
+                    deadlines.erase({*operation->deadline, operation});
+                operation->finished = true;
+                finished.emplace_back(operation);
+                auto& host = hosts[operation->target];
+                auto& connection = operation->connection;
+                if (connection)
+                    ::epoll_ctl(epfd, EPOLL_CTL_DEL, connection->fd, nullptr);
+                if (connection && ok && connection->parser.KeepAlive() && connection->begin == connection->end)
+                    host.idle.push_back(std::move(connection));
+                else
+                    --host.open;
+                if (ok)
+                    operation->promise.SetValue(std::move(operation->body));
+                else
+                    operation->promise.SetError(error ? error : std::make_exception_ptr(std::runtime_error("Request failed!")));
+                if (not host.waiting.empty()) {
+                    auto* next = host.waiting.front();
+                    host.waiting.pop_front();
+                    start(next);
+                }
+            }
+
+            Engine& engine;
+            int epfd = -1, wakefd = -1;
+            std::atomic<bool> stopping{false};
+            std::mutex mutex;
+            std::vector<std::unique_ptr<Operation>> submitted;
+            std::vector<Operation*> running;
+            std::vector<std::unique_ptr<Operation>> finished;
+            // Operations with a deadline, the next one first.
+            std::set<std::pair<std::chrono::steady_clock::time_point, Operation*>> deadlines;
+            struct Host {
+                std::vector<std::unique_ptr<Connection>> idle;
+                std::deque<Operation*> waiting;
+                std::size_t open = 0;
+            };
+            std::map<const Target*, Host> hosts;
+            std::thread thread;
+        };
+
+        // Looks names up for Send one at a time on a thread of its own, started on first use, and hands
+        // the operations on to their loops. A failed lookup fails the operation's future.
+        class Resolver {
+            public:
+            explicit Resolver(Engine& engine) : engine(engine) {}
+            Resolver(const Resolver&) = delete;
+            ~Resolver() {
+                {
+                    std::lock_guard lock(mutex);
+                    stopping = true;
+                }
+                wakeup.notify_one();
+                if (thread.joinable())
+                    thread.join();
+                for (auto& [operation, loop] : queue)
+                    operation->promise.SetError(std::make_exception_ptr(std::runtime_error("Request failed! Engine stopped.")));
+            }
+
+            void Submit(std::unique_ptr<Operation> operation, Loop& loop) {
+                {
+                    std::lock_guard lock(mutex);
+                    if (not thread.joinable())
+                        thread = std::thread([this] { run(); });
+                    queue.emplace_back(std::move(operation), &loop);
+                }
+                wakeup.notify_one();
+            }
+
+            private:
+            void run() {
+                std::unique_lock lock(mutex);
+                while (true) {
+                    wakeup.wait(lock, [&] { return stopping || not queue.empty(); });
+                    if (stopping)
+                        return;
+                    auto [operation, loop] = std::move(queue.front());
+                    queue.pop_front();
+                    lock.unlock();
+                    try {
+                        operation->addresses = engine.dns.Resolve(operation->target->name, operation->port);
+                        loop->Submit(std::move(operation));
+                    } catch (...) {
+                        operation->promise.SetError(std::current_exception());
+                    }
+                    lock.lock();
+                }
+            }
+
+            Engine& engine;
+            std::mutex mutex;
+            std::condition_variable wakeup;
+            std::deque<std::pair<std::unique_ptr<Operation>, Loop*>> queue;
+            bool stopping = false;
+            std::thread thread;
+        };
+
+        const Target& resolve(const Endpoint& endpoint) {
+            std::lock_guard lock(mutex);
+            if (endpoint.secure)
+                throw std::runtime_error("HTTPS is not supported by the POSIX transport.");
+            auto [it, inserted] = targets.try_emplace(endpoint);
+            auto& target = it->second;
+            if (inserted) {
+                target.name = target.host = Util::narrow(endpoint.host);
+                if (endpoint.port != 80)
+                    target.host += ':' + std::to_string(endpoint.port);
+            }
+            return target;
+        }
+
+        std::string userAgent;
+        Options options;
+        Dns::Cache dns;
+        std::mutex mutex;
+        std::map<Endpoint, Target> targets;
+        std::vector<std::unique_ptr<Loop>> loops;
+        std::atomic<std::size_t> next{0};
+        // Destroyed first, a lookup it finishes still goes to a loop.
+        Resolver resolver{*this};
+    };
+#endif
+}
+
+namespace WinHTTP::Cache {
+    // Wall clock, so expiry times stay meaningful in a store that outlives the process.
+    using Clock = std::chrono::system_clock;
+
+    // What's kept about a response besides its body.
+    struct Metadata {
+        std::string etag, lastModified;
+        // Served without asking the server until then.
+        Clock::time_point expires;
+
+        bool Fresh(Clock::time_point now) const {
+            return now < expires;
+        }
+        // Something to revalidate with once it's stale.
+        bool Validators() const {
+            return not etag.empty() || not lastModified.empty();
+        }
+    };
+
+    // A stored 200 response. The body lives as long as the entry, wherever the store keeps it.
+    struct Entry {
+        Metadata metadata;
+        std::string_view body;
+        std::shared_ptr<const void> storage;
+    };
+
+    // Only plain GETs are cached.
+    inline bool Cacheable(const RequestSpec& spec) {
+        return spec.verb == L"GET" && spec.formData.empty();
+    }
+
+    // The URL plus everything else in the request that can change the response.
+    inline std::string Key(const Endpoint& endpoint, const RequestSpec& spec) {
+        std::string key = endpoint.secure ? "https://" : "http://";
+        Util::append_narrow(key, endpoint.host);
+        key += ':';
+        Util::append_number(key, endpoint.port);
+        if (spec.objectName.empty() || spec.objectName.front() != L'/')
+            key += '/';
+        Util::append_narrow(key, spec.objectName);
+        for (const auto& type : spec.accept_types) {
+            key += "\nAccept: ";
+            Util::append_narrow(key, type);
+        }
+        if (not spec.headers.empty()) {
+            key += '\n';
+            Util::append_narrow(key, spec.headers);
+        }
+        if (spec.decompress)
+            key += "\nDecompress";
+        return key;
+    }
+
+    // Reads the caching headers of a response, header(name) returns the value of one.
+    // previous is the entry a 304 revalidated, its validators carry over unless the server sent new ones.
+    // Empty if the response mustn't be stored, or storing it would be no use.
+    template<typename Header_>
+    std::optional<Metadata> Describe(Header_&& header, Clock::time_point now, const Metadata* previous = nullptr) {
+        Metadata metadata;
+        if (previous)
+            metadata = *previous;
+        std::int64_t maxAge = 0;
+        // no-cache wins over any max-age, but the rest is still read for a no-store.
+        bool noCache = false;
+        if (auto control = header("Cache-Control")) {
+            auto directives = *control;
+            while (not directives.empty()) {
+                auto comma = directives.find(',');
+                auto directive = directives.substr(0, comma);
+                directives.remove_prefix(comma == std::string_view::npos ? directives.size() : comma + 1);
+                while (not directive.empty() && directive.front() == ' ')
+                    directive.remove_prefix(1);
+                while (not directive.empty() && directive.back() == ' ')
+                    directive.remove_suffix(1);
+                if (Util::iequals(directive, "no-store"))
+                    return {};
+                if (Util::iequals(directive, "no-cache")) {
+                    noCache = true;
+                    maxAge = -1;
+                }
+                if (not noCache && directive.size() > 8 && Util::iequals(directive.substr(0, 8), "max-age="))
+                    std::from_chars(directive.data() + 8, directive.data() + directive.size(), maxAge);
+            }
+        }
+        if (maxAge > 0) {
+            // Age is how long the response already sat in caches on the way.
+            std::int64_t age = 0;
+            if (auto value = header("Age"))
+                std::from_chars(value->data(), value->data() + value->size(), age);
+            maxAge = std::max<std::int64_t>(maxAge - age, 0);
+        }
+        if (auto vary = header("Vary"); vary && *vary == "*")
+            return {};
+        if (auto etag = header("ETag"))
+            metadata.etag = *etag;
+        if (auto lastModified = header("Last-Modified"))
+            metadata.lastModified = *lastModified;
+        metadata.expires = now + std::chrono::seconds(std::max<std::int64_t>(maxAge, 0));
+        if (maxAge <= 0 && not metadata.Validators())
+            return {};
+        return metadata;
+    }
+
+    // Where responses are kept. Implementations must be thread safe, a client calls them from
+    // every thread it's used on. The counters are kept here, so clients sharing a store add up.
+    class Store {
+        public:
+        enum class Outcome {
+            Hit,         // Fresh, no request made
+            Revalidated, // Stale, the server answered 304
+            Miss         // The body was downloaded
+        };
+
+        virtual ~Store() = default;
+        virtual std::shared_ptr<const Entry> Find(const std::string& key) = 0;
+        virtual void Put(const std::string& key, Metadata metadata, std::string body) = 0;
+        // A 304 confirmed the stored body, only its metadata changes.
+        virtual void Update(const std::string& key, const Metadata& metadata) = 0;
+        virtual void Remove(const std::string& key) = 0;
+        // Bodies bigger than this aren't kept, so they aren't copied while they're received either.
+        virtual std::size_t MaxEntrySize() const = 0;
+
+        void Count(Outcome outcome, std::uint64_t bytesSaved = 0) {
+            (outcome == Outcome::Hit ? hits : outcome == Outcome::Revalidated ? revalidated : misses).fetch_add(1, std::memory_order_relaxed);
+            saved.fetch_add(bytesSaved, std::memory_order_relaxed);
+        }
+        std::uint64_t Hits() const {
+            return hits;
+        }
+        std::uint64_t Revalidated() const {
+            return revalidated;
+        }
+        std::uint64_t Misses() const {
+            return misses;
+        }
+        // Body bytes served from the store instead of the network.
+        std::uint64_t BytesSaved() const {
+            return saved;
+        }
+        // Share of cacheable requests that didn't download the body, hits and 304s alike.
+        double HitRatio() const {
+            auto served = hits + revalidated;
+            auto total = served + misses;
+            return total ? static_cast<double>(served) / static_cast<double>(total) : 0.0;
+        }
+
+        private:
+        std::atomic<std::uint64_t> hits{0}, revalidated{0}, misses{0}, saved{0};
+    };
+
+    // In-memory store, least recently used entries go first once the bodies add up to maxBytes.
+    class MemoryStore : public Store {
+        public:
+        explicit MemoryStore(std::size_t maxBytes) : maxBytes(maxBytes) {}
+
+        std::shared_ptr<const Entry> Find(const std::string& key) override {
+            std::lock_guard lock(mutex);
+            auto it = index.find(key);
+            if (it == index.end())
+                return nullptr;
+            entries.splice(entries.begin(), entries, it->second);
+            return it->second->entry;
+        }
+        void Put(const std::string& key, Metadata metadata, std::string body) override {
+            if (body.size() > maxBytes)
+                return;
+            auto storage = std::make_shared<const std::string>(std::move(body));
+            auto entry = std::make_shared<const Entry>(Entry{std::move(metadata), *storage, storage});
+            std::lock_guard lock(mutex);
+            erase(key);
+            entries.push_front({key, entry});
+            index.emplace(key, entries.begin());
+            size += entry->body.size();
+            while (size > maxBytes)
+                erase(entries.back().key);
+        }
+        void Update(const std::string& key, const Metadata& metadata) override {
+            std::lock_guard lock(mutex);
+            auto it = index.find(key);
+            if (it == index.end())
+                return;
+            auto& old = it->second->entry;
+            old = std::make_shared<const Entry>(Entry{metadata, old->body, old->storage});
+        }
+        void Remove(const std::string& key) override {
+            std::lock_guard lock(mutex);
+            erase(key);
+        }
+        std::size_t MaxEntrySize() const override {
+            return maxBytes;
+        }
+        // Body bytes held right now.
+        std::size_t Size() const {
+            std::lock_guard lock(mutex);
+            return size;
+        }
+
+        private:
+        struct Node {
+            std::string key;
+            std::shared_ptr<const Entry> entry;
+        };
+        void erase(const std::string& key) {
+            auto it = index.find(key);
+            if (it == index.end())
+                return;
+            size -= it->second->entry->body.size();
+            entries.erase(it->second);
+            index.erase(it);
+        }
+
+        std::size_t maxBytes, size = 0;
+        mutable std::mutex mutex;
+        std::list<Node> entries; // Most recently used first
+        std::unordered_map<std::string, std::list<Node>::iterator> index;
+    };
+
+    // Read only view of a whole file, mapped into memory.
+    class MappedFile {
+        public:
+        // Maps the file at path, empty if it's missing, empty or can't be mapped.
+        static std::optional<MappedFile> Open(const std::filesystem::path& path) {
+            MappedFile mapped;
+#ifdef _WIN32
+            mapped.file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            LARGE_INTEGER fileSize{};
+            if (mapped.file == INVALID_HANDLE_VALUE || not GetFileSizeEx(mapped.file, &fileSize) || fileSize.QuadPart == 0)
+                return {};
+            mapped.mapping = CreateFileMappingW(mapped.file, NULL, PAGE_READONLY, 0, 0, NULL);
+            mapped.data = mapped.mapping ? MapViewOfFile(mapped.mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+            mapped.size = (std::size_t)fileSize.QuadPart;
+#else
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat info{};
+            if (fd < 0 || ::fstat(fd, &info) != 0 || info.st_size == 0) {
+                if (fd >= 0)
+                    ::close(fd);
+                return {};
+            }
+            mapped.size = static_cast<std::size_t>(info.st_size);
+            mapped.data = ::mmap(nullptr, mapped.size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (mapped.data == MAP_FAILED)
+                mapped.data = nullptr;
+#endif
+            if (not mapped.data)
+                return {};
+            return mapped;
+        }
+        MappedFile(MappedFile&& other) noexcept : data(std::exchange(other.data, nullptr)), size(other.size) {
+#ifdef _WIN32
+            file = std::exchange(other.file, INVALID_HANDLE_VALUE);
+            mapping = std::exchange(other.mapping, nullptr);
+#endif
+        }
+        MappedFile(const MappedFile&) = delete;
+        ~MappedFile() {
+            close();
+        }
+        std::string_view View() const {
+            return {static_cast<const char*>(data), size};
+        }
+
+        private:
+        MappedFile() = default;
+        void close() {
+#ifdef _WIN32
+            if (data)
+                UnmapViewOfFile(data);
+            if (mapping)
+                CloseHandle(mapping);
+            if (file != INVALID_HANDLE_VALUE)
+                CloseHandle(file);
+            file = INVALID_HANDLE_VALUE;
+            mapping = nullptr;
+#else
+            if (data)
+                ::munmap(data, size);
+#endif
+            data = nullptr;
+        }
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#endif
+        void* data = nullptr;
+        std::size_t size = 0;
+    };
+
+    // Keeps responses as files in directory, one per key, so they outlive the process.
+    // Bodies are served straight from a memory mapping of the file. Past maxBytes, the files
+    // used longest ago are deleted. Several processes may share the directory.
+    class DiskStore : public Store {
+        public:
+        DiskStore(std::filesystem::path directory, std::uint64_t maxBytes) : directory(std::move(directory)), maxBytes(maxBytes) {
+            std::filesystem::create_directories(this->directory);
+            for (const auto& file : std::filesystem::directory_iterator(this->directory)) {
+                if (not file.is_regular_file())
+                    continue;
+                // Left over by a write that never finished, nothing will rename it into place.
+                if (file.path().extension().string().starts_with(".tmp")) {
+                    std::error_code ignored;
+                    std::filesystem::remove(file.path(), ignored);
+                    continue;
+                }
+                size += file.file_size();
+            }
+        }
+
+        std::shared_ptr<const Entry> Find(const std::string& key) override {
+            auto path = path_of(key);
+            auto mapped = MappedFile::Open(path);
+            if (not mapped)
+                return nullptr;
+            auto file = std::make_shared<MappedFile>(std::move(*mapped));
+            auto entry = parse(file->View(), key);
+            if (not entry)
+                return nullptr;
+            entry->storage = file;
+            // The modification time doubles as the last use, for eviction.
+            std::error_code ignored;
+            std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ignored);
+            return std::make_shared<const Entry>(std::move(*entry));
+        }
+        void Put(const std::string& key, Metadata metadata, std::string body) override {
+            if (body.size() > maxBytes)
+                return;
+            write(key, metadata, body);
+        }
+        void Update(const std::string& key, const Metadata& metadata) override {
+            // The body is copied and the mapping let go first, Windows won't replace a mapped file.
+            auto entry = Find(key);
+            if (not entry)
+                return;
+            std::string body(entry->body);
+            entry.reset();
+            write(key, metadata, body);
+        }
+        void Remove(const std::string& key) override {
+            std::error_code ignored;
+            auto path = path_of(key);
+            std::lock_guard lock(mutex);
+            auto removed = std::filesystem::file_size(path, ignored);
+            if (std::filesystem::remove(path, ignored))
+                size -= std::min<std::uint64_t>(size, removed);
+        }
+        std::size_t MaxEntrySize() const override {
+            return static_cast<std::size_t>(std::min<std::uint64_t>(maxBytes, SIZE_MAX));
+        }
+
+        private:
+        // File layout: magic, then key, etag and last-modified each as a u32 length and the bytes,
+        // expiry as i64 seconds since the epoch, the u64 body size and the body. Native byte order.
+        static constexpr std::string_view Magic = "WHC1";
+
+        std::filesystem::path path_of(const std::string& key) const {
+            // FNV-1a, stable across runs unlike std::hash.
+            std::uint64_t hash = 14695981039346656037ull;
+            for (unsigned char c : key)
+                hash = (hash ^ c) * 1099511628211ull;
+            char name[17];
+            std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+            return directory / name;
+        }
+        static std::optional<Entry> parse(std::string_view file, const std::string& key) {
+            auto take = [&](std::size_t n) -> std::optional<std::string_view> {
+                if (file.size() < n)
+                    return {};
+                auto part = file.substr(0, n);
+                file.remove_prefix(n);
+                return part;
+            };
+            auto number = [&]<typename T_>(T_ value) -> std::optional<T_> {
+                auto bytes = take(sizeof(T_));
+                if (not bytes)
+                    return {};
+                std::memcpy(&value, bytes->data(), sizeof(T_));
+                return value;
+            };
+            auto text = [&]() -> std::optional<std::string_view> {
+                auto length = number(std::uint32_t{});
+                return length ? take(*length) : std::nullopt;
+            };
+            if (take(Magic.size()) != Magic)
+                return {};
+            auto storedKey = text();
+            auto etag = text();
+            auto lastModified = text();
+            auto expires = number(std::int64_t{});
+            auto bodySize = number(std::uint64_t{});
+            // Another key with the same hash, or a file cut short.
+            if (not storedKey || *storedKey != key || not etag || not lastModified || not expires || not bodySize || file.size() != *bodySize)
+                return {};
+            Entry entry;
+            entry.metadata.etag = *etag;
+            entry.metadata.lastModified = *lastModified;
+            entry.metadata.expires = Clock::time_point(std::chrono::seconds(*expires));
+            entry.body = file;
+            return entry;
+        }
+        void write(const std::string& key, const Metadata& metadata, std::string_view body) {
+            auto path = path_of(key);
+            // Written aside and renamed over, readers never see half a file.
+            auto temporary = path;
+            temporary += ".tmp" + std::to_string(sequence++);
+            {
+                std::ofstream out(temporary, std::ios::binary);
+                auto text = [&](std::string_view value) {
+                    auto length = static_cast<std::uint32_t>(value.size());
+                    out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+                    out.write(value.data(), static_cast<std::streamsize>(value.size()));
+                };
+                std::int64_t expires = std::chrono::duration_cast<std::chrono::seconds>(metadata.expires.time_since_epoch()).count();
+                std::uint64_t bodySize = body.size();
+                out.write(Magic.data(), static_cast<std::streamsize>(Magic.size()));
+                text(key);
+                text(metadata.etag);
+                text(metadata.lastModified);
+                out.write(reinterpret_cast<const char*>(&expires), sizeof(expires));
+                out.write(reinterpret_cast<const char*>(&bodySize), sizeof(bodySize));
+                out.write(body.data(), static_cast<std::streamsize>(body.size()));
+                if (not out) {
+                    out.close();
+                    std::error_code ignored;
+                    std::filesystem::remove(temporary, ignored);
+                    return;
+                }
+            }
+            std::error_code error;
+            auto written = std::filesystem::file_size(temporary, error);
+            if (error) {
+                std::filesystem::remove(temporary, error);
+                return;
+            }
+            // What's replaced is sized and the size kept up to date under the lock, so a write
+            // of the same key in between doesn't get counted twice.
+            std::lock_guard lock(mutex);
+            auto replaced = std::filesystem::file_size(path, error);
+            if (error)
+                replaced = 0;
+            std::filesystem::rename(temporary, path, error);
+            if (error && replaced) {
+                // Windows won't rename over a file a reader still has mapped, but lets that file be
+                // renamed. It's moved aside and deleted, or left for the next DiskStore to delete.
+                auto aside = path;
+                aside += ".tmp" + std::to_string(sequence++);
+                std::error_code moved;
+                std::filesystem::rename(path, aside, moved);
+                if (not moved) {
+                    std::filesystem::remove(aside, moved);
+                    size -= std::min<std::uint64_t>(size, replaced);
+                    replaced = 0;
+                    std::filesystem::rename(temporary, path, error);
+                }
+            }
+            if (error) {
+                std::filesystem::remove(temporary, error);
+                return;
+            }
+            size += written;
+            size -= std::min<std::uint64_t>(size, replaced);
+            if (size > maxBytes)
+                evict();
+        }
+        // Deletes the least recently used files until the directory fits maxBytes again. Under mutex.
+        void evict() {
+            struct File {
+                std::filesystem::path path;
+                std::filesystem::file_time_type used;
+                std::uint64_t size;
+            };
+            std::vector<File> files;
+            std::uint64_t total = 0;
+            std::error_code error;
+            for (const auto& file : std::filesystem::directory_iterator(directory, error)) {
+                if (not file.is_regular_file(error) || file.path().extension().string().starts_with(".tmp"))
+                    continue;
+                files.push_back({file.path(), file.last_write_time(error), file.file_size(error)});
+                total += files.back().size;
+            }
+            std::sort(files.begin(), files.end(), [](const File& a, const File& b) {
+                return a.used < b.used;
             });
+            for (const auto& file : files) {
+                if (total <= maxBytes)
+                    break;
+                if (std::filesystem::remove(file.path, error))
+                    total -= file.size;
+            }
+            size = total;
         }
-        template<typename Ret_>
-        Ret_ if_request_available(const std::function<Ret_()>& _if, const std::function<Ret_()>& _else = {}) {
-            return if_connection_available<Ret_>([&]() -> Ret_ {
-                if(not RequestAvailable()) {
-                    SetError(Error::RequestNotAvailable);
-                    if(_else)
-                        return _else();
-                    return Ret_{};
+
+        std::filesystem::path directory;
+        std::uint64_t maxBytes;
+        std::atomic<std::uint64_t> sequence{0};
+        std::mutex mutex;
+        // Bytes in the directory, under mutex.
+        std::uint64_t size = 0;
+    };
+}
+
+namespace WinHTTP::Coalescing {
+    struct Options {
+        // Header fields that tell identical requests apart, case insensitive. The others, like a
+        // request id, are sent as the first caller gave them. Empty compares all of them.
+        std::vector<std::string> headers;
+    };
+
+    // Only plain GETs are coalesced.
+    inline bool Coalescable(const RequestSpec& spec) {
+        return spec.verb == L"GET" && spec.formData.empty();
+    }
+
+    // Cache::Key of the request with only the selected header fields.
+    inline std::string Key(const Endpoint& endpoint, const RequestSpec& spec, const Options& options) {
+        if (options.headers.empty() || spec.headers.empty())
+            return Cache::Key(endpoint, spec);
+        auto selected = spec;
+        selected.headers.clear();
+        std::wstring_view fields = spec.headers;
+        while (not fields.empty()) {
+            auto end = fields.find(L"\r\n");
+            auto line = fields.substr(0, end);
+            fields.remove_prefix(end == std::wstring_view::npos ? fields.size() : end + 2);
+            auto name = Util::narrow(line.substr(0, line.find(L':')));
+            for (const auto& wanted : options.headers) {
+                if (Util::iequals(name, wanted)) {
+                    selected.headers.append(line).append(L"\r\n");
+                    break;
                 }
-                return _if();
-            }); 
+            }
         }
-        template<>
-        void if_session_available<void>(const std::function<void()>& _if, const std::function<void()>& _else) {
-            if(not SessionAvailable()) {
-                SetError(Error::SessionNotAvailable);
-                if(_else)
-                    _else();
-                return; 
+        return Cache::Key(endpoint, selected);
+    }
+
+    // The outcome of one upstream request, shared by every caller that asked for it while it ran.
+    struct Flight {
+        std::latch done{1};
+        int status = 0;
+        // Status line and headers as received, and the protocol they came over. Empty for a body from the cache.
+        std::string head;
+        std::optional<Protocol> protocol;
+        std::string body;
+        std::exception_ptr error;
+    };
+
+    // The requests in flight by key. The first caller of a key sends it, the ones arriving before
+    // it's answered wait for its response instead of sending their own.
+    class Group {
+        public:
+        explicit Group(Options options) : options(std::move(options)) {}
+
+        // Runs send(flight) to fill in the flight unless an identical request is already running,
+        // then waits for that one. Rethrows what the sending caller failed with.
+        template<typename Send_>
+        std::shared_ptr<const Flight> Join(const Endpoint& endpoint, const RequestSpec& spec, Send_&& send) {
+            auto key = Key(endpoint, spec, options);
+            std::shared_ptr<Flight> flight;
+            bool leading = false;
+            {
+                std::lock_guard lock(mutex);
+                auto& running = flights[key];
+                if (not running) {
+                    running = std::make_shared<Flight>();
+                    leading = true;
+                }
+                flight = running;
+            }
+            if (leading) {
+                try {
+                    send(*flight);
+                } catch (...) {
+                    flight->error = std::current_exception();
+                }
+                {
+                    // Callers from now on send again, the response may have changed since.
+                    std::lock_guard lock(mutex);
+                    flights.erase(key);
+                }
+                sent.fetch_add(1, std::memory_order_relaxed);
+                flight->done.count_down();
+            } else {
+                shared.fetch_add(1, std::memory_order_relaxed);
+                flight->done.wait();
             }
-            _if();
+            if (flight->error)
+                std::rethrow_exception(flight->error);
+            return flight;
         }
-        template<>
-        void if_connection_available<void>(const std::function<void()>& _if, const std::function<void()>& _else) {
-            if_session_available<void>([&]() -> void {
-                if(not ConnectionAvailable()) {
-                    SetError(Error::ConnectionNotAvailable);
-                    if(_else)
-                        _else();
-                    return; 
+
+        // Requests that went upstream.
+        std::uint64_t Sent() const {
+            return sent;
+        }
+        // Callers answered with another caller's response.
+        std::uint64_t Shared() const {
+            return shared;
+        }
+
+        private:
+        Options options;
+        std::mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<Flight>> flights;
+        std::atomic<std::uint64_t> sent{0}, shared{0};
+    };
+}
+
+namespace WinHTTP::Admission {
+    struct Options {
+        // Requests in flight per server to start with, and the range the limit moves in.
+        std::size_t initial = 8, min = 1, max = 256;
+        // Responses slower than tolerance times the fastest recent one, on average, mean overload like a 429 or 503.
+        double tolerance = 2.0;
+        // The limit is multiplied by it on overload, at most once per round trip.
+        double backoff = 0.75;
+        // Responses after which the fastest latency is taken anew. It rises by a tenth per window at most,
+        // so a backend that slows down under load doesn't become the new normal.
+        std::size_t window = 200;
+        // How long a request waits for its turn unless it says otherwise, zero fails fast.
+        std::chrono::milliseconds wait{1000};
+    };
+
+    // Thrown when a request isn't admitted in time. Nothing was sent.
+    class Rejected : public std::runtime_error {
+        public:
+        using std::runtime_error::runtime_error;
+    };
+
+    // Adaptive limit of the requests in flight to one server, AIMD: it grows by one per limit's worth
+    // of good responses and shrinks by backoff on a 429, a 503 or a response much slower than usual.
+    // Tokens are taken and given back without locking, only a request that has to wait locks.
+    class Limit {
+        public:
+        explicit Limit(const Options& options) : options(options), limit(static_cast<std::int64_t>(std::clamp(options.initial, options.min, options.max)) * Scale) {}
+
+        // Takes a token if one is free.
+        bool TryAcquire() {
+            auto current = inflight.load();
+            while (current < Current())
+                if (inflight.compare_exchange_weak(current, current + 1))
+                    return true;
+            return false;
+        }
+        // Waits up to wait for a token. False if none came free in time. Waiting requests are
+        // handed tokens in the order they came, later ones can't take them first.
+        bool Acquire(std::chrono::milliseconds wait) {
+            if (waiting.load() == 0 && TryAcquire())
+                return true;
+            if (wait <= std::chrono::milliseconds::zero())
+                return false;
+            auto deadline = std::chrono::steady_clock::now() + wait;
+            Waiter waiter;
+            std::unique_lock lock(mutex);
+            queue.push_back(&waiter);
+            waiting = queue.size();
+            // A token given back before we were queued wasn't handed to anyone.
+            hand_out();
+            waiter.turn.wait_until(lock, deadline, [&] { return waiter.admitted; });
+            if (not waiter.admitted) {
+                queue.erase(std::find(queue.begin(), queue.end(), &waiter));
+                waiting = queue.size();
+            }
+            return waiter.admitted;
+        }
+        // Gives a token back. latency is how long the server took to answer, empty if it didn't.
+        void Release(std::optional<std::chrono::nanoseconds> latency = {}, bool overloaded = false) {
+            inflight.fetch_sub(1);
+            if (latency)
+                adapt(latency->count(), overloaded);
+            if (waiting.load() > 0) {
+                std::lock_guard lock(mutex);
+                hand_out();
+            }
+        }
+
+        // Requests that may be in flight now.
+        std::int64_t Current() const {
+            return limit.load(std::memory_order_relaxed) / Scale;
+        }
+        std::int64_t InFlight() const {
+            return inflight.load(std::memory_order_relaxed);
+        }
+
+        private:
+        // The limit moves in fractions of a request.
+        static constexpr std::int64_t Scale = 1024;
+
+        struct Waiter {
+            std::condition_variable turn;
+            bool admitted = false;
+        };
+
+        // Takes free tokens for the longest waiting requests. Called with the mutex held.
+        void hand_out() {
+            while (not queue.empty() && TryAcquire()) {
+                queue.front()->admitted = true;
+                queue.front()->turn.notify_one();
+                queue.pop_front();
+            }
+            waiting = queue.size();
+        }
+
+        void adapt(std::int64_t latency, bool overloaded) {
+            auto fastest = windowFastest.load(std::memory_order_relaxed);
+            while (latency < fastest && not windowFastest.compare_exchange_weak(fastest, latency, std::memory_order_relaxed)) {}
+            auto base = baseline.load(std::memory_order_relaxed);
+            if ((samples.fetch_add(1, std::memory_order_relaxed) + 1) % std::max<std::size_t>(options.window, 1) == 0) {
+                auto fresh = windowFastest.exchange(std::numeric_limits<std::int64_t>::max(), std::memory_order_relaxed);
+                base = base ? std::min(fresh, base + base / 10) : fresh;
+                baseline.store(base, std::memory_order_relaxed);
+            }
+            if (not base)
+                base = std::min(latency, windowFastest.load(std::memory_order_relaxed));
+            // Smoothed over the last few responses, so a single slow one isn't taken for overload.
+            auto previous = average.load(std::memory_order_relaxed);
+            std::int64_t smoothed;
+            do {
+                smoothed = previous ? previous + (latency - previous) / 8 : latency;
+            } while (not average.compare_exchange_weak(previous, smoothed, std::memory_order_relaxed));
+            auto current = limit.load(std::memory_order_relaxed);
+            if (overloaded || static_cast<double>(smoothed) > options.tolerance * static_cast<double>(base)) {
+                // The responses of one burst come back together, they count as one overload.
+                auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+                auto last = lastBackoff.load(std::memory_order_relaxed);
+                if (now - last < smoothed || not lastBackoff.compare_exchange_strong(last, now, std::memory_order_relaxed))
+                    return;
+                auto floor = static_cast<std::int64_t>(options.min) * Scale;
+                while (not limit.compare_exchange_weak(current, std::max(floor, static_cast<std::int64_t>(static_cast<double>(current) * options.backoff)), std::memory_order_relaxed)) {}
+                return;
+            }
+            // Only grow while the limit is what holds requests back.
+            if (inflight.load(std::memory_order_relaxed) + 1 < current / Scale / 2)
+                return;
+            auto ceiling = static_cast<std::int64_t>(options.max) * Scale;
+            while (current < ceiling && not limit.compare_exchange_weak(current, std::min(ceiling, current + Scale * Scale / current), std::memory_order_relaxed)) {}
+        }
+
+        const Options& options;
+        std::atomic<std::int64_t> limit, inflight{0};
+        // Fastest latency of the last window and of the current one, nanoseconds.
+        std::atomic<std::int64_t> baseline{0}, windowFastest{std::numeric_limits<std::int64_t>::max()};
+        // Moving average of the latency, nanoseconds.
+        std::atomic<std::int64_t> average{0};
+        std::atomic<std::int64_t> lastBackoff{0};
+        std::atomic<std::uint64_t> samples{0};
+        std::atomic<std::size_t> waiting{0};
+        std::mutex mutex;
+        std::deque<Waiter*> queue;
+    };
+
+    // Holds a token of a Limit until the response is done with, gives it back on destruction otherwise.
+    class Ticket {
+        public:
+        Ticket() = default;
+        explicit Ticket(Limit* limit) : limit(limit), start(std::chrono::steady_clock::now()) {}
+        Ticket(Ticket&& other) noexcept : limit(std::exchange(other.limit, nullptr)), start(other.start), answered(other.answered) {}
+        Ticket& operator=(Ticket&& other) noexcept {
+            if (this != &other) {
+                Release();
+                limit = std::exchange(other.limit, nullptr);
+                start = other.start;
+                answered = other.answered;
+            }
+            return *this;
+        }
+        ~Ticket() {
+            Release();
+        }
+
+        // The response headers are in, their latency is what the limit adapts to.
+        void Answered() {
+            if (limit && not answered)
+                answered = std::chrono::steady_clock::now() - start;
+        }
+        // Gives the token back, status tells whether the server was overloaded.
+        void Release(int status = 0) {
+            if (limit)
+                std::exchange(limit, nullptr)->Release(answered, status == 429 || status == 503);
+        }
+
+        private:
+        Limit* limit = nullptr;
+        std::chrono::steady_clock::time_point start;
+        std::optional<std::chrono::nanoseconds> answered;
+    };
+
+    // A Limit per server.
+    class Limiter {
+        public:
+        explicit Limiter(Options options) : options(std::move(options)) {}
+
+        const Options& Settings() const {
+            return options;
+        }
+
+        // Waits for a token to endpoint, up to wait or the default. Throws Rejected if none comes free.
+        Ticket Admit(const Endpoint& endpoint, std::optional<std::chrono::milliseconds> wait = {}) {
+            auto& limit = For(endpoint);
+            if (not limit.Acquire(wait.value_or(options.wait))) {
+                rejected.fetch_add(1, std::memory_order_relaxed);
+                throw Rejected("Request rejected! Too many requests in flight to " + Util::narrow(endpoint.host) + '.');
+            }
+            admitted.fetch_add(1, std::memory_order_relaxed);
+            return Ticket(&limit);
+        }
+        Limit& For(const Endpoint& endpoint) {
+            std::lock_guard lock(mutex);
+            auto& limit = limits[endpoint];
+            if (not limit)
+                limit = std::make_unique<Limit>(options);
+            return *limit;
+        }
+
+        std::uint64_t Admitted() const {
+            return admitted;
+        }
+        std::uint64_t Rejections() const {
+            return rejected;
+        }
+
+        private:
+        Options options;
+        std::mutex mutex;
+        std::map<Endpoint, std::unique_ptr<Limit>> limits;
+        std::atomic<std::uint64_t> admitted{0}, rejected{0};
+    };
+}
+
+namespace WinHTTP::Retry {
+    struct Options {
+        // Tries per request, the first one included. Only idempotent requests are tried again.
+        std::size_t attempts = 3;
+        // Waits before a retry, a random time up to backoff * 2^(retry - 1) but not above maxBackoff.
+        std::chrono::milliseconds backoff{25}, maxBackoff{1000};
+        // Retries may add this share of the requests on top, besides a reserve for quiet times, so a
+        // struggling server isn't flooded with them.
+        double budget = 0.2;
+        std::size_t reserve = 10;
+        // Sends a second copy of an idempotent request once the first has waited longer for its response
+        // than this share of the server's responses did, e.g. 0.95. Zero sends no copies.
+        double hedgePercentile = 0;
+        // Responses from a server before its percentile is trusted, nothing is hedged until then.
+        std::size_t hedgeAfter = 100;
+    };
+
+    // Requests that can be sent twice without harm, RFC 9110 9.2.2.
+    inline bool Idempotent(const RequestSpec& spec) {
+        for (std::wstring_view verb : {L"GET", L"HEAD", L"PUT", L"DELETE", L"OPTIONS", L"TRACE"})
+            if (spec.verb == verb)
+                return true;
+        return false;
+    }
+    // Statuses that say the server couldn't answer this time.
+    inline bool Retryable(int status) {
+        return status == 502 || status == 503 || status == 504;
+    }
+
+    // Token bucket of retries: every request adds budget of a retry, every retry takes a whole one,
+    // and no more than reserve pile up. Lock free.
+    class Budget {
+        public:
+        Budget(double budget, std::size_t reserve) : deposit(static_cast<std::int64_t>(budget * Scale)), ceiling(static_cast<std::int64_t>(reserve) * Scale), tokens(ceiling) {}
+
+        void Deposit() {
+            auto current = tokens.load(std::memory_order_relaxed);
+            while (current < ceiling && not tokens.compare_exchange_weak(current, std::min(ceiling, current + deposit), std::memory_order_relaxed)) {}
+        }
+        bool Withdraw() {
+            auto current = tokens.load(std::memory_order_relaxed);
+            while (current >= Scale)
+                if (tokens.compare_exchange_weak(current, current - Scale, std::memory_order_relaxed))
+                    return true;
+            return false;
+        }
+
+        private:
+        static constexpr std::int64_t Scale = 1000;
+        std::int64_t deposit, ceiling;
+        std::atomic<std::int64_t> tokens;
+    };
+
+    // What a client needs to retry and hedge: the options, the budget and how fast each server answers.
+    class Policy {
+        public:
+        explicit Policy(Options options) : options(std::move(options)), budget(this->options.budget, this->options.reserve) {}
+
+        const Options& Settings() const {
+            return options;
+        }
+        // A new request, adds to the budget.
+        void Started() {
+            budget.Deposit();
+        }
+        // True if attempt, which failed, may be followed by another.
+        bool Again(std::size_t attempt) {
+            if (attempt >= options.attempts)
+                return false;
+            if (not budget.Withdraw()) {
+                exhausted.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            retried.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        // How long to wait before the retry after attempt, full jitter.
+        std::chrono::milliseconds Backoff(std::size_t attempt) const {
+            auto ceiling = options.backoff.count() << std::min<std::size_t>(attempt - 1, 20);
+            ceiling = std::min<std::int64_t>(ceiling, options.maxBackoff.count());
+            thread_local std::mt19937_64 generator{std::random_device{}()};
+            return std::chrono::milliseconds(ceiling > 0 ? std::uniform_int_distribution<std::int64_t>(0, ceiling)(generator) : 0);
+        }
+
+        // Time until the response headers of a request to endpoint.
+        void Record(const Endpoint& endpoint, std::chrono::nanoseconds latency) {
+            if (options.hedgePercentile <= 0)
+                return;
+            auto& host = find(endpoint);
+            host.latency.Record(latency);
+            // The percentile walks the whole histogram, it's taken anew every so often.
+            if (host.latency.Count() % 16 == 0)
+                host.delay = host.latency.Percentile(options.hedgePercentile).count();
+        }
+        // How long to wait for the response before hedging a request to endpoint, none if it isn't.
+        std::optional<std::chrono::nanoseconds> HedgeDelay(const Endpoint& endpoint) {
+            if (options.hedgePercentile <= 0)
+                return {};
+            auto& host = find(endpoint);
+            if (host.latency.Count() < options.hedgeAfter)
+                return {};
+            return std::chrono::nanoseconds(host.delay.load());
+        }
+        void Hedged(bool won) {
+            hedged.fetch_add(1, std::memory_order_relaxed);
+            if (won)
+                hedgesWon.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Attempts after the first.
+        std::uint64_t Retried() const {
+            return retried;
+        }
+        // Retries the budget didn't allow.
+        std::uint64_t Exhausted() const {
+            return exhausted;
+        }
+        // Copies sent, and how many of them answered first.
+        std::uint64_t Hedges() const {
+            return hedged;
+        }
+        std::uint64_t HedgesWon() const {
+            return hedgesWon;
+        }
+
+        private:
+        struct Host {
+            Metrics::Histogram latency;
+            std::atomic<std::int64_t> delay{0};
+        };
+        Host& find(const Endpoint& endpoint) {
+            std::lock_guard lock(mutex);
+            auto& host = hosts[endpoint];
+            if (not host)
+                host = std::make_unique<Host>();
+            return *host;
+        }
+
+        Options options;
+        Budget budget;
+        std::mutex mutex;
+        std::map<Endpoint, std::unique_ptr<Host>> hosts;
+        std::atomic<std::uint64_t> retried{0}, exhausted{0}, hedged{0}, hedgesWon{0};
+    };
+}
+
+namespace WinHTTP::Download {
+    struct Options {
+        // Byte ranges fetched in parallel, each on its own connection. The client's pool limit
+        // per host caps how many really run at once.
+        std::size_t segments = 4;
+        // Ranges smaller than this aren't worth a connection of their own.
+        std::uint64_t minSegmentSize = 1024 * 1024;
+        // Tries per range, every one resumes where the last one stopped.
+        std::size_t attempts = 3;
+        // Keeps the progress in a journal beside the file, path + ".download", so a download
+        // that failed or was killed picks up where it stopped when it's started again.
+        bool resume = true;
+    };
+
+    struct Result {
+        std::uint64_t size = 0;
+        // Ranges the file was fetched in, 1 when it was streamed.
+        std::size_t segments = 1;
+        // False if the server ignored Range and the file came as one stream.
+        bool ranged = false;
+        // Bytes that were already on disk from an earlier attempt.
+        std::uint64_t resumed = 0;
+    };
+
+    // A file written at given offsets, from several threads at once.
+    class File {
+        public:
+        File(const std::filesystem::path& path, bool truncate) {
+#ifdef _WIN32
+            handle = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, truncate ? CREATE_ALWAYS : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (handle == INVALID_HANDLE_VALUE)
+                throw std::runtime_error("Download failed! Can't open " + path.string());
+#else
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+            if (fd < 0)
+                throw std::runtime_error("Download failed! Can't open " + path.string() + ": " + std::strerror(errno));
+#endif
+        }
+        File(const File&) = delete;
+        ~File() {
+#ifdef _WIN32
+            CloseHandle(handle);
+#else
+            ::close(fd);
+#endif
+        }
+
+        // Sets the size up front, so ranges can be written in any order without the file growing under them.
+        void Resize(std::uint64_t size) {
+#ifdef _WIN32
+            LARGE_INTEGER end;
+            end.QuadPart = (LONGLONG)size;
+            if (not SetFilePointerEx(handle, end, NULL, FILE_BEGIN) || not SetEndOfFile(handle))
+                throw std::runtime_error("Download failed! Can't allocate the file.");
+#else
+            if (::ftruncate(fd, static_cast<off_t>(size)) != 0)
+                throw std::runtime_error("Download failed! Can't allocate the file: " + std::string(std::strerror(errno)));
+#ifdef __linux__
+            // Reserve the blocks too where it's cheap, best effort.
+            if (size > 0)
+                ::posix_fallocate(fd, 0, static_cast<off_t>(size));
+#endif
+#endif
+        }
+
+        void Write(std::uint64_t offset, std::string_view data) {
+            while (not data.empty()) {
+#ifdef _WIN32
+                OVERLAPPED at{};
+                at.Offset = (DWORD)offset;
+                at.OffsetHigh = (DWORD)(offset >> 32);
+                DWORD written = 0;
+                if (not WriteFile(handle, data.data(), (DWORD)std::min<std::size_t>(data.size(), 1u << 30), &written, &at))
+                    throw std::runtime_error("Download failed! Write error.");
+#else
+                auto written = ::pwrite(fd, data.data(), data.size(), static_cast<off_t>(offset));
+                if (written < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    throw std::runtime_error("Download failed! Write error: " + std::string(std::strerror(errno)));
                 }
-                _if();
-            });
+#endif
+                data.remove_prefix(static_cast<std::size_t>(written));
+                offset += static_cast<std::uint64_t>(written);
+            }
+        }
+
+        private:
+#ifdef _WIN32
+        HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+        int fd = -1;
+#endif
+    };
+
+    // Progress of a ranged download: the file it's for, and how far each range got.
+    class Journal {
+        public:
+        struct Segment {
+            std::uint64_t begin = 0, end = 0; // [begin, end)
+        };
+
+        Journal() = default;
+        // Splits total bytes into up to segments ranges of at least minSize.
+        Journal(std::uint64_t total, std::string validator, std::size_t segments, std::uint64_t minSize) : total(total), validator(std::move(validator)) {
+            auto count = static_cast<std::size_t>(std::clamp<std::uint64_t>(total / std::max<std::uint64_t>(minSize, 1), 1, std::max<std::size_t>(segments, 1)));
+            for (std::size_t i = 0; i < count; ++i)
+                ranges.push_back({total * i / count, total * (i + 1) / count});
+            done = std::vector<std::atomic<std::uint64_t>>(count);
+        }
+
+        // Reads a journal written by Save. False if there's none or it's damaged.
+        bool Load(const std::filesystem::path& path) {
+            std::ifstream in(path);
+            std::string magic;
+            std::size_t count = 0;
+            if (not (in >> magic >> total >> std::quoted(validator) >> count) || magic != "WinHTTP-download-1" || count == 0)
+                return false;
+            ranges.assign(count, {});
+            std::vector<std::uint64_t> progress(count);
+            for (std::size_t i = 0; i < count; ++i)
+                if (not (in >> ranges[i].begin >> ranges[i].end >> progress[i]) || ranges[i].end < ranges[i].begin || progress[i] > ranges[i].end - ranges[i].begin)
+                    return false;
+            done = std::vector<std::atomic<std::uint64_t>>(count);
+            for (std::size_t i = 0; i < count; ++i)
+                done[i] = progress[i];
+            return true;
+        }
+        // Written aside and renamed over, a crash leaves the previous journal whole. Thread safe.
+        void Save(const std::filesystem::path& path) {
+            std::lock_guard lock(mutex);
+            auto temporary = path;
+            temporary += ".tmp";
+            {
+                std::ofstream out(temporary, std::ios::trunc);
+                out << "WinHTTP-download-1 " << total << ' ' << std::quoted(validator) << ' ' << ranges.size() << '\n';
+                for (std::size_t i = 0; i < ranges.size(); ++i)
+                    out << ranges[i].begin << ' ' << ranges[i].end << ' ' << done[i].load() << '\n';
+                if (not out)
+                    return;
+            }
+            std::error_code ignored;
+            std::filesystem::rename(temporary, path, ignored);
+        }
+
+        std::uint64_t Total() const {
+            return total;
+        }
+        // ETag or Last-Modified of the file, empty if the server sent neither.
+        const std::string& Validator() const {
+            return validator;
+        }
+        const std::vector<Segment>& Segments() const {
+            return ranges;
+        }
+        // Bytes of segment i already written.
+        std::atomic<std::uint64_t>& Done(std::size_t i) {
+            return done[i];
+        }
+        std::uint64_t Written() const {
+            std::uint64_t written = 0;
+            for (const auto& bytes : done)
+                written += bytes.load();
+            return written;
+        }
+
+        private:
+        std::uint64_t total = 0;
+        std::string validator;
+        std::vector<Segment> ranges;
+        std::vector<std::atomic<std::uint64_t>> done;
+        std::mutex mutex;
+    };
+
+    // Parses "bytes 0-0/12345" into its first byte and the full size. The size is empty when the server sent "*".
+    inline std::optional<std::pair<std::uint64_t, std::optional<std::uint64_t>>> ParseContentRange(std::string_view value) {
+        if (not value.starts_with("bytes "))
+            return {};
+        value.remove_prefix(6);
+        std::uint64_t first = 0, total = 0;
+        auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), first);
+        auto slash = value.find('/');
+        if (error != std::errc() || slash == std::string_view::npos)
+            return {};
+        auto size = value.substr(slash + 1);
+        if (size == "*")
+            return std::pair{first, std::optional<std::uint64_t>{}};
+        if (std::from_chars(size.data(), size.data() + size.size(), total).ec != std::errc())
+            return {};
+        return std::pair{first, std::optional<std::uint64_t>{total}};
+    }
+}
+
+namespace WinHTTP {
+    // Keeps idle keep-alive connections per endpoint so later requests can reuse them. Thread safe.
+    class ConnectionPool {
+        struct Host;
+        public:
+        struct Options {
+            // Connections to one endpoint, idle and leased together. Acquire waits while it's reached.
+            std::size_t maxPerHost = 8;
+            // Idle connections older than this are closed instead of reused.
+            std::chrono::milliseconds idleTimeout = std::chrono::seconds(30);
+        };
+
+        // A connection taken out of the pool. Goes back when released or destroyed,
+        // unless it can't carry another request, then it's closed.
+        class Lease {
+            public:
+            Lease() = default;
+            Lease(Lease&& other) noexcept : pool(std::exchange(other.pool, nullptr)), host(other.host), connection(std::move(other.connection)), reused(other.reused) {}
+            Lease& operator=(Lease&& other) noexcept {
+                if (this != &other) {
+                    Release();
+                    pool = std::exchange(other.pool, nullptr);
+                    host = other.host;
+                    connection = std::move(other.connection);
+                    reused = other.reused;
+                }
+                return *this;
+            }
+            ~Lease() {
+                Release();
+            }
+            Transport::Connection& operator*() const {
+                return *connection;
+            }
+            Transport::Connection* operator->() const {
+                return connection.get();
+            }
+            explicit operator bool() const {
+                return static_cast<bool>(connection);
+            }
+            // True if the connection served an earlier request.
+            bool Reused() const {
+                return reused;
+            }
+            // The pool's interned copy of the endpoint the connection goes to.
+            const Endpoint& Target() const {
+                return *host->endpoint;
+            }
+            void Release() {
+                if (pool)
+                    std::exchange(pool, nullptr)->release(*host, std::move(connection));
+            }
+
+            private:
+            friend class ConnectionPool;
+            Lease(ConnectionPool* pool, Host* host, std::unique_ptr<Transport::Connection> connection, bool reused) : pool(pool), host(host), connection(std::move(connection)), reused(reused) {}
+            ConnectionPool* pool = nullptr;
+            Host* host = nullptr;
+            std::unique_ptr<Transport::Connection> connection;
+            bool reused = false;
+        };
+
+        ConnectionPool(Transport::Backend& backend, Options options) : backend(backend), options(options) {}
+        ConnectionPool(const ConnectionPool&) = delete;
+
+        // Returns the pool's own copy of endpoint, stable for the pool's lifetime.
+        const Endpoint& Intern(const Endpoint& endpoint) {
+            std::lock_guard lock(mutex);
+            return hosts.try_emplace(endpoint).first->first;
         }
-        template<>
-        void if_request_available<void>(const std::function<void()>& _if, const std::function<void()>& _else) {
-            if_connection_available<void>([&]() -> void {
-                if(not RequestAvailable()) {
-                    SetError(Error::RequestNotAvailable);
-                    if(_else)
-                        _else();
-                    return;
-                }
-                _if();
-            }); 
+        // Same, but only copies host the first time the pool sees the endpoint.
+        const Endpoint& Intern(std::wstring_view host, std::uint16_t port, bool secure) {
+            std::lock_guard lock(mutex);
+            auto it = hosts.find(EndpointLess::Key(host, port, secure));
+            if (it == hosts.end())
+                it = hosts.try_emplace(Endpoint{std::wstring(host), port, secure}).first;
+            return it->first;
         }
-        void check_thread() const {
-            if(allowMultiThread)
-                return; 
-            if (std::this_thread::get_id() != ownerThreadId) {
-                throw std::runtime_error("Attempt to use WinHTTP class from a different thread. If you know what you are doing, you can suppress this error with AllowMultiThread() method.");
+
+        // Hands out the most recently used live idle connection, or opens a new one.
+        // fresh skips the idle ones. Throws if a new connection can't be opened.
+        Lease Acquire(const Endpoint& endpoint, bool fresh = false) {
+            std::unique_lock lock(mutex);
+            auto it = hosts.try_emplace(endpoint).first;
+            auto& host = it->second;
+            host.endpoint = &it->first;
+            while (true) {
+                evict_expired(host, std::chrono::steady_clock::now());
+                while (not fresh && not host.idle.empty()) {
+                    auto connection = std::move(host.idle.back().connection);
+                    host.idle.pop_back();
+                    if (connection->Alive()) {
+                        ++host.leased;
+                        ++reused;
+                        return Lease{this, &host, std::move(connection), true};
+                    }
+                }
+                if (host.leased + host.idle.size() < options.maxPerHost)
+                    break;
+                if (not host.idle.empty()) {
+                    // Make room for the fresh connection.
+                    host.idle.erase(host.idle.begin());
+                    break;
+                }
+                available.wait(lock);
+            }
+            ++host.leased;
+            lock.unlock();
+            try {
+                auto connection = backend.Connect(endpoint);
+                ++opened;
+                return Lease{this, &host, std::move(connection), false};
+            } catch (...) {
+                lock.lock();
+                --host.leased;
+                available.notify_one();
+                throw;
             }
         }
 
-        std::string read_file_content(const std::string& filePath) {
-            std::ifstream file(filePath, std::ios::binary | std::ios::ate);
-            if (!file) {
-                throw std::runtime_error("Failed to open file.");
+        // Opens connections to endpoint until count of them are open, leased ones included, but no
+        // more than maxPerHost, and parks the new ones as idle. Returns how many it opened. Throws if
+        // the first one can't be opened, stops quietly at a later one.
+        std::size_t Prewarm(const Endpoint& endpoint, std::size_t count) {
+            std::size_t added = 0;
+            std::unique_lock lock(mutex);
+            auto it = hosts.try_emplace(endpoint).first;
+            auto& host = it->second;
+            host.endpoint = &it->first;
+            while (host.leased + host.idle.size() < std::min(count, options.maxPerHost)) {
+                // Counted as leased while it opens, so Acquire doesn't go past maxPerHost meanwhile.
+                ++host.leased;
+                lock.unlock();
+                std::unique_ptr<Transport::Connection> connection;
+                try {
+                    connection = backend.Connect(endpoint);
+                } catch (...) {
+                    lock.lock();
+                    --host.leased;
+                    available.notify_one();
+                    if (added == 0)
+                        throw;
+                    return added;
+                }
+                ++opened;
+                ++added;
+                lock.lock();
+                --host.leased;
+                host.idle.push_back({std::move(connection), std::chrono::steady_clock::now()});
+                available.notify_one();
             }
+            return added;
+        }
 
-            std::streamsize size = file.tellg();
-            file.seekg(0, std::ios::beg);
+        // Closes idle connections that outlived the idle timeout.
+        void EvictIdle() {
+            std::lock_guard lock(mutex);
+            auto now = std::chrono::steady_clock::now();
+            for (auto& [endpoint, host] : hosts)
+                evict_expired(host, now);
+        }
+
+        // Connections opened since the pool was created.
+        std::size_t Opened() const {
+            return opened;
+        }
+        // Requests that went out on a reused connection.
+        std::size_t Reused() const {
+            return reused;
+        }
 
-            std::string buffer(size, '\0');
-            if (!file.read(buffer.data(), size)) {
-                throw std::runtime_error("Failed to read file.");
+        private:
+        struct Idle {
+            std::unique_ptr<Transport::Connection> connection;
+            std::chrono::steady_clock::time_point since;
+        };
+        struct Host {
+            const Endpoint* endpoint = nullptr; // Its key in hosts
+            std::vector<Idle> idle; // Oldest first
+            std::size_t leased = 0;
+        };
+        // Lets hosts be searched by (host, port, secure) without building an Endpoint.
+        struct EndpointLess {
+            using is_transparent = void;
+            using Key = std::tuple<std::wstring_view, std::uint16_t, bool>;
+            static Key key(const Endpoint& endpoint) {
+                return {endpoint.host, endpoint.port, endpoint.secure};
+            }
+            static const Key& key(const Key& key) {
+                return key;
             }
+            template<typename A_, typename B_>
+            bool operator()(const A_& a, const B_& b) const {
+                return key(a) < key(b);
+            }
+        };
 
-            return buffer;
+        void release(Host& host, std::unique_ptr<Transport::Connection> connection) {
+            if (connection && not connection->Reusable())
+                connection.reset();
+            std::lock_guard lock(mutex);
+            --host.leased;
+            if (connection)
+                host.idle.push_back({std::move(connection), std::chrono::steady_clock::now()});
+            available.notify_one();
         }
-        template <typename T_>
-        constexpr std::underlying_type_t<T_> to_underlying(T_ obj) noexcept {
-            return static_cast<std::underlying_type_t<T_>>(obj);
+        void evict_expired(Host& host, std::chrono::steady_clock::time_point now) {
+            auto expired = std::find_if(host.idle.begin(), host.idle.end(), [&](const Idle& idle) {
+                return now - idle.since < options.idleTimeout;
+            });
+            host.idle.erase(host.idle.begin(), expired);
         }
-        HINTERNET hSession, hConnect, hRequest;
-        bool requestSent, allowMultiThread; 
-        Error error;
-        std::thread::id ownerThreadId;
+
+        Transport::Backend& backend;
+        Options options;
+        std::mutex mutex;
+        std::condition_variable available;
+        std::map<Endpoint, Host, EndpointLess> hosts;
+        std::atomic<std::size_t> opened{0}, reused{0};
     };
-    
-    class HTTPBuilder {
-        private:
-        WinHTTP session;
+
+    // One request of a batch: where it goes and the same fields the request chain collects.
+    struct BatchRequest {
+        Endpoint endpoint;
+        RequestSpec spec;
+    };
+
+    // Outcome of one batch request. index is its position in the batch, error is set when it failed.
+    struct BatchResult {
+        std::size_t index = 0;
+        std::string body;
+        std::exception_ptr error;
+        explicit operator bool() const {
+            return not error;
+        }
+    };
+
+    // Long-lived, thread safe HTTP client. Connections are kept alive and reused per
+    // (host, port, scheme), so repeated calls to one server skip TCP and TLS setup.
+    // Requests are built with the same chain as HTTPBuilder:
+    //   client.Connect(L"localhost", 8000).GetRequest().Target(L"/").Send().Receive();
+    class Client {
+        public:
         class Response {
             public:
-            Response(HTTPBuilder * owner) : owner(owner) {}
+            explicit Response(ConnectionPool::Lease lease, Metrics::Registry* metrics = nullptr) : lease(std::move(lease)), metrics(metrics) {}
+            // Answered from the cache, nothing goes over the network.
+            explicit Response(std::shared_ptr<const Cache::Entry> entry) : metrics(nullptr), entry(std::move(entry)), received(true), status(200) {}
+            // Answered with a response read in full, shared with identical requests in flight, see Client::Coalesce.
+            explicit Response(std::shared_ptr<const Coalescing::Flight> flight) : metrics(nullptr), flight(std::move(flight)), received(true), status(this->flight->status), protocol(this->flight->protocol) {
+                sharedHeaders.Reset(this->flight->head);
+            }
             std::string Receive() {
-                auto resp = owner->session.ReceiveResponse();
-                if(not resp) {
-                    throw std::runtime_error("Recieve failed!");
+                if (receive_headers())
+                    return std::string(held());
+                std::string body;
+                if (not Body::ReadAll(*lease, body, lease->ContentLength()))
+                    failed();
+                finish();
+                if (caching && caching->metadata)
+                    keep(body);
+                return body;
+            }
+            // Streams the body into sink, see WinHTTP::ReceiveResponse.
+            template<typename Sink_> requires Body::Sink<Sink_>
+            void Receive(Sink_&& sink) {
+                if (receive_headers()) {
+                    std::string_view body = held();
+                    while (not body.empty()) {
+                        auto chunk = body.substr(0, Body::ChunkSize);
+                        body.remove_prefix(chunk.size());
+                        if (not sink(chunk))
+                            throw std::runtime_error("Recieve failed!");
+                    }
+                    return;
+                }
+                // A response that goes into the cache is copied on the way, unless it turns out too big.
+                std::string copy;
+                bool copying = caching && caching->metadata;
+                auto tee = [&](std::string_view chunk) -> bool {
+                    if (copying && copy.size() + chunk.size() > caching->store->MaxEntrySize()) {
+                        copying = false;
+                        copy = {};
+                    } else if (copying) {
+                        copy.append(chunk);
+                    }
+                    return sink(chunk);
+                };
+                if (not Body::Pump(*lease, lease->Buffer(), tee))
+                    failed();
+                finish();
+                if (copying)
+                    keep(copy);
+            }
+            // Reads the body into out and returns its size.
+            std::size_t Receive(std::span<char> out) {
+                if (receive_headers()) {
+                    auto body = held();
+                    if (body.size() > out.size())
+                        throw std::runtime_error("Recieve failed!");
+                    std::memcpy(out.data(), body.data(), body.size());
+                    return body.size();
+                }
+                auto size = Body::ReadInto(*lease, out);
+                if (not size)
+                    failed();
+                finish();
+                if (caching && caching->metadata)
+                    keep(std::string_view(out.data(), *size));
+                return *size;
+            }
+            void Receive(std::ostream& out) {
+                Receive([&](std::string_view chunk) -> bool {
+                    return static_cast<bool>(out.write(chunk.data(), (std::streamsize)chunk.size()));
+                });
+            }
+            // The body without a copy of its own: a coalesced response hands out the one its callers
+            // share, any other is read into a new one.
+            std::shared_ptr<const std::string> ReceiveShared() {
+                if (receive_headers() && flight)
+                    return std::shared_ptr<const std::string>(flight, &flight->body);
+                return std::make_shared<const std::string>(Receive());
+            }
+            // Streams a multipart/* body part by part: part(headers) at the start of each, then sink(chunk)
+            // with its body. Chunks point into the connection's buffer and are only valid during the call.
+            // Bodies from the cache don't keep their Content-Type, so they can't be split.
+            template<typename Part_, typename Sink_> requires Body::Sink<Sink_>
+            void ReceiveParts(Part_&& part, Sink_&& sink) {
+                if (receive_headers() && flight) {
+                    auto boundary = Multipart::BoundaryOf(sharedHeaders.Find("Content-Type").value_or(""));
+                    bool parsed = not boundary.empty() && Multipart::Split(held(), boundary, [&](const Http1::Headers& headers, std::string_view body) {
+                        part(headers);
+                        if (not body.empty() && not sink(body))
+                            throw std::runtime_error("Recieve failed!");
+                    });
+                    if (not parsed)
+                        throw std::runtime_error("Recieve failed! Malformed multipart body.");
+                    return;
+                }
+                if (entry)
+                    throw std::runtime_error("Recieve failed! The boundary of a cached body isn't known.");
+                auto boundary = Multipart::BoundaryOf(lease->Header("Content-Type").value_or(""));
+                if (boundary.empty())
+                    throw std::runtime_error("Recieve failed! Not a multipart response.");
+                Multipart::Parser parser(boundary);
+                auto buffer = lease->Buffer();
+                std::size_t begin = 0, end = 0;
+                bool eof = false;
+                while (true) {
+                    std::string_view input(buffer.data() + begin, end - begin), data;
+                    auto event = parser.Parse(input, data);
+                    begin = end - input.size();
+                    if (event == Multipart::Parser::Event::Done)
+                        break;
+                    if (event == Multipart::Parser::Event::Headers) {
+                        part(parser.Headers());
+                    } else if (event == Multipart::Parser::Event::Data) {
+                        if (not sink(data))
+                            throw std::runtime_error("Recieve failed!");
+                    } else if (event == Multipart::Parser::Event::NeedMore) {
+                        // What's left is shorter than a delimiter, move it to the front and read behind it.
+                        if (eof)
+                            throw std::runtime_error("Recieve failed! The multipart body is cut short.");
+                        std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+                        end -= begin;
+                        begin = 0;
+                        auto read = lease->Read(buffer.data() + end, buffer.size() - end);
+                        if (not read)
+                            failed();
+                        eof = *read == 0;
+                        end += *read;
+                    } else if (event == Multipart::Parser::Event::Error) {
+                        throw std::runtime_error("Recieve failed! Malformed multipart body.");
+                    }
                 }
-                return *resp; 
+                // Past the closing delimiter, so the connection can carry the next request.
+                if (not Body::Pump(*lease, buffer, [](std::string_view) { return true; }))
+                    failed();
+                finish();
             }
+
+            // Streams a body of lines, e.g. NDJSON, handing each to line(record) without its line break as
+            // soon as it's in. Empty lines are skipped. Returns true at the end of the body, false once line
+            // returns false or options.stop is requested. Lines point into the connection's buffer and are
+            // only valid during the call, just the tail not handed out yet is kept.
+            template<typename Line_> requires std::is_invocable_r_v<bool, Line_&, std::string_view>
+            bool ReceiveLines(Line_&& line, const Streaming::Options& options = {}) {
+                Streaming::Lines lines;
+                return receive_stream(options, [&](std::string_view& input, bool eof) {
+                    std::string_view record;
+                    while (lines.Parse(input, record, eof) == Streaming::Lines::Event::Line)
+                        if (not record.empty() && not line(record))
+                            return false;
+                    return true;
+                });
+            }
+            // Streams a text/event-stream body, handing each Server-Sent Event to event as soon as its
+            // closing empty line is in. Returns and stops like ReceiveLines. options.maxRecord limits an
+            // event's line and its data.
+            template<typename Event_> requires std::is_invocable_r_v<bool, Event_&, const Streaming::Event&>
+            bool ReceiveEvents(Event_&& event, const Streaming::Options& options = {}) {
+                Streaming::Events events(options.maxRecord);
+                return receive_stream(options, [&](std::string_view& input, bool) {
+                    while (true) {
+                        switch (events.Parse(input)) {
+                            case Streaming::Events::Result::Event:
+                                if (not event(events.Current()))
+                                    return false;
+                                break;
+                            case Streaming::Events::Result::TooLong:
+                                throw std::runtime_error("Recieve failed! An event is longer than maxRecord.");
+                            case Streaming::Events::Result::NeedMore:
+                                return true;
+                        }
+                    }
+                });
+            }
+
+            // How long each phase took, once the body is received. All zero unless the client's metrics are enabled.
+            const Metrics::Timing& Timing() const {
+                return timing;
+            }
+            // True if the body came from the client's cache, fresh or after a 304.
+            bool Cached() const {
+                return static_cast<bool>(entry);
+            }
+            // True if the body is shared with other callers of the same request, see Client::Coalesce.
+            bool Coalesced() const {
+                return coalesced;
+            }
+            // Status code, waits for the response headers. 200 for a body from the cache.
+            int Status() {
+                wait_headers();
+                return status;
+            }
+            // HTTP version the response came over, waits for the headers. Empty for a body from the cache.
+            std::optional<Protocol> Negotiated() {
+                wait_headers();
+                return protocol;
+            }
+            // Status line and headers, waits for them. They point into the connection's buffer,
+            // so they're only there until the body is received. Empty for a body from the cache,
+            // a copy that stays for a coalesced one.
+            const Http1::Headers& Headers() {
+                static const Http1::Headers none;
+                wait_headers();
+                return lease ? lease->Headers() : flight ? sharedHeaders : none;
+            }
+
             private:
-            HTTPBuilder * owner;
+            friend class Client;
+            // A cacheable request on its way: where its response goes and the stale entry it revalidates.
+            struct Caching {
+                Cache::Store* store;
+                std::string key;
+                std::shared_ptr<const Cache::Entry> stale;
+                // Set once the response turned out storable.
+                std::optional<Cache::Metadata> metadata;
+            };
+
+            // Waits for the response headers. True if the body is already in memory instead, see held().
+            bool receive_headers() {
+                wait_headers();
+                if (entry || flight)
+                    return true;
+                if (not lease)
+                    throw std::runtime_error("Recieve failed!");
+                return false;
+            }
+            // Reads the body through parse, see Streaming::Pump. A body read up front is parsed in one go.
+            template<typename Parse_>
+            bool receive_stream(const Streaming::Options& options, Parse_&& parse) {
+                if (receive_headers()) {
+                    std::string_view input = held();
+                    return parse(input, true);
+                }
+                std::vector<char> own;
+                auto buffer = lease->Buffer();
+                if (options.maxRecord > buffer.size()) {
+                    own.resize(options.maxRecord);
+                    buffer = own;
+                }
+                struct Some {
+                    Transport::Connection& connection;
+                    std::optional<std::size_t> Read(char* dst, std::size_t capacity) {
+                        return connection.ReadSome(dst, capacity);
+                    }
+                } source{*lease};
+                Streaming::Outcome outcome;
+                {
+                    // Gone before the lease is released, so the connection is never cancelled after that.
+                    std::stop_callback cancel(options.stop, [&] { lease->Cancel(); });
+                    outcome = Streaming::Pump(source, buffer, options.maxRecord, parse);
+                }
+                if (outcome == Streaming::Outcome::Failed && not options.stop.stop_requested())
+                    failed();
+                if (outcome == Streaming::Outcome::TooLong)
+                    throw std::runtime_error("Recieve failed! A line is longer than maxRecord.");
+                // A stopped body isn't read to its end, the pool closes the connection.
+                finish();
+                return outcome == Streaming::Outcome::Ended;
+            }
+            // A transfer failed, past the deadline or for another reason.
+            [[noreturn]] void failed() const {
+                if (lease && lease->Expired())
+                    throw Retry::DeadlineExceeded("Request failed! The deadline passed.");
+                throw std::runtime_error("Recieve failed!");
+            }
+            void wait_headers() {
+                if (received)
+                    return;
+                received = true;
+                if (not lease || not lease->Receive())
+                    failed();
+                ticket.Answered();
+                status = lease->Status();
+                protocol = lease->Negotiated();
+                if (caching && revalidate())
+                    status = 200;
+            }
+            bool revalidate() {
+                auto& cache = *caching->store;
+                auto header = [&](std::string_view name) {
+                    return lease->Header(name);
+                };
+                auto now = Cache::Clock::now();
+                if (lease->Status() == 304 && caching->stale) {
+                    auto metadata = Cache::Describe(header, now, &caching->stale->metadata);
+                    // No body, but the connection has to get past the end of the response.
+                    if (not Body::Pump(*lease, lease->Buffer(), [](std::string_view) { return true; }))
+                        failed();
+                    finish();
+                    if (metadata)
+                        cache.Update(caching->key, *metadata);
+                    else
+                        cache.Remove(caching->key);
+                    cache.Count(Cache::Store::Outcome::Revalidated, caching->stale->body.size());
+                    entry = std::move(caching->stale);
+                    return true;
+                }
+                if (lease->Status() == 200)
+                    caching->metadata = Cache::Describe(header, now);
+                if (not caching->metadata && caching->stale)
+                    cache.Remove(caching->key);
+                cache.Count(Cache::Store::Outcome::Miss);
+                return false;
+            }
+            // The body from the cache or the coalesced request.
+            std::string_view held() const {
+                return entry ? entry->body : std::string_view(flight->body);
+            }
+            void keep(std::string_view body) {
+                if (body.size() <= caching->store->MaxEntrySize())
+                    caching->store->Put(caching->key, std::move(*caching->metadata), std::string(body));
+            }
+            void finish() {
+                if (metrics) {
+                    timing = lease->TakeTiming();
+                    metrics->Record(lease.Target(), timing);
+                }
+                lease.Release();
+                ticket.Release(status);
+            }
+            ConnectionPool::Lease lease;
+            Metrics::Registry* metrics;
+            Metrics::Timing timing;
+            std::shared_ptr<const Cache::Entry> entry;
+            // A body read up front, by a coalesced or a hedged request.
+            std::shared_ptr<const Coalescing::Flight> flight;
+            Http1::Headers sharedHeaders;
+            bool coalesced = false;
+            std::optional<Caching> caching;
+            // The limiter's token, held until the body is read.
+            Admission::Ticket ticket;
+            bool received = false;
+            int status = 0;
+            std::optional<Protocol> protocol;
         };
 
         template<typename ReqType>
         class SetTarget {
             public:
-            SetTarget(HTTPBuilder * owner) : owner(owner) {} 
+            SetTarget(Client * owner, const Endpoint * endpoint) : owner(owner), endpoint(endpoint) {} 
             ReqType Target(const std::wstring& target) {
-                return {owner, target};
+                return {owner, endpoint, target};
             }
             private: 
-            HTTPBuilder * owner;
+            Client * owner;
+            const Endpoint * endpoint;
+        };
+
+        // A request rendered once by Prepare() and sent many times, see WinHTTP::PreparedRequest.
+        class Prepared {
+            public:
+            Prepared(Client* owner, const Endpoint* endpoint, PreparedRequest request) : owner(owner), endpoint(endpoint), request(std::move(request)) {}
+            // Fills the target's placeholders with parameters in order, and the form parts with payloads if any.
+            Response Send(std::initializer_list<std::string_view> parameters = {}, std::initializer_list<std::string_view> payloads = {}) {
+                return Send(std::span(parameters.begin(), parameters.size()), std::span(payloads.begin(), payloads.size()));
+            }
+            Response Send(std::span<const std::string_view> parameters, std::span<const std::string_view> payloads = {}) {
+                return owner->Send(*endpoint, request, parameters, payloads);
+            }
+            private:
+            Client* owner;
+            const Endpoint* endpoint;
+            PreparedRequest request;
         };
 
         template<typename ReqType>
         class Request {
             public: 
-            Request() : owner(nullptr) {}
-            Request(HTTPBuilder * owner, const std::wstring& verb) : owner(owner), verb(verb) {}
-            Request(HTTPBuilder * owner, const std::wstring& verb, const std::wstring& target) : owner(owner), verb(verb), objectName(target) {}
+            Request(Client * owner, const Endpoint * endpoint, std::wstring_view verb, const std::wstring& target) : owner(owner), endpoint(endpoint) {
+                spec.verb = verb;
+                spec.objectName = target;
+            }
             ReqType& Version(const std::wstring& version) {
-                this->version = version;
+                spec.version = version;
                 return *static_cast<ReqType*>(this);
             }
 
             ReqType& Referrer(const std::wstring& referrer) {
-                this->referrer = referrer; 
+                spec.referrer = referrer; 
+                return *static_cast<ReqType*>(this);
+            }
+
+            ReqType& AcceptTypes(wstring_vector accept_types) {
+                spec.accept_types = std::move(accept_types);
+                return *static_cast<ReqType*>(this);
+            }
+
+            ReqType& Flags(std::uint32_t flags) {
+                spec.flags = flags;
+                return *static_cast<ReqType*>(this);
+            }
+
+            ReqType& Header(std::wstring_view name, std::wstring_view value) {
+                spec.headers.append(name).append(L": ").append(value).append(L"\r\n");
+                return *static_cast<ReqType*>(this);
+            }
+
+            // Asks the server to compress the response, the body is decoded while it's received.
+            ReqType& Decompress(bool decompress = true) {
+                spec.decompress = decompress;
                 return *static_cast<ReqType*>(this);
             }
 
-            ReqType& AcceptTypes(WinHTTP::wstring_vector accept_types) {
-                this->accept_types = accept_types;
+            // Fails the request with Retry::DeadlineExceeded if it isn't done in time, from sending it to
+            // reading the last of the body. Retries have to fit in too. SendAsync fails its future then.
+            ReqType& Timeout(std::chrono::milliseconds timeout) {
+                spec.timeout = timeout;
                 return *static_cast<ReqType*>(this);
             }
 
-            ReqType& Flags(DWORD flags) {
-                this->flags = flags;
+            // How long to wait for a turn when the client limits concurrency, see Client::LimitConcurrency.
+            // Throws Admission::Rejected from Send() if it takes longer.
+            ReqType& AdmissionTimeout(std::chrono::milliseconds wait) {
+                spec.admissionTimeout = wait;
                 return *static_cast<ReqType*>(this);
             }
+            // Throws Admission::Rejected from Send() right away instead of waiting for a turn.
+            ReqType& FailFast() {
+                return AdmissionTimeout(std::chrono::milliseconds::zero());
+            }
+
+            // The request as built so far, to be sent later as part of a batch.
+            BatchRequest Describe() const {
+                return {*endpoint, spec};
+            }
+
+            // Renders the request as built so far once, for sending it over and over.
+            // Write the parts of the target that change as {name}.
+            Prepared Prepare() const {
+                return {owner, endpoint, PreparedRequest(spec)};
+            }
             
             protected:
-            HTTPBuilder* owner;
-            const std::wstring verb = L"";
-            std::wstring objectName = L"", version = L"", referrer = L"";
-            WinHTTP::wstring_vector accept_types = {};
-            DWORD flags = 0;
+            Client* owner;
+            const Endpoint* endpoint;
+            RequestSpec spec;
         };
 
         class PostRequest : public Request<PostRequest> {
             public:
-            PostRequest(HTTPBuilder *owner) : Request(owner, L"POST") {}
-            PostRequest(HTTPBuilder *owner, const std::wstring& target) : Request(owner, L"POST", target) {}
+            PostRequest(Client *owner, const Endpoint *endpoint, const std::wstring& target) : Request(owner, endpoint, L"POST", target) {}
 
-            PostRequest& AddFormData(const std::string& key, const WinHTTP::FormContent& content) {
-                formData.emplace_back(key, content);
+            PostRequest& AddFormData(const std::string& key, const FormContent& content) {
+                spec.formData.emplace_back(key, content);
                 return *this;
             }
-            Response& Send() {
-                if(not owner->session.ConnectionAvailable())
-                    throw std::runtime_error("Connection not available! Error code: " + std::to_string(owner->session.GetLastErrorMessage().first));
-                if(formData.empty()) 
+            Response Send() {
+                if(spec.formData.empty()) 
                     throw std::runtime_error("Form data must be set to send!");
-                owner->session.OpenRequest(verb, objectName, version, referrer, accept_types, flags);
-                if(not owner->session.RequestAvailable()) 
-                    throw std::runtime_error("An error occured while opening request! Error code: " + std::to_string(owner->session.GetLastErrorMessage().first));
-                owner->session.SendMultiPartFormRequest(formData);
-                return *new Response{owner};
+                return owner->Send(*endpoint, spec);
+            }
+            // Sends without blocking, the future resolves to the response body.
+            Async::Future<std::string> SendAsync() {
+                if(spec.formData.empty()) 
+                    throw std::runtime_error("Form data must be set to send!");
+                return owner->SendAsync(*endpoint, spec);
             }
-            private:
-            std::vector<WinHTTP::FormData> formData;
         };
 
         class GetRequest : public Request<GetRequest> {
             public:
-            GetRequest(HTTPBuilder *owner) : Request(owner, L"GET") {}
-            GetRequest(HTTPBuilder *owner, const std::wstring& target) : Request(owner, L"POST", target) {}
+            GetRequest(Client *owner, const Endpoint *endpoint, const std::wstring& target) : Request(owner, endpoint, L"GET", target) {}
             //Sends the request and returns a response
-            Response& Send() {
-                if(not owner->session.ConnectionAvailable())
-                    throw std::runtime_error("Connection not available! Error code: " + std::to_string(owner->session.GetLastErrorMessage().first));
-                if(objectName.empty()) {
+            Response Send() {
+                if(spec.objectName.empty()) {
                     throw std::runtime_error("Target must be set!");
                 }
-                owner->session.OpenRequest(verb, objectName, version, referrer, accept_types, flags);
-                if(not owner->session.RequestAvailable()) 
-                    throw std::runtime_error("An error occured while opening request! Error code: " + std::to_string(owner->session.GetLastErrorMessage().first));
-                owner->session.SendRequest();
+                return owner->Send(*endpoint, spec);
+            }
+            // Sends without blocking, the future resolves to the response body.
+            Async::Future<std::string> SendAsync() {
+                if(spec.objectName.empty()) {
+                    throw std::runtime_error("Target must be set!");
+                }
+                return owner->SendAsync(*endpoint, spec);
+            }
+            // Downloads the body into the file at path, over parallel ranges when the server allows.
+            Download::Result DownloadToFile(const std::filesystem::path& path, const Download::Options& options = {}) {
+                if(spec.objectName.empty()) {
+                    throw std::runtime_error("Target must be set!");
+                }
+                return owner->DownloadToFile(*endpoint, spec, path, options);
+            }
+        };
 
-                return *new Response{owner};
+        class Connection {
+            public:
+            Connection(Client* owner, const Endpoint* endpoint) : owner(owner), endpoint(endpoint) {}
+            SetTarget<Client::GetRequest> GetRequest() {
+                return SetTarget<Client::GetRequest>{owner, endpoint};
+            }
+            SetTarget<Client::PostRequest> PostRequest() {
+                return SetTarget<Client::PostRequest>{owner, endpoint};
             }
             private:
+            Client* owner;
+            const Endpoint* endpoint;
         };
 
+        explicit Client(const std::wstring& userAgent, ConnectionPool::Options options = {}) : Client(std::make_unique<Transport::DefaultBackend>(userAgent), options) {
+            this->userAgent = userAgent;
+        }
+        explicit Client(std::unique_ptr<Transport::Backend> backend, ConnectionPool::Options options = {}) : backend(std::move(backend)), pool(*this->backend, options) {}
+        Client(const Client&) = delete;
 
+        // Starts a request chain against the server. Doesn't open anything yet, connections
+        // are taken from the pool when a request is sent.
+        Connection Connect(std::wstring_view serverName, std::uint16_t port = 80, bool secure = false) {
+            return Connection{this, &pool.Intern(serverName, port, secure)};
+        }
 
-        class Connection {
-            public:
-            Connection() : owner(nullptr) {}
-            Connection(HTTPBuilder* owner) : owner(owner) {}
-            SetTarget<GetRequest> GetRequest() {
-                return SetTarget<class GetRequest>{owner};
+        // Sends spec on a pooled connection. The response holds the connection until its body is read.
+        // With a cache, fresh GETs are answered from it and stale ones revalidated.
+        Response Send(const Endpoint& endpoint, const RequestSpec& spec) {
+            if (coalescing && Coalescing::Coalescable(spec))
+                return send_coalesced(endpoint, spec);
+            return send_uncoalesced(endpoint, spec);
+        }
+
+        // Sends a prepared request with its blanks filled in, see PreparedRequest.
+        Response Send(const Endpoint& endpoint, const PreparedRequest& request, std::span<const std::string_view> parameters = {}, std::span<const std::string_view> payloads = {}) {
+            request.Check(parameters, payloads);
+            // A payload holding the prepared boundary goes out as a plain request, which picks another.
+            if ((cache && Cache::Cacheable(request.Spec())) || (coalescing && Coalescing::Coalescable(request.Spec())) || request.Collides(payloads))
+                return Send(endpoint, request.Resolve(parameters, payloads));
+            return send_with(endpoint, request.Spec(), [&](Transport::Connection& connection) {
+                return connection.Send(request, parameters, payloads);
+            });
+        }
+
+        // Sends spec without blocking the caller. Runs on the client's Async::Engine,
+        // which is created on first use and keeps its own connections.
+        Async::Future<std::string> SendAsync(const Endpoint& endpoint, RequestSpec spec) {
+            std::call_once(engineCreated, [&] { engine = std::make_unique<Async::Engine>(userAgent); });
+            return engine->Send(endpoint, std::move(spec));
+        }
+
+        ConnectionPool& Pool() {
+            return pool;
+        }
+
+        // Gets a server ready ahead of the first requests to it: looks its name up and opens count
+        // connections on a thread of its own, which wait in the pool for the requests. The future
+        // resolves to the connections opened, or the error if none could be.
+        Async::Future<std::size_t> Prewarm(std::wstring_view serverName, std::uint16_t port = 80, std::size_t count = 1, bool secure = false) {
+            const auto& endpoint = pool.Intern(serverName, port, secure);
+            Async::Promise<std::size_t> promise;
+            auto future = promise.GetFuture();
+            std::lock_guard lock(prewarmMutex);
+            // Threads of earlier calls that are through are joined here, so they don't pile up.
+            prewarming.remove_if([](const Prewarming& earlier) { return earlier.done.load(); });
+            auto& prewarm = prewarming.emplace_back();
+            prewarm.thread = std::jthread([this, &endpoint, count, promise, &done = prewarm.done]() mutable {
+                try {
+                    backend->Resolve(endpoint);
+                    promise.SetValue(pool.Prewarm(endpoint, count));
+                } catch (...) {
+                    promise.SetError(std::current_exception());
+                }
+                done = true;
+            });
+            return future;
+        }
+
+        // Starts timing the phases of every blocking request, see Response::Timing, and
+        // aggregating them per server. Off by default, call it before sending anything.
+        Metrics::Registry& EnableMetrics() {
+            if (not metrics)
+                metrics = std::make_unique<Metrics::Registry>();
+            return *metrics;
+        }
+        // Null while metrics are off.
+        const Metrics::Registry* GetMetrics() const {
+            return metrics.get();
+        }
+
+        // Downloads the body of spec into the file at path. A Range probe tells the size and whether
+        // the server serves ranges; if it does, the file is preallocated and its ranges are fetched over
+        // parallel connections and written in place. Otherwise the body is streamed into it. Throws
+        // if the download fails, after saving the progress for the next call to resume from.
+        Download::Result DownloadToFile(const Endpoint& endpoint, const RequestSpec& spec, const std::filesystem::path& path, const Download::Options& options = {}) {
+            auto journalPath = path;
+            journalPath += ".download";
+            auto journal = std::make_unique<Download::Journal>();
+            bool resuming = options.resume && journal->Load(journalPath) && std::filesystem::exists(path);
+
+            auto probe = spec;
+            add_header(probe, L"Range", "bytes=0-0");
+            if (resuming && not journal->Validator().empty())
+                add_header(probe, L"If-Range", journal->Validator());
+            auto response = send(endpoint, probe, streamed{});
+            response.receive_headers();
+            auto& lease = response.lease;
+            auto range = content_range(lease);
+            if (not range || not range->second) {
+                if (lease->Status() != 200)
+                    throw std::runtime_error("Download failed! Status " + std::to_string(lease->Status()));
+                // No ranges, the probe's response is the whole file.
+                Download::File file(path, true);
+                if (auto length = lease->ContentLength())
+                    file.Resize(*length);
+                std::uint64_t written = 0;
+                if (not Body::Pump(*lease, lease->Buffer(), [&](std::string_view chunk) {
+                    file.Write(written, chunk);
+                    written += chunk.size();
+                    return true;
+                }))
+                    throw std::runtime_error("Download failed!");
+                response.finish();
+                std::error_code ignored;
+                std::filesystem::remove(journalPath, ignored);
+                return {written, 1, false, 0};
             }
-            SetTarget<PostRequest> PostRequest() {
-                return SetTarget<class PostRequest>{owner};
+            // A strong ETag, or else Last-Modified, makes sure every range comes from the same version of the file.
+            std::string validator;
+            if (auto etag = lease->Header("ETag"); etag && not etag->starts_with("W/"))
+                validator = *etag;
+            else if (auto lastModified = lease->Header("Last-Modified"))
+                validator = *lastModified;
+            Body::Pump(*lease, lease->Buffer(), [](std::string_view) { return true; });
+            response.finish();
+
+            auto total = *range->second;
+            if (resuming && (journal->Total() != total || journal->Validator() != validator))
+                resuming = false;
+            if (not resuming)
+                journal = std::make_unique<Download::Journal>(total, validator, options.segments, options.minSegmentSize);
+            Download::File file(path, not resuming);
+            if (not resuming)
+                file.Resize(total);
+            Download::Result result{total, journal->Segments().size(), true, resuming ? journal->Written() : 0};
+
+            // The journal is saved every SaveEvery bytes a range moves, and whenever one stops.
+            constexpr std::uint64_t SaveEvery = 8 * 1024 * 1024;
+            std::vector<std::exception_ptr> errors(journal->Segments().size());
+            auto fetch = [&](std::size_t index) {
+                auto segment = journal->Segments()[index];
+                auto& done = journal->Done(index);
+                for (std::size_t attempt = 1; done < segment.end - segment.begin; ++attempt) {
+                    auto from = segment.begin + done;
+                    try {
+                        auto ranged = spec;
+                        std::string bytes = "bytes=" + std::to_string(from) + '-' + std::to_string(segment.end - 1);
+                        add_header(ranged, L"Range", bytes);
+                        if (not validator.empty())
+                            add_header(ranged, L"If-Range", validator);
+                        auto part = send(endpoint, ranged, streamed{});
+                        part.receive_headers();
+                        auto got = content_range(part.lease);
+                        // Anything but our range means the file changed since the probe.
+                        if (not got || got->first != from || got->second != total)
+                            throw std::runtime_error("Download failed! The server didn't send the range, the file may have changed.");
+                        auto saved = done.load();
+                        bool complete = Body::Pump(*part.lease, part.lease->Buffer(), [&](std::string_view chunk) {
+                            auto room = segment.end - segment.begin - done;
+                            chunk = chunk.substr(0, static_cast<std::size_t>(std::min<std::uint64_t>(chunk.size(), room)));
+                            file.Write(segment.begin + done, chunk);
+                            done += chunk.size();
+                            if (done - saved >= SaveEvery && options.resume) {
+                                saved = done;
+                                journal->Save(journalPath);
+                            }
+                            return true;
+                        });
+                        if (complete)
+                            part.finish();
+                        if (not complete && attempt >= options.attempts)
+                            throw std::runtime_error("Download failed!");
+                    } catch (...) {
+                        if (attempt >= options.attempts) {
+                            errors[index] = std::current_exception();
+                            break;
+                        }
+                    }
+                }
+                if (options.resume)
+                    journal->Save(journalPath);
+            };
+            {
+                std::vector<std::jthread> workers;
+                for (std::size_t i = 1; i < journal->Segments().size(); ++i)
+                    workers.emplace_back(fetch, i);
+                fetch(0);
             }
-            private:
-            HTTPBuilder* owner;
+            for (auto& error : errors)
+                if (error)
+                    std::rethrow_exception(error);
+            std::error_code ignored;
+            std::filesystem::remove(journalPath, ignored);
+            return result;
+        }
+
+        // Caches GET responses in store, which may be shared with other clients. Call it before sending anything.
+        void UseCache(std::shared_ptr<Cache::Store> store) {
+            cache = std::move(store);
+        }
+        // Null without a cache. Hit ratio and bytes saved are counted here.
+        Cache::Store* GetCache() const {
+            return cache.get();
+        }
+
+        // Limits the blocking requests in flight to each server, adapting the limit to how the server
+        // copes: it grows while responses come back quickly and shrinks on 429, 503 or slow responses.
+        // Requests past it wait for a turn, or throw Admission::Rejected, see Request::AdmissionTimeout.
+        // Call it before sending anything.
+        void LimitConcurrency(Admission::Options options = {}) {
+            limiter = std::make_unique<Admission::Limiter>(std::move(options));
+        }
+        // Null unless limiting.
+        Admission::Limiter* GetLimiter() const {
+            return limiter.get();
+        }
+
+        // Lets identical GETs sent at the same time share one upstream request. The first one is sent,
+        // the others wait for it and get its status, headers and body. Send() then reads the whole
+        // body before it returns, use ReceiveShared() to take it without a copy per caller. Only
+        // blocking requests are coalesced. Call it before sending anything.
+        void Coalesce(Coalescing::Options options = {}) {
+            coalescing = std::make_unique<Coalescing::Group>(std::move(options));
+        }
+        // Null unless coalescing. Upstream requests and the callers they were shared with are counted here.
+        const Coalescing::Group* GetCoalescing() const {
+            return coalescing.get();
+        }
+
+        // Retries idempotent requests that fail or get a 502, 503 or 504, after a jittered backoff and
+        // within a budget, so retries can't snowball on a struggling server. With hedgePercentile set,
+        // a request that waits longer than that share of the server's responses did is sent again on
+        // another connection and the first response read in full wins; hedged requests read the body
+        // before Send() returns. Both stay inside the deadline, see Request::Timeout. Call it before
+        // sending anything.
+        void EnableRetries(Retry::Options options = {}) {
+            retry = std::make_unique<Retry::Policy>(std::move(options));
+        }
+        // Null unless retrying. Retries, hedges and what the budget held back are counted here.
+        const Retry::Policy* GetRetryPolicy() const {
+            return retry.get();
+        }
+
+        private:
+        Response send_uncoalesced(const Endpoint& endpoint, const RequestSpec& spec) {
+            if (cache && Cache::Cacheable(spec))
+                return send_cached(endpoint, spec);
+            return send(endpoint, spec);
+        }
+        // Joins the identical request in flight, or sends it and reads the response for everyone.
+        Response send_coalesced(const Endpoint& endpoint, const RequestSpec& spec) {
+            Response response{coalescing->Join(endpoint, spec, [&](Coalescing::Flight& flight) {
+                auto response = send_uncoalesced(endpoint, spec);
+                flight.status = response.Status();
+                flight.protocol = response.Negotiated();
+                flight.head = response.Headers().Raw();
+                flight.body = response.Receive();
+            })};
+            response.coalesced = true;
+            return response;
+        }
+        // What send_with does to the response of every attempt before its headers are awaited.
+        struct unattached {
+            void operator()(Response&) const {}
         };
+        // Same, for a response whose body the caller streams itself. It can't be hedged, that reads it in full.
+        struct streamed {
+            void operator()(Response&) const {}
+        };
+        using Deadline = std::optional<std::chrono::steady_clock::time_point>;
 
-        public:
-        HTTPBuilder(const std::wstring& userAgent) : session(userAgent) {}
-        Connection& Connect(const std::wstring& serverName, INTERNET_PORT port = INTERNET_DEFAULT_HTTP_PORT, DWORD Reserved = WINHTTP_DEFAULT_ACCEPT_TYPES) {
-            session.Connect(serverName, port, Reserved);
-            return *new Connection{this};
+        template<typename Attach_ = unattached>
+        Response send(const Endpoint& endpoint, const RequestSpec& spec, Attach_&& attach = {}) {
+            return send_with(endpoint, spec, [&](Transport::Connection& connection) {
+                return connection.Send(spec);
+            }, attach);
+        }
+        // Sends with transmit and sets the deadline. Idempotent requests are retried and hedged if the client does.
+        template<typename Transmit_, typename Attach_ = unattached>
+        Response send_with(const Endpoint& endpoint, const RequestSpec& spec, Transmit_&& transmit, Attach_&& attach = {}) {
+            Deadline deadline;
+            if (spec.timeout)
+                deadline = std::chrono::steady_clock::now() + *spec.timeout;
+            if (retry && Retry::Idempotent(spec))
+                return send_retried(endpoint, spec, transmit, attach, deadline);
+            auto response = send_once(endpoint, spec, transmit, deadline);
+            attach(response);
+            return response;
+        }
+        // Sends with transmit on a pooled connection, once the limiter admits spec.
+        template<typename Transmit_>
+        Response send_once(const Endpoint& endpoint, const RequestSpec& spec, Transmit_& transmit, Deadline deadline) {
+            if (deadline && std::chrono::steady_clock::now() >= *deadline)
+                throw Retry::DeadlineExceeded("Request failed! The deadline passed.");
+            Admission::Ticket ticket;
+            if (limiter) {
+                auto wait = spec.admissionTimeout.value_or(limiter->Settings().wait);
+                if (deadline)
+                    wait = std::min(wait, std::chrono::ceil<std::chrono::milliseconds>(*deadline - std::chrono::steady_clock::now()));
+                ticket = limiter->Admit(endpoint, wait);
+            }
+            auto lease = pool.Acquire(endpoint);
+            auto sent = [&] {
+                lease->SetDeadline(deadline);
+                if (metrics)
+                    lease->StartTiming();
+                return transmit(*lease);
+            };
+            if (not sent()) {
+                // The server may have closed a kept-alive connection in the meantime, one retry on a new one.
+                if (lease->Expired())
+                    throw Retry::DeadlineExceeded("Request failed! The deadline passed.");
+                if (not lease.Reused())
+                    throw std::runtime_error("Request failed!");
+                lease.Release();
+                lease = pool.Acquire(endpoint, true);
+                if (not sent()) {
+                    if (lease->Expired())
+                        throw Retry::DeadlineExceeded("Request failed! The deadline passed.");
+                    throw std::runtime_error("Request failed!");
+                }
+            }
+            Response response{std::move(lease), metrics.get()};
+            response.ticket = std::move(ticket);
+            return response;
+        }
+
+        // Tries until a response isn't a 502, 503 or 504, or the attempts, the budget or the time run out.
+        // Returns once the headers of the last attempt are in.
+        template<typename Transmit_, typename Attach_>
+        Response send_retried(const Endpoint& endpoint, const RequestSpec& spec, Transmit_& transmit, Attach_& attach, Deadline deadline) {
+            retry->Started();
+            auto again = [&](std::size_t attempt) {
+                if (deadline && std::chrono::steady_clock::now() >= *deadline)
+                    return false;
+                return retry->Again(attempt);
+            };
+            for (std::size_t attempt = 1;; ++attempt) {
+                try {
+                    auto response = send_attempt(endpoint, spec, transmit, attach, deadline);
+                    if (not Retry::Retryable(response.Status()) || not again(attempt))
+                        return response;
+                } catch (const Admission::Rejected&) {
+                    throw;
+                } catch (const Retry::DeadlineExceeded&) {
+                    throw;
+                } catch (...) {
+                    if (not again(attempt))
+                        throw;
+                }
+                auto pause = retry->Backoff(attempt);
+                if (deadline)
+                    pause = std::min(pause, std::chrono::ceil<std::chrono::milliseconds>(*deadline - std::chrono::steady_clock::now()));
+                std::this_thread::sleep_for(pause);
+            }
+        }
+        // One attempt, hedged when the server's responses tell how long is too long.
+        template<typename Transmit_, typename Attach_>
+        Response send_attempt(const Endpoint& endpoint, const RequestSpec& spec, Transmit_& transmit, Attach_& attach, Deadline deadline) {
+            if constexpr (std::is_same_v<std::remove_cvref_t<Attach_>, unattached>)
+                if (auto delay = retry->HedgeDelay(endpoint))
+                    return send_hedged(endpoint, spec, transmit, deadline, *delay);
+            auto start = std::chrono::steady_clock::now();
+            auto response = send_once(endpoint, spec, transmit, deadline);
+            attach(response);
+            response.wait_headers();
+            retry->Record(endpoint, std::chrono::steady_clock::now() - start);
+            return response;
+        }
+        // Sends spec, and a copy on another pooled connection if no response is in after delay.
+        // Each reads its whole response, the first to finish wins and cancels the other.
+        template<typename Transmit_>
+        Response send_hedged(const Endpoint& endpoint, const RequestSpec& spec, Transmit_& transmit, Deadline deadline, std::chrono::nanoseconds delay) {
+            struct Race {
+                std::mutex mutex;
+                std::condition_variable settled;
+                std::shared_ptr<const Coalescing::Flight> winner;
+                std::exception_ptr error;
+                std::size_t started = 1, finished = 0;
+                bool hedgeWon = false;
+                // The connections still reading, so the winner can cancel the other.
+                Transport::Connection* running[2] = {};
+            } race;
+            auto attempt = [&](std::size_t index) {
+                std::optional<Response> response;
+                std::shared_ptr<Coalescing::Flight> flight;
+                std::exception_ptr error;
+                try {
+                    auto start = std::chrono::steady_clock::now();
+                    response.emplace(send_once(endpoint, spec, transmit, deadline));
+                    bool lost = [&] {
+                        std::lock_guard lock(race.mutex);
+                        race.running[index] = &*response->lease;
+                        return static_cast<bool>(race.winner);
+                    }();
+                    if (not lost) {
+                        response->wait_headers();
+                        retry->Record(endpoint, std::chrono::steady_clock::now() - start);
+                        auto& lease = response->lease;
+                        auto read = std::make_shared<Coalescing::Flight>();
+                        read->status = lease->Status();
+                        read->protocol = lease->Negotiated();
+                        read->head = lease->Headers().Raw();
+                        if (not Body::ReadAll(*lease, read->body, lease->ContentLength()))
+                            response->failed();
+                        flight = std::move(read);
+                    }
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                bool won = false;
+                {
+                    // Unregistered before the connection goes back to the pool, where a late cancel would hit another request.
+                    std::lock_guard lock(race.mutex);
+                    race.running[index] = nullptr;
+                    ++race.finished;
+                    if (flight && not race.winner) {
+                        won = true;
+                        race.winner = flight;
+                        race.hedgeWon = index == 1;
+                        if (auto* other = race.running[1 - index])
+                            other->Cancel();
+                    } else if (error && not race.error) {
+                        race.error = error;
+                    }
+                    race.settled.notify_all();
+                }
+                if (won)
+                    response->finish();
+            };
+            {
+                std::jthread hedge([&] {
+                    {
+                        std::unique_lock lock(race.mutex);
+                        if (race.settled.wait_for(lock, delay, [&] { return race.finished > 0; }))
+                            return;
+                        ++race.started;
+                    }
+                    attempt(1);
+                });
+                attempt(0);
+                std::unique_lock lock(race.mutex);
+                race.settled.wait(lock, [&] { return race.winner || race.finished == race.started; });
+            }
+            if (race.started > 1)
+                retry->Hedged(race.hedgeWon);
+            if (not race.winner)
+                std::rethrow_exception(race.error);
+            return Response{std::move(race.winner)};
+        }
+
+        // Answers from the cache while the entry is fresh, otherwise asks the server whether it changed.
+        Response send_cached(const Endpoint& endpoint, const RequestSpec& spec) {
+            auto key = Cache::Key(endpoint, spec);
+            auto entry = cache->Find(key);
+            if (entry && entry->metadata.Fresh(Cache::Clock::now())) {
+                cache->Count(Cache::Store::Outcome::Hit, entry->body.size());
+                return Response{std::move(entry)};
+            }
+            // A copy per attempt, whichever response is kept revalidates the entry.
+            Response::Caching caching{cache.get(), std::move(key), std::move(entry), {}};
+            auto attach = [&](Response& response) {
+                response.caching.emplace(caching);
+            };
+            auto& stale = caching.stale;
+            if (not stale || not stale->metadata.Validators())
+                return send(endpoint, spec, attach);
+            auto conditional = spec;
+            if (not stale->metadata.etag.empty())
+                add_header(conditional, L"If-None-Match", stale->metadata.etag);
+            if (not stale->metadata.lastModified.empty())
+                add_header(conditional, L"If-Modified-Since", stale->metadata.lastModified);
+            return send(endpoint, conditional, attach);
+        }
+
+        // Appends a header taken from a response, which are ASCII.
+        static void add_header(RequestSpec& spec, std::wstring_view name, std::string_view value) {
+            if (not spec.headers.empty() && not spec.headers.ends_with(L"\r\n"))
+                spec.headers += L"\r\n";
+            spec.headers += name;
+            spec.headers += L": ";
+            for (unsigned char c : value)
+                spec.headers += static_cast<wchar_t>(c);
+            spec.headers += L"\r\n";
+        }
+
+        // The Content-Range of a 206 response.
+        static auto content_range(ConnectionPool::Lease& lease) -> decltype(Download::ParseContentRange({})) {
+            if (lease->Status() != 206)
+                return {};
+            auto value = lease->Header("Content-Range");
+            return value ? Download::ParseContentRange(*value) : std::nullopt;
         }
+
+        std::wstring userAgent;
+        std::unique_ptr<Transport::Backend> backend;
+        ConnectionPool pool;
+        std::unique_ptr<Metrics::Registry> metrics;
+        std::shared_ptr<Cache::Store> cache;
+        std::unique_ptr<Coalescing::Group> coalescing;
+        std::unique_ptr<Admission::Limiter> limiter;
+        std::unique_ptr<Retry::Policy> retry;
+        std::once_flag engineCreated;
+        std::unique_ptr<Async::Engine> engine;
+        // Last, so they're joined before anything they use goes away.
+        struct Prewarming {
+            std::jthread thread;
+            std::atomic<bool> done{false};
+        };
+        std::mutex prewarmMutex;
+        std::list<Prewarming> prewarming;
     };
-}
 
+    // Runs many independent requests on a client with a fixed set of worker threads. Each worker
+    // has its own queue and steals from the others when it runs dry, and no more than maxPerHost
+    // requests of the executor go to one server at a time. Run may be called from several threads.
+    class BatchExecutor {
+        public:
+        struct Options {
+            std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+            // Requests in flight per endpoint, keep it at or below the client's pool limit.
+            std::size_t maxPerHost = 8;
+        };
+
+        explicit BatchExecutor(Client& client) : BatchExecutor(client, Options{}) {}
+        BatchExecutor(Client& client, Options options) : client(client), options(options), queues(std::max<std::size_t>(options.threads, 1)) {
+            for (std::size_t i = 0; i < queues.size(); ++i)
+                workers.emplace_back([this, i] { work(i); });
+        }
+        BatchExecutor(const BatchExecutor&) = delete;
+        ~BatchExecutor() {
+            {
+                std::lock_guard lock(mutex);
+                stopping = true;
+            }
+            workAvailable.notify_all();
+            for (auto& worker : workers)
+                worker.join();
+        }
+
+        // Runs all requests and returns their results in request order.
+        std::vector<BatchResult> Run(std::span<const BatchRequest> requests) {
+            std::vector<BatchResult> results(requests.size());
+            Run(requests, [&](BatchResult&& result) {
+                auto index = result.index;
+                results[index] = std::move(result);
+            });
+            return results;
+        }
+
+        // Runs all requests and calls onResult with each result as it finishes, on the calling thread.
+        template<typename OnResult_> requires std::invocable<OnResult_&, BatchResult&&>
+        void Run(std::span<const BatchRequest> requests, OnResult_&& onResult) {
+            Batch batch;
+            batch.requests = requests;
+            batch.endpoints.reserve(requests.size());
+            for (const auto& request : requests)
+                batch.endpoints.push_back(&client.Pool().Intern(request.endpoint));
+            submit(batch);
+
+            // If onResult throws, the rest of the batch still has to finish before it can be rethrown.
+            std::size_t delivered = 0;
+            std::exception_ptr error;
+            std::unique_lock lock(batch.mutex);
+            while (delivered < requests.size()) {
+                batch.finished.wait(lock, [&] { return not batch.done.empty(); });
+                auto done = std::exchange(batch.done, {});
+                lock.unlock();
+                for (auto& result : done) {
+                    ++delivered;
+                    if (error)
+                        continue;
+                    try {
+                        onResult(std::move(result));
+                    } catch (...) {
+                        error = std::current_exception();
+                    }
+                }
+                lock.lock();
+            }
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+        private:
+        struct Batch {
+            std::span<const BatchRequest> requests;
+            std::vector<const Endpoint*> endpoints;
+            std::mutex mutex;
+            std::condition_variable finished;
+            std::vector<BatchResult> done;
+        };
+        struct Task {
+            Batch* batch;
+            std::size_t index;
+        };
+        struct Queue {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+        struct Host {
+            std::size_t active = 0;
+            std::deque<Task> deferred;
+        };
+
+        // Deals the requests round-robin over the worker queues.
+        void submit(Batch& batch) {
+            auto start = next.fetch_add(1);
+            for (std::size_t i = 0; i < queues.size(); ++i) {
+                auto& queue = queues[(start + i) % queues.size()];
+                std::lock_guard lock(queue.mutex);
+                for (auto index = i; index < batch.requests.size(); index += queues.size())
+                    queue.tasks.push_back({&batch, index});
+            }
+            {
+                std::lock_guard lock(mutex);
+                queued += batch.requests.size();
+            }
+            workAvailable.notify_all();
+        }
+
+        // Own queue from the front first, then the back of the others'.
+        std::optional<Task> take(std::size_t self) {
+            for (std::size_t i = 0; i < queues.size(); ++i) {
+                auto& queue = queues[(self + i) % queues.size()];
+                std::lock_guard lock(queue.mutex);
+                if (queue.tasks.empty())
+                    continue;
+                Task task;
+                if (i == 0) {
+                    task = queue.tasks.front();
+                    queue.tasks.pop_front();
+                } else {
+                    task = queue.tasks.back();
+                    queue.tasks.pop_back();
+                }
+                std::lock_guard count(mutex);
+                --queued;
+                return task;
+            }
+            return std::nullopt;
+        }
+
+        void work(std::size_t self) {
+            while (true) {
+                {
+                    std::unique_lock lock(mutex);
+                    workAvailable.wait(lock, [&] { return stopping || queued > 0; });
+                    if (stopping)
+                        return;
+                }
+                if (auto task = take(self))
+                    run(*task);
+            }
+        }
+
+        // A task whose host is busy waits in that host's deferred list. Whoever finishes a
+        // request for the host runs the next deferred one right away.
+        void run(Task task) {
+            auto* endpoint = task.batch->endpoints[task.index];
+            {
+                std::lock_guard lock(hostsMutex);
+                auto& host = hosts[endpoint];
+                if (host.active >= options.maxPerHost) {
+                    host.deferred.push_back(task);
+                    return;
+                }
+                ++host.active;
+            }
+            while (true) {
+                execute(task, *endpoint);
+                std::lock_guard lock(hostsMutex);
+                auto& host = hosts[endpoint];
+                if (host.deferred.empty()) {
+                    --host.active;
+                    return;
+                }
+                task = host.deferred.front();
+                host.deferred.pop_front();
+            }
+        }
 
+        void execute(Task task, const Endpoint& endpoint) {
+            auto& batch = *task.batch;
+            BatchResult result;
+            result.index = task.index;
+            try {
+                result.body = client.Send(endpoint, batch.requests[task.index].spec).Receive();
+            } catch (...) {
+                result.error = std::current_exception();
+            }
+            // Notify under the lock, Run returns and destroys the batch as soon as it sees the last result.
+            std::lock_guard lock(batch.mutex);
+            batch.done.push_back(std::move(result));
+            batch.finished.notify_one();
+        }
 
+        Client& client;
+        Options options;
+        std::vector<Queue> queues;
+        std::vector<std::thread> workers;
+        std::atomic<std::size_t> next{0};
+        std::mutex mutex;
+        std::condition_variable workAvailable;
+        std::size_t queued = 0;
+        bool stopping = false;
+        std::mutex hostsMutex;
+        std::map<const Endpoint*, Host> hosts;
+    };
 
+    // One use helper for building a single request, see Client for the long-lived version.
+    class HTTPBuilder {
+        public:
+        HTTPBuilder(const std::wstring& userAgent) : client(userAgent) {}
+        // GETs are answered from cache when they can be, see Client::UseCache.
+        HTTPBuilder(const std::wstring& userAgent, std::shared_ptr<Cache::Store> cache) : client(userAgent) {
+            client.UseCache(std::move(cache));
+        }
+        Client::Connection Connect(const std::wstring& serverName, std::uint16_t port = 80, bool secure = false) {
+            return client.Connect(serverName, port, secure);
+        }
+        private:
+        Client client;
+    };
+}
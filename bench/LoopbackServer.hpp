@@ -0,0 +1,621 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <atomic>
+#include <stdexcept>
+#include <algorithm>
+#include <utility>
+#include <map>
+#include <unordered_map>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cerrno>
+
+namespace WinHTTP::Bench {
+    // Set on the server's own threads, so the benchmark can leave their allocations out.
+    inline thread_local bool ServerThread = false;
+
+    struct LoopbackOptions {
+        // Body size of every response.
+        std::size_t responseSize = 128;
+        // Slept before each response, to stand in for a slow backend.
+        std::chrono::microseconds latency{0};
+        // Slept once per connection before its first request is read, to stand in for a TLS handshake.
+        std::chrono::microseconds handshakeLatency{0};
+        // Chunked transfer encoding instead of Content-Length.
+        bool chunked = false;
+        std::size_t chunkSize = 16 * 1024;
+        // Closes the connection after each response when false.
+        bool keepAlive = true;
+        // Served instead of the generated pattern when set, responseSize is then ignored.
+        std::string body{};
+        // Content-Encoding the body is sent with, e.g. a gzip compressed fixture as body.
+        std::string contentEncoding{};
+        // Answers "Range: bytes=first-last" requests with 206 Partial Content. Not with chunked.
+        bool ranges = false;
+        // Bytes per second each response is sent at, 0 for as fast as it goes.
+        std::uint64_t bandwidth = 0;
+        // Requests the backend takes at once without slowing down, 0 for no limit. Past it latency
+        // grows with the square of the overload, past four times it requests get 503.
+        std::size_t capacity = 0;
+        // Every outlierEvery-th request sleeps outlierLatency instead of latency, a slow tail. 0 for none.
+        std::size_t outlierEvery = 0;
+        std::chrono::microseconds outlierLatency{0};
+        // Every failEvery-th request gets a 503 right away, 0 for none.
+        std::size_t failEvery = 0;
+        // Streams eventCount records eventInterval apart as a chunked body instead, Server-Sent Events or
+        // with ndjson lines of JSON. Each carries the steady clock time it was sent at in nanoseconds and
+        // is padded to responseSize. Not with h2c.
+        std::size_t eventCount = 0;
+        std::chrono::microseconds eventInterval{0};
+        bool ndjson = false;
+        // Speaks h2c with prior knowledge instead of HTTP/1.1, every stream of a connection is a request.
+        // Only the body, latency, outlier and failEvery options apply then.
+        bool http2 = false;
+    };
+
+    // Minimal HTTP/1.1 server on 127.0.0.1 for benchmarks, a thread per connection.
+    // Reads and discards request bodies with a Content-Length, answers every request with
+    // the same configured response. Or h2c, where request header blocks are ignored and
+    // bodies discarded the same way.
+    class LoopbackServer {
+        public:
+        explicit LoopbackServer(LoopbackOptions options) : options(std::move(options)), pattern(64 * 1024) {
+            if (not this->options.body.empty())
+                this->options.responseSize = this->options.body.size();
+            for (std::size_t i = 0; i < pattern.size(); ++i)
+                pattern[i] = static_cast<char>('a' + i % 26);
+            listenfd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (listenfd < 0)
+                throw std::runtime_error("Server socket failed!");
+            int one = 1;
+            ::setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            address.sin_port = 0;
+            socklen_t length = sizeof(address);
+            if (::bind(listenfd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listenfd, 1024) != 0 ||
+                ::getsockname(listenfd, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+                ::close(listenfd);
+                throw std::runtime_error("Server listen failed!");
+            }
+            port = ntohs(address.sin_port);
+            acceptor = std::thread([this] { accept_loop(); });
+        }
+        LoopbackServer(const LoopbackServer&) = delete;
+        ~LoopbackServer() {
+            stopping = true;
+            ::shutdown(listenfd, SHUT_RDWR);
+            acceptor.join();
+            std::unique_lock lock(mutex);
+            for (int fd : connections)
+                ::shutdown(fd, SHUT_RDWR);
+            finished.wait(lock, [&] { return connections.empty(); });
+            ::close(listenfd);
+        }
+
+        std::uint16_t Port() const {
+            return port;
+        }
+        // Connections accepted so far.
+        std::size_t Accepted() const {
+            return accepted;
+        }
+        // Requests answered so far.
+        std::size_t Served() const {
+            return served;
+        }
+
+        private:
+        void accept_loop() {
+            ServerThread = true;
+            while (not stopping) {
+                int fd = ::accept4(listenfd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED)
+                        continue;
+                    return;
+                }
+                int one = 1;
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                ++accepted;
+                std::lock_guard lock(mutex);
+                connections.push_back(fd);
+                std::thread([this, fd] {
+                    ServerThread = true;
+                    serve(fd);
+                    // Notify under the lock, the destructor may return as soon as it sees the last one go.
+                    std::lock_guard lock(mutex);
+                    connections.erase(std::find(connections.begin(), connections.end(), fd));
+                    ::close(fd);
+                    finished.notify_all();
+                }).detach();
+            }
+        }
+
+        void serve(int fd) {
+            if (options.handshakeLatency.count() > 0)
+                std::this_thread::sleep_for(options.handshakeLatency);
+            if (options.http2)
+                return serve_http2(fd);
+            std::vector<char> in(64 * 1024);
+            std::size_t begin = 0, end = 0;
+            while (true) {
+                // Request head
+                std::size_t eoh;
+                while ((eoh = std::string_view(in.data() + begin, end - begin).find("\r\n\r\n")) == std::string_view::npos) {
+                    if (begin > 0) {
+                        std::memmove(in.data(), in.data() + begin, end - begin);
+                        end -= begin;
+                        begin = 0;
+                    }
+                    if (end == in.size())
+                        return;
+                    auto got = ::recv(fd, in.data() + end, in.size() - end, 0);
+                    if (got <= 0)
+                        return;
+                    end += static_cast<std::size_t>(got);
+                }
+                std::string_view head(in.data() + begin, eoh + 4);
+                begin += eoh + 4;
+                bool close = not options.keepAlive || has_header(head, "connection", "close");
+
+                // Request body, thrown away
+                std::uint64_t remaining = content_length(head);
+                auto buffered = std::min<std::uint64_t>(remaining, end - begin);
+                begin += static_cast<std::size_t>(buffered);
+                remaining -= buffered;
+                if (begin == end)
+                    begin = end = 0;
+                while (remaining > 0) {
+                    auto got = ::recv(fd, in.data(), static_cast<std::size_t>(std::min<std::uint64_t>(remaining, in.size())), 0);
+                    if (got <= 0)
+                        return;
+                    remaining -= static_cast<std::uint64_t>(got);
+                }
+
+                auto index = ++served;
+                auto load = ++busy;
+                auto latency = options.latency;
+                if (options.outlierEvery && index % options.outlierEvery == 0)
+                    latency = options.outlierLatency;
+                bool unavailable = options.failEvery && index % options.failEvery == 0;
+                if (unavailable || (options.capacity && load > 4 * options.capacity)) {
+                    --busy;
+                    if (not send_body(fd, close ? "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\nContent-Length: 0\r\n\r\n"
+                                                : "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n", 0, 0, "") || close)
+                        return;
+                    continue;
+                }
+                if (options.capacity && load > options.capacity) {
+                    auto overload = static_cast<double>(load) / static_cast<double>(options.capacity);
+                    latency = std::chrono::duration_cast<std::chrono::microseconds>(latency * overload * overload);
+                }
+                if (latency.count() > 0)
+                    std::this_thread::sleep_for(latency);
+                bool sent = respond(fd, close, head);
+                --busy;
+                if (not sent || close)
+                    return;
+            }
+        }
+
+        bool respond(int fd, bool close, std::string_view request) {
+            if (options.eventCount > 0)
+                return stream_events(fd, close);
+            char head[256];
+            char encoding[64] = "";
+            if (not options.contentEncoding.empty())
+                std::snprintf(encoding, sizeof(encoding), "Content-Encoding: %s\r\n", options.contentEncoding.c_str());
+            if (options.ranges) {
+                auto [first, last] = range(request);
+                if (first <= last && last < options.responseSize) {
+                    int headSize = std::snprintf(head, sizeof(head), "HTTP/1.1 206 Partial Content\r\n%s%sAccept-Ranges: bytes\r\nContent-Range: bytes %zu-%zu/%zu\r\nContent-Length: %zu\r\n\r\n",
+                        close ? "Connection: close\r\n" : "", encoding, first, last, options.responseSize, last - first + 1);
+                    return send_body(fd, std::string_view(head, static_cast<std::size_t>(headSize)), first, last - first + 1, "");
+                }
+            }
+            int headSize = options.chunked
+                ? std::snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n%s%sTransfer-Encoding: chunked\r\n\r\n", close ? "Connection: close\r\n" : "", encoding)
+                : std::snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n%s%sContent-Length: %zu\r\n\r\n", close ? "Connection: close\r\n" : "", encoding, options.responseSize);
+            std::string_view prefix(head, static_cast<std::size_t>(headSize));
+            if (not options.chunked)
+                return send_body(fd, prefix, 0, options.responseSize, "");
+
+            // The head goes out together with the first chunk.
+            char frame[sizeof(head) + 32];
+            std::size_t offset = 0;
+            while (offset < options.responseSize) {
+                auto size = std::min({options.responseSize - offset, options.chunkSize, pattern.size()});
+                if (not prefix.empty())
+                    std::memcpy(frame, prefix.data(), prefix.size());
+                int frameSize = std::snprintf(frame + prefix.size(), 32, "%zx\r\n", size);
+                if (not send_body(fd, std::string_view(frame, prefix.size() + static_cast<std::size_t>(frameSize)), offset, size, "\r\n"))
+                    return false;
+                prefix = {};
+                offset += size;
+            }
+            return send_body(fd, prefix, offset, 0, "0\r\n\r\n");
+        }
+
+        // State of an h2c connection, shared by its reader and the thread that answers delayed requests.
+        struct Http2Peer {
+            int fd = -1;
+            std::mutex mutex;
+            std::condition_variable due;
+            // Requests waiting for their latency to pass, by when they are answered.
+            std::multimap<std::chrono::steady_clock::time_point, std::uint32_t> delayed;
+            // Responses whose body doesn't fit the flow control windows yet, stream to body offset.
+            std::map<std::uint32_t, std::size_t> blocked;
+            std::unordered_map<std::uint32_t, std::int64_t> windows;
+            std::int64_t window = 65535, initialWindow = 65535;
+            std::size_t frameSize = 16384;
+            bool closed = false;
+        };
+
+        static void append_frame(std::string& out, std::uint8_t type, std::uint8_t flags, std::uint32_t stream, std::string_view payload) {
+            char head[9] = {static_cast<char>(payload.size() >> 16), static_cast<char>(payload.size() >> 8), static_cast<char>(payload.size()),
+                static_cast<char>(type), static_cast<char>(flags),
+                static_cast<char>(stream >> 24), static_cast<char>(stream >> 16), static_cast<char>(stream >> 8), static_cast<char>(stream)};
+            out.append(head, sizeof(head));
+            out += payload;
+        }
+        static std::uint32_t read_uint(const char* data, std::size_t size) {
+            std::uint32_t value = 0;
+            for (std::size_t i = 0; i < size; ++i)
+                value = value << 8 | static_cast<std::uint8_t>(data[i]);
+            return value;
+        }
+        static bool send_all(int fd, std::string_view data) {
+            while (not data.empty()) {
+                auto sent = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+                if (sent < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                data.remove_prefix(static_cast<std::size_t>(sent));
+            }
+            return true;
+        }
+
+        // Reads frames until the client goes away. Requests without latency are answered right here,
+        // the others by a second thread once their time comes.
+        void serve_http2(int fd) {
+            std::vector<char> in(64 * 1024);
+            std::size_t begin = 0, end = 0;
+            // Makes sure count bytes from begin on are buffered.
+            auto fill = [&](std::size_t count) {
+                if (begin + count > in.size()) {
+                    std::memmove(in.data(), in.data() + begin, end - begin);
+                    end -= begin;
+                    begin = 0;
+                }
+                while (end - begin < count) {
+                    auto got = ::recv(fd, in.data() + end, in.size() - end, 0);
+                    if (got <= 0)
+                        return false;
+                    end += static_cast<std::size_t>(got);
+                }
+                return true;
+            };
+            if (not fill(24) || std::string_view(in.data(), 24) != "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n")
+                return;
+            begin += 24;
+
+            Http2Peer peer;
+            peer.fd = fd;
+            std::string out;
+            // Streams aren't limited in practice, and request bodies get 1 MiB windows and a 16 MiB connection window.
+            append_frame(out, 0x4, 0, 0, std::string_view("\x00\x03\x00\x00\x10\x00\x00\x04\x00\x10\x00\x00", 12));
+            append_frame(out, 0x8, 0, 0, std::string_view("\x00\xff\x00\x00", 4));
+            if (not send_all(fd, out))
+                return;
+            std::jthread answerer([&] {
+                ServerThread = true;
+                std::unique_lock lock(peer.mutex);
+                while (not peer.closed) {
+                    if (peer.delayed.empty()) {
+                        peer.due.wait(lock);
+                        continue;
+                    }
+                    auto next = peer.delayed.begin();
+                    if (peer.due.wait_until(lock, next->first) == std::cv_status::no_timeout)
+                        continue;
+                    auto stream = next->second;
+                    peer.delayed.erase(next);
+                    answer(peer, stream);
+                }
+            });
+
+            std::uint32_t continued = 0;
+            while (fill(9)) {
+                auto length = read_uint(in.data() + begin, 3);
+                auto type = static_cast<std::uint8_t>(in[begin + 3]);
+                auto flags = static_cast<std::uint8_t>(in[begin + 4]);
+                auto stream = read_uint(in.data() + begin + 5, 4) & 0x7fffffff;
+                if (length > in.size() - 9 || not fill(9 + length))
+                    break;
+                std::string_view payload(in.data() + begin + 9, length);
+                begin += 9 + length;
+
+                std::unique_lock lock(peer.mutex);
+                out.clear();
+                // A request is complete once its stream ends and its header block is all there.
+                bool complete = false;
+                if (type == 0x0) {
+                    if (length > 0) {
+                        // Room for the next body bytes right away, they are thrown away.
+                        char increment[4] = {static_cast<char>(length >> 24), static_cast<char>(length >> 16), static_cast<char>(length >> 8), static_cast<char>(length)};
+                        append_frame(out, 0x8, 0, 0, std::string_view(increment, 4));
+                        if (not (flags & 0x1))
+                            append_frame(out, 0x8, 0, stream, std::string_view(increment, 4));
+                    }
+                    complete = flags & 0x1;
+                } else if (type == 0x1) {
+                    peer.windows.emplace(stream, peer.initialWindow);
+                    if (not (flags & 0x4))
+                        continued = flags & 0x1 ? stream : 0x80000000 | stream;
+                    else
+                        complete = flags & 0x1;
+                } else if (type == 0x9) {
+                    if (flags & 0x4) {
+                        complete = continued && not (continued & 0x80000000);
+                        continued = 0;
+                    }
+                } else if (type == 0x3) {
+                    peer.windows.erase(stream);
+                    peer.blocked.erase(stream);
+                } else if (type == 0x4 && not (flags & 0x1)) {
+                    for (std::size_t i = 0; i + 6 <= payload.size(); i += 6) {
+                        auto id = read_uint(payload.data() + i, 2);
+                        auto value = read_uint(payload.data() + i + 2, 4);
+                        if (id == 0x4) {
+                            for (auto& [_, window] : peer.windows)
+                                window += static_cast<std::int64_t>(value) - peer.initialWindow;
+                            peer.initialWindow = value;
+                        } else if (id == 0x5)
+                            peer.frameSize = value;
+                    }
+                    append_frame(out, 0x4, 0x1, 0, {});
+                } else if (type == 0x6 && not (flags & 0x1)) {
+                    append_frame(out, 0x6, 0x1, 0, payload);
+                } else if (type == 0x7) {
+                    break;
+                } else if (type == 0x8 && payload.size() == 4) {
+                    auto increment = read_uint(payload.data(), 4) & 0x7fffffff;
+                    if (stream == 0)
+                        peer.window += increment;
+                    else if (auto found = peer.windows.find(stream); found != peer.windows.end())
+                        found->second += increment;
+                }
+                if (not out.empty() && not send_all(fd, out))
+                    break;
+                if (type == 0x4 || type == 0x8)
+                    flush(peer);
+                if (complete)
+                    schedule(peer, stream);
+            }
+            std::lock_guard lock(peer.mutex);
+            peer.closed = true;
+            peer.due.notify_one();
+        }
+
+        // Picks when stream is answered, now if there's no latency to wait out. Called under the lock.
+        void schedule(Http2Peer& peer, std::uint32_t stream) {
+            auto index = ++served;
+            auto latency = options.latency;
+            if (options.outlierEvery && index % options.outlierEvery == 0)
+                latency = options.outlierLatency;
+            if (options.failEvery && index % options.failEvery == 0) {
+                // :status 503 isn't in the static table, a literal with the name of :status 200.
+                std::string out;
+                append_frame(out, 0x1, 0x5, stream, std::string_view("\x08\x03" "503" "\x0f\x0d\x01" "0", 9));
+                peer.windows.erase(stream);
+                send_all(peer.fd, out);
+            } else if (latency.count() > 0) {
+                peer.delayed.emplace(std::chrono::steady_clock::now() + latency, stream);
+                peer.due.notify_one();
+            } else
+                answer(peer, stream);
+        }
+        // Sends the response head and as much of the body as the windows allow. Called under the lock.
+        void answer(Http2Peer& peer, std::uint32_t stream) {
+            if (not peer.windows.contains(stream))
+                return;
+            // :status 200 is indexed, content-length a literal with a name from the static table.
+            auto length = std::to_string(options.responseSize);
+            std::string block("\x88\x0f\x0d", 3);
+            block += static_cast<char>(length.size());
+            block += length;
+            std::string out;
+            append_frame(out, 0x1, options.responseSize == 0 ? 0x5 : 0x4, stream, block);
+            if (options.responseSize == 0) {
+                peer.windows.erase(stream);
+                send_all(peer.fd, out);
+                return;
+            }
+            peer.blocked.emplace(stream, 0);
+            flush(peer, std::move(out));
+        }
+        // Sends the body of blocked responses as far as the windows go, after prefix. Called under the lock.
+        void flush(Http2Peer& peer, std::string prefix = {}) {
+            std::string out = std::move(prefix);
+            for (auto it = peer.blocked.begin(); it != peer.blocked.end() && peer.window > 0;) {
+                auto& [stream, offset] = *it;
+                auto& window = peer.windows[stream];
+                while (offset < options.responseSize && window > 0 && peer.window > 0) {
+                    auto size = std::min({options.responseSize - offset, peer.frameSize, static_cast<std::size_t>(std::min(window, peer.window))});
+                    auto data = content(offset, size);
+                    offset += data.size();
+                    window -= static_cast<std::int64_t>(data.size());
+                    peer.window -= static_cast<std::int64_t>(data.size());
+                    append_frame(out, 0x0, offset == options.responseSize ? 0x1 : 0, stream, data);
+                }
+                if (offset == options.responseSize) {
+                    peer.windows.erase(stream);
+                    it = peer.blocked.erase(it);
+                } else
+                    ++it;
+            }
+            if (not out.empty())
+                send_all(peer.fd, out);
+        }
+
+        // Sends the configured events as chunks, each as soon as its time comes.
+        bool stream_events(int fd, bool close) {
+            char head[160];
+            int headSize = std::snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n%sContent-Type: %s\r\nTransfer-Encoding: chunked\r\n\r\n",
+                close ? "Connection: close\r\n" : "", options.ndjson ? "application/x-ndjson" : "text/event-stream");
+            if (not send_body(fd, std::string_view(head, static_cast<std::size_t>(headSize)), 0, 0, ""))
+                return false;
+            std::string record, frame;
+            auto next = std::chrono::steady_clock::now();
+            for (std::size_t i = 0; i < options.eventCount; ++i) {
+                if (options.eventInterval.count() > 0) {
+                    next += options.eventInterval;
+                    std::this_thread::sleep_until(next);
+                }
+                auto sent = static_cast<long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+                char stamp[96];
+                int stampSize = options.ndjson ? std::snprintf(stamp, sizeof(stamp), "{\"id\":%zu,\"sent\":%lld,\"pad\":\"", i, sent)
+                                               : std::snprintf(stamp, sizeof(stamp), "id: %zu\ndata: %lld ", i, sent);
+                record.assign(stamp, static_cast<std::size_t>(stampSize));
+                if (record.size() < options.responseSize)
+                    record += content(0, options.responseSize - record.size());
+                record += options.ndjson ? "\"}\n" : "\n\n";
+                char size[32];
+                int sizeSize = std::snprintf(size, sizeof(size), "%zx\r\n", record.size());
+                frame.assign(size, static_cast<std::size_t>(sizeSize));
+                frame += record;
+                frame += "\r\n";
+                if (not send_body(fd, frame, 0, 0, ""))
+                    return false;
+            }
+            return send_body(fd, "0\r\n\r\n", 0, 0, "");
+        }
+
+        // Up to size bytes of the body from offset on. The pattern repeats, so it ignores offset.
+        std::string_view content(std::size_t offset, std::size_t size) const {
+            if (not options.body.empty())
+                return std::string_view(options.body).substr(offset, size);
+            return std::string_view(pattern.data(), std::min(size, pattern.size()));
+        }
+
+        // Sends prefix, size bytes of the body from offset and suffix, with as few syscalls as it takes.
+        // Throttled to options.bandwidth by sleeping between smaller sends.
+        bool send_body(int fd, std::string_view prefix, std::size_t offset, std::size_t size, std::string_view suffix) {
+            auto start = std::chrono::steady_clock::now();
+            std::uint64_t total = 0;
+            while (not prefix.empty() || size > 0 || not suffix.empty()) {
+                if (options.bandwidth > 0)
+                    std::this_thread::sleep_until(start + std::chrono::microseconds(total * 1000000 / options.bandwidth));
+                auto data = content(offset, options.bandwidth > 0 ? std::min<std::size_t>(size, 64 * 1024) : size);
+                auto slice = data.size();
+                iovec parts[3] = {
+                    {const_cast<char*>(prefix.data()), prefix.size()},
+                    {const_cast<char*>(data.data()), slice},
+                    {const_cast<char*>(suffix.data()), slice == size ? suffix.size() : 0},
+                };
+                msghdr message{};
+                message.msg_iov = parts;
+                message.msg_iovlen = 3;
+                auto sent = ::sendmsg(fd, &message, MSG_NOSIGNAL);
+                if (sent < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                auto done = static_cast<std::size_t>(sent);
+                total += done;
+                auto take = [&](std::size_t available) {
+                    auto n = std::min(done, available);
+                    done -= n;
+                    return n;
+                };
+                prefix.remove_prefix(take(prefix.size()));
+                auto sentBody = take(slice);
+                offset += sentBody;
+                size -= sentBody;
+                if (size == 0)
+                    suffix.remove_prefix(take(suffix.size()));
+            }
+            return true;
+        }
+
+        static std::string_view header(std::string_view head, std::string_view name) {
+            std::size_t pos = head.find("\r\n");
+            while (pos != std::string_view::npos && pos + 2 < head.size()) {
+                auto next = head.find("\r\n", pos + 2);
+                auto line = head.substr(pos + 2, next - pos - 2);
+                auto colon = line.find(':');
+                if (colon == name.size() && std::equal(name.begin(), name.end(), line.begin(), [](char a, char b) { return a == (b | 0x20); })) {
+                    auto value = line.substr(colon + 1);
+                    while (not value.empty() && value.front() == ' ')
+                        value.remove_prefix(1);
+                    return value;
+                }
+                pos = next;
+            }
+            return {};
+        }
+        // The first and last byte asked for by a "Range: bytes=first-last" header, last may be left out.
+        // An empty range if there's none or it isn't a single range.
+        std::pair<std::size_t, std::size_t> range(std::string_view head) const {
+            auto value = header(head, "range");
+            if (not value.starts_with("bytes=") || value.find(',') != std::string_view::npos)
+                return {1, 0};
+            value.remove_prefix(6);
+            auto dash = value.find('-');
+            if (dash == 0 || dash == std::string_view::npos)
+                return {1, 0};
+            std::size_t first = 0, last = 0;
+            for (char c : value.substr(0, dash))
+                first = first * 10 + static_cast<std::size_t>(c - '0');
+            if (dash + 1 == value.size())
+                return {first, options.responseSize - 1};
+            for (char c : value.substr(dash + 1))
+                last = last * 10 + static_cast<std::size_t>(c - '0');
+            return {first, std::min(last, options.responseSize - 1)};
+        }
+        static bool has_header(std::string_view head, std::string_view name, std::string_view value) {
+            auto found = header(head, name);
+            return found.size() == value.size() && std::equal(value.begin(), value.end(), found.begin(), [](char a, char b) { return a == (b | 0x20); });
+        }
+        static std::uint64_t content_length(std::string_view head) {
+            std::uint64_t length = 0;
+            for (char c : header(head, "content-length")) {
+                if (c < '0' || c > '9')
+                    break;
+                length = length * 10 + static_cast<std::uint64_t>(c - '0');
+            }
+            return length;
+        }
+
+        LoopbackOptions options;
+        std::vector<char> pattern;
+        int listenfd = -1;
+        std::uint16_t port = 0;
+        std::atomic<bool> stopping{false};
+        std::atomic<std::size_t> accepted{0}, served{0}, busy{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::vector<int> connections;
+        std::thread acceptor;
+    };
+}
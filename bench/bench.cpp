@@ -0,0 +1,1067 @@
+// Benchmarks the client against an in-process loopback server and prints the results as JSON.
+//
+//   bench [--quick] [--filter <substring>] [--out <file>]
+//
+// Progress goes to stderr, the JSON document to stdout or to --out.
+#include "WinHTTP.hpp"
+#include "LoopbackServer.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <ctime>
+#include <new>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <latch>
+#include <random>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+    std::atomic<std::uint64_t> allocations{0}, allocatedBytes{0};
+}
+
+// GCC pairs the inlined replacement delete with malloc and warns, the pair is matched.
+#if defined(__GNUC__) && not defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+// Counts every allocation made outside the loopback server's threads.
+void* operator new(std::size_t size) {
+    if (not WinHTTP::Bench::ServerThread) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    struct Result {
+        std::string name;
+        std::size_t threads = 1;
+        std::size_t requests = 0;
+        double seconds = 0;
+        // Payload moved: response bodies for downloads, request bodies for uploads.
+        std::uint64_t bytes = 0;
+        // Per request, microseconds. Empty when only the total is measured.
+        std::vector<double> latencies;
+        double allocationsPerRequest = 0;
+        // CPU time of the measuring thread per request, microseconds. Zero when requests run elsewhere.
+        double cpuPerRequest = 0;
+        // Requests that didn't get a good response, when the scenario tells them apart. Latencies are
+        // of the good ones then.
+        std::optional<std::size_t> failures;
+        // Peak resident set of a child process that ran the scenario once on its own, KiB. Zero when
+        // it isn't reported.
+        std::uint64_t peakRssKiB = 0;
+        // With every request held in flight at once, what the client allocated and what the RSS grew
+        // by per request, bytes and KiB. Zero for the other scenarios.
+        double inflightBytes = 0, inflightRssKiB = 0;
+    };
+
+    struct Settings {
+        bool quick = false;
+        std::string filter;
+        std::string out;
+    };
+
+    std::size_t scaled(const Settings& settings, std::size_t count) {
+        return settings.quick ? std::max<std::size_t>(count / 10, 1) : count;
+    }
+
+    double percentile(std::vector<double>& sorted, double q) {
+        if (sorted.empty())
+            return 0;
+        auto index = static_cast<std::size_t>(std::ceil(q * static_cast<double>(sorted.size())));
+        return sorted[std::min(sorted.size(), std::max<std::size_t>(index, 1)) - 1];
+    }
+
+    double thread_cpu_us() {
+        timespec now{};
+        ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        return static_cast<double>(now.tv_sec) * 1e6 + static_cast<double>(now.tv_nsec) / 1e3;
+    }
+
+    std::uint64_t peak_rss_kib() {
+        rusage usage{};
+        ::getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return static_cast<std::uint64_t>(usage.ru_maxrss) / 1024;
+#else
+        return static_cast<std::uint64_t>(usage.ru_maxrss);
+#endif
+    }
+
+    // Peak resident set, KiB, of a forked child that runs f and exits. The child's peak starts over
+    // from what it has mapped at the fork, so it isn't the high-water mark of earlier scenarios.
+    // Zero if the child couldn't be run or f threw.
+    template<typename F_>
+    std::uint64_t peak_rss_of(F_&& f) {
+        int fds[2];
+        if (::pipe(fds) != 0)
+            return 0;
+        auto pid = ::fork();
+        if (pid == 0) {
+            ::close(fds[0]);
+            std::uint64_t peak = 0;
+            try {
+                f();
+                peak = peak_rss_kib();
+            } catch (const std::exception&) {
+            }
+            auto written = ::write(fds[1], &peak, sizeof(peak));
+            ::_exit(written == sizeof(peak) ? 0 : 1);
+        }
+        ::close(fds[1]);
+        std::uint64_t peak = 0;
+        if (pid < 0 || ::read(fds[0], &peak, sizeof(peak)) != sizeof(peak))
+            peak = 0;
+        ::close(fds[0]);
+        if (pid > 0)
+            ::waitpid(pid, nullptr, 0);
+        return peak;
+    }
+
+    // Resident set now, KiB. Zero where there's no /proc to ask.
+    std::uint64_t current_rss_kib() {
+        std::uint64_t pages = 0, resident = 0;
+        std::ifstream statm("/proc/self/statm");
+        if (not (statm >> pages >> resident))
+            return 0;
+        return resident * static_cast<std::uint64_t>(::sysconf(_SC_PAGESIZE)) / 1024;
+    }
+
+    // Runs request count times on this thread after a short warm-up, timing each one.
+    // request returns the payload bytes it moved.
+    template<typename Request_>
+    Result measure(std::string name, std::size_t count, Request_&& request) {
+        for (std::size_t i = 0; i < std::min<std::size_t>(count / 10 + 1, 50); ++i)
+            request();
+        Result result;
+        result.name = std::move(name);
+        result.requests = count;
+        result.latencies.reserve(count);
+        auto allocated = allocations.load();
+        auto cpu = thread_cpu_us();
+        auto start = Clock::now();
+        for (std::size_t i = 0; i < count; ++i) {
+            auto begin = Clock::now();
+            result.bytes += request();
+            result.latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - begin).count());
+        }
+        result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        result.cpuPerRequest = (thread_cpu_us() - cpu) / static_cast<double>(count);
+        result.allocationsPerRequest = static_cast<double>(allocations.load() - allocated) / static_cast<double>(count);
+        return result;
+    }
+
+    // Fire-and-forget coroutine for the async scenario.
+    struct Task {
+        struct promise_type {
+            Task get_return_object() { return {}; }
+            std::suspend_never initial_suspend() { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    // concurrency coroutines, each sending perWorker requests back to back with co_await.
+    Result measure_async(std::string name, WinHTTP::Client& client, std::uint16_t port, std::size_t concurrency, std::size_t perWorker) {
+        auto run = [&](std::vector<double>* latencies, std::atomic<std::uint64_t>& bytes) {
+            std::latch done(static_cast<std::ptrdiff_t>(concurrency));
+            auto worker = [&](std::size_t id) -> Task {
+                for (std::size_t i = 0; i < perWorker; ++i) {
+                    auto begin = Clock::now();
+                    auto body = co_await client.Connect(L"127.0.0.1", port).GetRequest().Target(L"/").SendAsync();
+                    bytes += body.size();
+                    if (latencies)
+                        latencies[id].push_back(std::chrono::duration<double, std::micro>(Clock::now() - begin).count());
+                }
+                done.count_down();
+            };
+            for (std::size_t id = 0; id < concurrency; ++id)
+                worker(id);
+            done.wait();
+        };
+
+        std::atomic<std::uint64_t> bytes{0};
+        run(nullptr, bytes);
+        std::vector<std::vector<double>> latencies(concurrency);
+        for (auto& worker : latencies)
+            worker.reserve(perWorker);
+        bytes = 0;
+        Result result;
+        result.name = std::move(name);
+        result.threads = concurrency;
+        result.requests = concurrency * perWorker;
+        auto allocated = allocations.load();
+        auto start = Clock::now();
+        run(latencies.data(), bytes);
+        result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        result.allocationsPerRequest = static_cast<double>(allocations.load() - allocated) / static_cast<double>(result.requests);
+        result.bytes = bytes;
+        for (auto& worker : latencies)
+            result.latencies.insert(result.latencies.end(), worker.begin(), worker.end());
+        return result;
+    }
+
+    // threads callers sending perThread requests each at the same time. request returns the payload
+    // bytes of a good response, or nothing for a failed one.
+    template<typename Request_>
+    Result measure_threads(std::string name, std::size_t threads, std::size_t perThread, Request_&& request) {
+        std::vector<std::vector<double>> latencies(threads);
+        std::atomic<std::uint64_t> bytes{0};
+        std::atomic<std::size_t> failures{0};
+        Result result;
+        result.name = std::move(name);
+        result.threads = threads;
+        result.requests = threads * perThread;
+        auto allocated = allocations.load();
+        auto start = Clock::now();
+        {
+            std::vector<std::jthread> workers;
+            for (std::size_t id = 0; id < threads; ++id) {
+                workers.emplace_back([&, id] {
+                    latencies[id].reserve(perThread);
+                    for (std::size_t i = 0; i < perThread; ++i) {
+                        auto begin = Clock::now();
+                        if (auto moved = request()) {
+                            bytes += *moved;
+                            latencies[id].push_back(std::chrono::duration<double, std::micro>(Clock::now() - begin).count());
+                        } else {
+                            ++failures;
+                        }
+                    }
+                });
+            }
+        }
+        result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        result.allocationsPerRequest = static_cast<double>(allocations.load() - allocated) / static_cast<double>(result.requests);
+        result.bytes = bytes;
+        result.failures = failures.load();
+        for (auto& worker : latencies)
+            result.latencies.insert(result.latencies.end(), worker.begin(), worker.end());
+        return result;
+    }
+
+    Result measure_batch(std::string name, WinHTTP::Client& client, std::span<const WinHTTP::BatchRequest> requests, std::size_t threads) {
+        WinHTTP::BatchExecutor executor(client, {.threads = threads, .maxPerHost = 8});
+        executor.Run(requests.first(std::min<std::size_t>(requests.size(), 100)));
+        Result result;
+        result.name = std::move(name);
+        result.threads = threads;
+        result.requests = requests.size();
+        auto allocated = allocations.load();
+        auto start = Clock::now();
+        for (auto& response : executor.Run(requests)) {
+            if (not response)
+                std::rethrow_exception(response.error);
+            result.bytes += response.body.size();
+        }
+        result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        result.allocationsPerRequest = static_cast<double>(allocations.load() - allocated) / static_cast<double>(result.requests);
+        return result;
+    }
+
+    std::string to_json(std::vector<Result>& results, const Settings& settings) {
+        std::ostringstream json;
+        json.precision(6);
+        json << "{\n  \"library\": \"WinHTTP\",\n  \"quick\": " << (settings.quick ? "true" : "false")
+             << ",\n  \"hardware_concurrency\": " << std::thread::hardware_concurrency() << ",\n  \"results\": [";
+        for (std::size_t i = 0; i < results.size(); ++i) {
+            auto& result = results[i];
+            std::sort(result.latencies.begin(), result.latencies.end());
+            json << (i ? "," : "") << "\n    {\"name\": \"" << result.name << "\", \"threads\": " << result.threads
+                 << ", \"requests\": " << result.requests << ", \"seconds\": " << result.seconds
+                 << ", \"requests_per_second\": " << static_cast<double>(result.requests) / result.seconds
+                 << ", \"bytes_per_second\": " << static_cast<double>(result.bytes) / result.seconds;
+            if (not result.latencies.empty()) {
+                json << ", \"latency_us\": {\"p50\": " << percentile(result.latencies, 0.5) << ", \"p99\": " << percentile(result.latencies, 0.99)
+                     << ", \"p999\": " << percentile(result.latencies, 0.999) << ", \"max\": " << result.latencies.back() << "}";
+            }
+            if (result.cpuPerRequest > 0)
+                json << ", \"cpu_us_per_request\": " << result.cpuPerRequest;
+            if (result.failures)
+                json << ", \"failures\": " << *result.failures
+                     << ", \"goodput_per_second\": " << static_cast<double>(result.requests - *result.failures) / result.seconds;
+            if (result.inflightBytes > 0)
+                json << ", \"allocated_bytes_per_inflight\": " << result.inflightBytes << ", \"rss_kib_per_inflight\": " << result.inflightRssKiB;
+            if (result.peakRssKiB)
+                json << ", \"peak_rss_kib\": " << result.peakRssKiB;
+            json << ", \"allocations_per_request\": " << result.allocationsPerRequest << "}";
+        }
+        json << "\n  ]\n}\n";
+        return json.str();
+    }
+
+    std::filesystem::path make_upload(std::size_t size) {
+        auto path = std::filesystem::temp_directory_path() / "winhttp_bench_upload.bin";
+        std::ofstream file(path, std::ios::binary);
+        std::vector<char> block(64 * 1024, 'x');
+        for (std::size_t written = 0; written < size; written += block.size())
+            file.write(block.data(), static_cast<std::streamsize>(std::min(block.size(), size - written)));
+        return path;
+    }
+
+    // JSON array of records, repetitive the way API payloads are, about size bytes.
+    std::string make_json(std::size_t size) {
+        std::string json = "[";
+        char record[160];
+        for (std::size_t i = 0; json.size() < size; ++i) {
+            int n = std::snprintf(record, sizeof(record), "%s{\"id\":%zu,\"name\":\"user%zu\",\"active\":%s,\"score\":%zu.%02zu,\"tags\":[\"alpha\",\"beta\"]}",
+                i ? "," : "", i, i % 1000, i % 3 ? "true" : "false", i * 7 % 1000, i % 100);
+            json.append(record, static_cast<std::size_t>(n));
+        }
+        json += ']';
+        return json;
+    }
+
+#ifdef WINHTTP_ZLIB_SUPPORT
+    std::string gzip(std::string_view data) {
+        z_stream stream{};
+        // 16 on top of the window bits writes a gzip wrapper.
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("deflateInit2 failed");
+        std::string out(deflateBound(&stream, static_cast<uLong>(data.size())), '\0');
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        stream.avail_in = static_cast<uInt>(data.size());
+        stream.next_out = reinterpret_cast<Bytef*>(out.data());
+        stream.avail_out = static_cast<uInt>(out.size());
+        deflate(&stream, Z_FINISH);
+        out.resize(stream.total_out);
+        deflateEnd(&stream);
+        return out;
+    }
+#endif
+}
+
+int main(int argc, char** argv) {
+    using WinHTTP::Bench::LoopbackOptions;
+    using WinHTTP::Bench::LoopbackServer;
+
+    Settings settings;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--quick")
+            settings.quick = true;
+        else if (arg == "--filter" && i + 1 < argc)
+            settings.filter = argv[++i];
+        else if (arg == "--out" && i + 1 < argc)
+            settings.out = argv[++i];
+        else {
+            std::cerr << "usage: bench [--quick] [--filter <substring>] [--out <file>]" << std::endl;
+            return 2;
+        }
+    }
+
+    std::vector<Result> results;
+    auto wanted = [&](std::string_view name) {
+        return settings.filter.empty() || name.find(settings.filter) != std::string_view::npos;
+    };
+    auto report = [&](Result result) {
+        std::cerr << result.name << ": " << static_cast<double>(result.requests) / result.seconds << " req/s" << std::endl;
+        results.push_back(std::move(result));
+    };
+    // A scenario that finds the library regressed fails the run, after the JSON is written.
+    bool failed = false;
+    auto check = [&](bool ok, std::string_view what) {
+        if (not ok) {
+            std::cerr << "check failed: " << what << std::endl;
+            failed = true;
+        }
+    };
+
+    try {
+        if (wanted("get_small")) {
+            LoopbackServer server({.responseSize = 128});
+            WinHTTP::Client client(L"bench");
+            auto result = measure("get_small", scaled(settings, 20000), [&] {
+                return client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/").Send().Receive().size();
+            });
+            // The returned string is the one allocation left, receiving into a buffer needs none.
+            check(result.allocationsPerRequest <= 1, "get_small allocates more than the body");
+            report(std::move(result));
+            char buffer[256];
+            result = measure("get_small_into_buffer", scaled(settings, 20000), [&] {
+                return client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/").Send().Receive(std::span<char>(buffer));
+            });
+            check(result.allocationsPerRequest == 0, "get_small_into_buffer allocates");
+            report(std::move(result));
+        }
+        if (wanted("get_small_metrics")) {
+            // Same as get_small with phase timing on, the difference is what instrumentation costs.
+            LoopbackServer server({.responseSize = 128});
+            WinHTTP::Client client(L"bench");
+            client.EnableMetrics();
+            report(measure("get_small_metrics", scaled(settings, 20000), [&] {
+                return client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/").Send().Receive().size();
+            }));
+        }
+        if (wanted("get_api")) {
+            // An API call with a path parameter, accept types and a few headers, built per call and
+            // prepared once. cpu_us_per_request tells what rendering the request costs.
+            LoopbackServer server({.responseSize = 128});
+            WinHTTP::Client client(L"bench");
+            WinHTTP::wstring_vector types;
+            types.push_back(L"application/json");
+            types.push_back(L"text/plain");
+            char buffer[256];
+            std::size_t id = 0;
+            report(measure("get_api", scaled(settings, 20000), [&] {
+                return client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/api/v1/items/" + std::to_wstring(++id % 1000) + L"/details")
+                    .AcceptTypes(types).Header(L"Authorization", L"Bearer 0123456789abcdef0123456789abcdef").Header(L"X-Client", L"bench")
+                    .Send().Receive(std::span<char>(buffer));
+            }));
+            auto prepared = client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/api/v1/items/{id}/details")
+                .AcceptTypes(types).Header(L"Authorization", L"Bearer 0123456789abcdef0123456789abcdef").Header(L"X-Client", L"bench")
+                .Prepare();
+            auto result = measure("get_api_prepared", scaled(settings, 20000), [&] {
+                char digits[24];
+                auto end = std::to_chars(digits, digits + sizeof(digits), ++id % 1000).ptr;
+                return prepared.Send({std::string_view(digits, static_cast<std::size_t>(end - digits))}).Receive(std::span<char>(buffer));
+            });
+            check(result.allocationsPerRequest == 0, "get_api_prepared allocates");
+            report(std::move(result));
+        }
+        if (wanted("headers")) {
+            // Four lookups in a typical API response head, indexed once against scanning it per lookup.
+            const std::string head = "HTTP/1.1 200 OK\r\nDate: Wed, 21 Oct 2015 07:28:00 GMT\r\nServer: nginx/1.25.3\r\n"
+                "Content-Type: application/json; charset=utf-8\r\nContent-Length: 1234\r\nConnection: keep-alive\r\n"
+                "Vary: Accept-Encoding, Origin\r\nCache-Control: private, max-age=0, must-revalidate\r\nETag: W/\"4d2-18b5f3a1c\"\r\n"
+                "Strict-Transport-Security: max-age=31536000; includeSubDomains\r\nX-Content-Type-Options: nosniff\r\n"
+                "X-Frame-Options: DENY\r\nX-Request-Id: 7f9c2ba4-e88f-4a2b-9f1e-1d3c5b7a9e0f\r\nX-RateLimit-Limit: 5000\r\n"
+                "X-RateLimit-Remaining: 4987\r\nX-RateLimit-Reset: 1445412480\r\nAccess-Control-Allow-Origin: *\r\n\r\n";
+            const std::string_view names[] = {"content-type", "content-length", "x-ratelimit-remaining", "retry-after"};
+            WinHTTP::Http1::Headers headers;
+            std::size_t found = 0;
+            report(measure("headers_index", scaled(settings, 1000000), [&] {
+                headers.Reset(head);
+                for (auto name : names)
+                    found += headers.Find(name).has_value();
+                found += headers.Status() == 200;
+                return head.size();
+            }));
+            report(measure("headers_scan", scaled(settings, 1000000), [&] {
+                for (auto name : names)
+                    found += WinHTTP::Util::find_header(head, name).has_value();
+                return head.size();
+            }));
+            if (found == 0)
+                std::cerr << "headers: nothing found" << std::endl;
+        }
+        if (wanted("headers_differential")) {
+            // Random heads, and random bytes cut at the first blank line, indexed with Headers and
+            // scanned with find_header, which must agree on every lookup. Names come in mixed case and
+            // with a byte off by the case bit, some made of the bytes around the letters.
+            const std::string_view names[] = {"Content-Type", "content-length", "X-RateLimit-Remaining", "Set-Cookie", "ETag", "A", "ab",
+                "x-very-long-header-name", "Retry-After", "@[`{^~"};
+            const std::string_view bytes = "abcxyzABCXYZ@[`{^~-_:; \t0123\x80\xff";
+            std::mt19937_64 random(2);
+            auto pick = [&](std::size_t maxLength, std::string_view from) {
+                std::string out(random() % maxLength + 1, '\0');
+                for (auto& c : out)
+                    c = from[random() % from.size()];
+                return out;
+            };
+            auto flip = [&](std::string out) {
+                for (auto& c : out)
+                    if (((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) && random() % 2)
+                        c = static_cast<char>(c ^ 0x20);
+                return out;
+            };
+            std::string head;
+            std::vector<std::string> lookups;
+            WinHTTP::Http1::Headers headers;
+            std::size_t mismatches = 0;
+            auto result = measure("headers_differential", scaled(settings, 200000), [&] {
+                lookups.clear();
+                for (auto name : names)
+                    lookups.push_back(flip(std::string(name)));
+                if (random() % 8 == 0) {
+                    head = pick(256, std::string(bytes) + "\r\n\r\n::");
+                    if (auto end = head.find("\r\n\r\n"); end != std::string::npos)
+                        head.resize(end + 4);
+                } else {
+                    head = "HTTP/1.1 200 OK\r\n";
+                    for (auto fields = random() % 16; fields; --fields) {
+                        if (random() % 5 == 0) {
+                            head += pick(20, bytes);
+                        } else {
+                            auto name = random() % 4 ? std::string(names[random() % std::size(names)]) : pick(12, bytes);
+                            head += flip(name);
+                            lookups.push_back(flip(name));
+                            // One byte off by the case bit, which only letters may ignore.
+                            name[random() % name.size()] ^= 0x20;
+                            lookups.push_back(std::move(name));
+                            head.append(random() % 2 ? ": " : ":").append(pick(10, bytes));
+                        }
+                        head += "\r\n";
+                    }
+                    head += "\r\n";
+                }
+                headers.Reset(head);
+                for (const auto& name : lookups) {
+                    if (headers.Find(name) != WinHTTP::Util::find_header(head, name) && mismatches++ == 0)
+                        std::cerr << "headers_differential: lookup of \"" << name << "\" differs in\n" << head << std::endl;
+                }
+                return head.size();
+            });
+            check(mismatches == 0, "headers_differential found Headers and find_header disagreeing");
+            report(std::move(result));
+        }
+        if (wanted("cache_control")) {
+            // What Cache::Describe makes of common Cache-Control values on a response with an ETag.
+            struct Case {
+                std::string_view control;
+                bool stored;
+                std::int64_t fresh;
+            };
+            const Case cases[] = {
+                {"no-cache, no-store, must-revalidate", false, 0},
+                {"no-store", false, 0},
+                {"no-cache", true, 0},
+                {"max-age=60, no-cache", true, 0},
+                {"no-cache, max-age=60", true, 0},
+                {"public, max-age=60", true, 60},
+            };
+            auto now = WinHTTP::Cache::Clock::now();
+            for (const auto& test : cases) {
+                auto metadata = WinHTTP::Cache::Describe([&](std::string_view name) -> std::optional<std::string_view> {
+                    if (name == "Cache-Control")
+                        return test.control;
+                    if (name == "ETag")
+                        return "\"v1\"";
+                    return {};
+                }, now);
+                check(metadata.has_value() == test.stored && (not metadata || metadata->expires == now + std::chrono::seconds(test.fresh)),
+                    "Cache-Control: " + std::string(test.control) + " isn't cached as it says");
+            }
+        }
+        if (wanted("boundary_scan")) {
+            // A generated boundary searched for in 64 MiB of random bytes.
+            std::string haystack(64 << 20, '\0');
+            std::mt19937_64 random(1);
+            for (auto& c : haystack)
+                c = static_cast<char>(random());
+            std::pmr::string boundary;
+            WinHTTP::Multipart::RandomBoundary(boundary);
+            WinHTTP::Multipart::Finder finder(boundary);
+            std::size_t found = 0;
+            report(measure("boundary_scan", scaled(settings, 50), [&] {
+                found += finder.In(haystack);
+                return haystack.size();
+            }));
+            if (found != 0)
+                std::cerr << "boundary_scan: boundary found" << std::endl;
+        }
+        if (wanted("multipart_parse")) {
+            // A 64 MiB multipart body of 1 MiB parts split in place.
+            std::pmr::string boundary;
+            WinHTTP::Multipart::RandomBoundary(boundary);
+            std::string part(1 << 20, 'x');
+            std::string body;
+            for (int i = 0; i < 64; ++i)
+                body.append("--").append(boundary).append("\r\nContent-Type: application/octet-stream\r\n\r\n").append(part).append("\r\n");
+            body.append("--").append(boundary).append("--\r\n");
+            std::size_t parts = 0;
+            report(measure("multipart_parse", scaled(settings, 50), [&] {
+                WinHTTP::Multipart::Split(body, boundary, [&](const WinHTTP::Http1::Headers&, std::string_view) { ++parts; });
+                return body.size();
+            }));
+            if (parts == 0)
+                std::cerr << "multipart_parse: no parts" << std::endl;
+        }
+        if (wanted("replay")) {
+            // get_small, get_api and post_form_small recorded off the loopback server once and answered
+            // from memory, plus a 1 MiB chunked download made up by hand. No sockets, no server threads:
+            // the time and allocations are the library's own, requests rendered and responses parsed.
+            auto recording = std::make_shared<WinHTTP::Transport::Recording>();
+            WinHTTP::wstring_vector types;
+            types.push_back(L"application/json");
+            types.push_back(L"text/plain");
+            {
+                LoopbackServer small({.responseSize = 128}), tiny({.responseSize = 64});
+                WinHTTP::Client recorder(std::make_unique<WinHTTP::Transport::RecordingBackend>(std::make_unique<WinHTTP::Transport::DefaultBackend>(L"bench"), recording));
+                recorder.Connect(L"127.0.0.1", small.Port()).GetRequest().Target(L"/").Send().Receive();
+                auto apiRecorder = recorder.Connect(L"127.0.0.1", small.Port()).GetRequest().Target(L"/api/v1/items/{id}/details").Prepare();
+                for (std::size_t id = 0; id < 1000; ++id)
+                    apiRecorder.Send({std::to_string(id)}).Receive();
+                recorder.Connect(L"127.0.0.1", tiny.Port()).PostRequest().Target(L"/api/login")
+                    .AddFormData("email", {"mail@example.com"})
+                    .AddFormData("password", {"somesecurepassword"})
+                    .Send().Receive();
+            }
+            std::string download = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nTransfer-Encoding: chunked\r\n\r\n";
+            for (int i = 0; i < 64; ++i)
+                download.append("4000\r\n").append(16 * 1024, static_cast<char>('a' + i % 26)).append("\r\n");
+            download += "0\r\n\r\n";
+            recording->Add("GET /download", std::move(download));
+
+            WinHTTP::Client client(std::make_unique<WinHTTP::Transport::ReplayBackend>(recording, L"bench"));
+            report(measure("replay_get_small", scaled(settings, 200000), [&] {
+                return client.Connect(L"127.0.0.1", 80).GetRequest().Target(L"/").Send().Receive().size();
+            }));
+            char buffer[256];
+            std::size_t id = 0;
+            report(measure("replay_get_api", scaled(settings, 200000), [&] {
+                return client.Connect(L"127.0.0.1", 80).GetRequest().Target(L"/api/v1/items/" + std::to_wstring(++id % 1000) + L"/details")
+                    .AcceptTypes(types).Header(L"Authorization", L"Bearer 0123456789abcdef0123456789abcdef").Header(L"X-Client", L"bench")
+                    .Send().Receive(std::span<char>(buffer));
+            }));
+            auto prepared = client.Connect(L"127.0.0.1", 80).GetRequest().Target(L"/api/v1/items/{id}/details")
+                .AcceptTypes(types).Header(L"Authorization", L"Bearer 0123456789abcdef0123456789abcdef").Header(L"X-Client", L"bench")
+                .Prepare();
+            report(measure("replay_get_api_prepared", scaled(settings, 200000), [&] {
+                char digits[24];
+                auto end = std::to_chars(digits, digits + sizeof(digits), ++id % 1000).ptr;
+                return prepared.Send({std::string_view(digits, static_cast<std::size_t>(end - digits))}).Receive(std::span<char>(buffer));
+            }));
+            auto form = client.Connect(L"127.0.0.1", 80).PostRequest().Target(L"/api/login")
+                .AddFormData("email", {"mail@example.com"})
+                .AddFormData("password", {"somesecurepassword"})
+                .Describe();
+            auto size = WinHTTP::Multipart::Encoder(form.spec.formData).ContentLength();
+            report(measure("replay_post_form_small", scaled(settings, 200000), [&] {
+                client.Send(form.endpoint, form.spec).Receive();
+                return size;
+            }));
+            report(measure("replay_download_chunked", scaled(settings, 2000), [&] {
+                std::uint64_t size = 0;
+                client.Connect(L"127.0.0.1", 80).GetRequest().Target(L"/download").Send().Receive([&](std::string_view chunk) {
+                    size += chunk.size();
+                    return true;
+                });
+                return size;
+            }));
+        }
+        if (wanted("get_no_keepalive")) {
+            LoopbackServer server({.responseSize = 128, .keepAlive = false});
+            WinHTTP::Client client(L"bench");
+            report(measure("get_no_keepalive", scaled(settings, 2000), [&] {
+                return client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/").Send().Receive().size();
+            }));
+        }
+        if (wanted("post_form_small")) {
+            LoopbackServer server({.responseSize = 64});
+            WinHTTP::Client client(L"bench");
+            auto request = client.Connect(L"127.0.0.1", server.Port()).PostRequest().Target(L"/api/login")
+                .AddFormData("email", {"mail@example.com"})
+                .AddFormData("password", {"somesecurepassword"})
+                .Describe();
+            auto size = WinHTTP::Multipart::Encoder(request.spec.formData).ContentLength();
+            report(measure("post_form_small", scaled(settings, 20000), [&] {
+                client.Send(request.endpoint, request.spec).Receive();
+                return size;
+            }));
+            auto prepared = client.Connect(L"127.0.0.1", server.Port()).PostRequest().Target(L"/api/login")
+                .AddFormData("email", {""})
+                .AddFormData("password", {""})
+                .Prepare();
+            const std::string_view payloads[] = {"mail@example.com", "somesecurepassword"};
+            report(measure("post_form_small_prepared", scaled(settings, 20000), [&] {
+                prepared.Send({}, payloads).Receive();
+                return size;
+            }));
+        }
+        if (wanted("post_multipart_file")) {
+            // A 32 MiB file streamed from disk, and read into a stringstream and sent from memory the
+            // way the body used to be built. The peak RSS is of one upload in a child of its own.
+            constexpr std::size_t fileSize = 32 * 1024 * 1024;
+            auto path = make_upload(fileSize);
+            auto upload = [&](WinHTTP::Client& client, std::uint16_t port, bool buffered) {
+                auto post = client.Connect(L"127.0.0.1", port).PostRequest().Target(L"/upload");
+                if (buffered) {
+                    std::stringstream file;
+                    file << std::ifstream(path, std::ios::binary).rdbuf();
+                    post.AddFormData("file", {file.str(), WinHTTP::FormContentType::AttachedFile, "application/octet-stream|" + path.filename().string()});
+                } else {
+                    post.AddFormData("file", {path.string(), WinHTTP::FormContentType::File, "application/octet-stream"});
+                }
+                post.Send().Receive();
+            };
+            for (bool buffered : {false, true}) {
+                LoopbackServer server({.responseSize = 64});
+                WinHTTP::Client client(L"bench");
+                auto result = measure(buffered ? "post_multipart_file_buffered" : "post_multipart_file", scaled(settings, 50), [&] {
+                    upload(client, server.Port(), buffered);
+                    return fileSize;
+                });
+                result.peakRssKiB = peak_rss_of([&] {
+                    LoopbackServer server({.responseSize = 64});
+                    WinHTTP::Client client(L"bench");
+                    upload(client, server.Port(), buffered);
+                });
+                std::cerr << result.name << ": " << result.peakRssKiB / 1024 << " MiB peak RSS" << std::endl;
+                report(std::move(result));
+            }
+            std::filesystem::remove(path);
+        }
+        for (bool chunked : {false, true}) {
+            std::string name = chunked ? "download_large_chunked" : "download_large";
+            if (not wanted(name))
+                continue;
+            LoopbackServer server({.responseSize = 64 * 1024 * 1024, .chunked = chunked});
+            WinHTTP::Client client(L"bench");
+            report(measure(name, scaled(settings, 30), [&] {
+                std::uint64_t size = 0;
+                client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/").Send().Receive([&](std::string_view chunk) {
+                    size += chunk.size();
+                    return true;
+                });
+                return size;
+            }));
+            report(measure(name + "_string", scaled(settings, 30), [&] {
+                return client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/").Send().Receive().size();
+            }));
+        }
+        if (wanted("download_json")) {
+            // The same 16 MiB of JSON as it is and gzip compressed, bytes/s counts the decoded body.
+            auto json = make_json(16 * 1024 * 1024);
+            {
+                LoopbackServer server({.body = json});
+                WinHTTP::Client client(L"bench");
+                report(measure("download_json", scaled(settings, 30), [&] {
+                    return client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/").Send().Receive().size();
+                }));
+            }
+#ifdef WINHTTP_ZLIB_SUPPORT
+            LoopbackServer server({.body = gzip(json), .contentEncoding = "gzip"});
+            WinHTTP::Client client(L"bench");
+            report(measure("download_json_gzip", scaled(settings, 30), [&] {
+                return client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/").Decompress().Send().Receive().size();
+            }));
+#endif
+        }
+        if (wanted("download_segmented")) {
+            // 32 MiB to a file, the server sends 64 MiB/s per connection like a remote host would.
+            // Throughput as the download is split over more ranges.
+            LoopbackServer server({.responseSize = 32 * 1024 * 1024, .ranges = true, .bandwidth = 64 * 1024 * 1024});
+            WinHTTP::Client client(L"bench", {.maxPerHost = 8});
+            auto path = std::filesystem::temp_directory_path() / "winhttp-bench-download.bin";
+            for (std::size_t segments : {1, 2, 4, 8}) {
+                auto result = measure("download_segmented", scaled(settings, 20), [&] {
+                    return client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/")
+                        .DownloadToFile(path, {.segments = segments}).size;
+                });
+                result.threads = segments;
+                report(std::move(result));
+            }
+            std::filesystem::remove(path);
+        }
+        for (auto latency : {std::chrono::microseconds(0), std::chrono::microseconds(1000)}) {
+            std::string name = latency.count() ? "async_get_1ms" : "async_get";
+            if (not wanted(name))
+                continue;
+            LoopbackServer server({.responseSize = 128, .latency = latency});
+            WinHTTP::Client client(L"bench");
+            report(measure_async(name, client, server.Port(), 64, scaled(settings, latency.count() ? 50 : 300)));
+        }
+        if (wanted("async_upload_errors")) {
+            // Uploads that can't be sent fail instead of taking the process down: a missing file throws
+            // from Send, one removed while its request waits for the connection fails the future.
+            LoopbackServer server({.responseSize = 64, .latency = std::chrono::milliseconds(100)});
+            WinHTTP::Client client(L"bench");
+            WinHTTP::Async::Engine engine(L"bench", {.maxPerHost = 1});
+            auto path = make_upload(64 * 1024);
+            auto upload = [&](const std::filesystem::path& file) {
+                return client.Connect(L"127.0.0.1", server.Port()).PostRequest().Target(L"/upload")
+                    .AddFormData("file", {file.string(), WinHTTP::FormContentType::File, "application/octet-stream"})
+                    .Describe();
+            };
+            auto fails = [](auto&& f) {
+                try {
+                    f();
+                    return false;
+                } catch (const std::exception&) {
+                    return true;
+                }
+            };
+            auto missing = upload(path.parent_path() / "winhttp_bench_missing.bin");
+            check(fails([&] { engine.Send(missing.endpoint, missing.spec); }), "async upload of a missing file didn't throw");
+            auto get = client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/").Describe();
+            auto ahead = engine.Send(get.endpoint, get.spec);
+            auto removed = upload(path);
+            auto future = engine.Send(removed.endpoint, removed.spec);
+            std::filesystem::remove(path);
+            check(fails([&] { future.Get(); }), "async upload of a removed file didn't fail");
+            check(not fails([&] { ahead.Get(); }), "async GET ahead of a failed upload failed");
+        }
+        if (wanted("inflight")) {
+            // 4096 GETs in flight at once on a server that holds each for a second, sent as coroutines on
+            // one async engine and from a thread each with the blocking API. Memory per request is
+            // measured from before sending until the server holds all of them. The RSS also has the
+            // server's thread per connection in it, the same in both runs.
+            auto count = scaled(settings, 4096);
+            for (std::string name : {"inflight_async", "inflight_blocking"}) {
+                LoopbackServer server({.responseSize = 128, .latency = std::chrono::seconds(1)});
+                WinHTTP::Client client(L"bench", {.maxPerHost = count});
+                WinHTTP::Async::Engine engine(L"bench", {.maxPerHost = count});
+                auto request = client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/").Describe();
+                std::latch done(static_cast<std::ptrdiff_t>(count));
+                std::atomic<std::uint64_t> bytes{0};
+                auto worker = [&]() -> Task {
+                    auto body = co_await engine.Send(request.endpoint, request.spec);
+                    bytes += body.size();
+                    done.count_down();
+                };
+                std::vector<std::jthread> callers;
+                callers.reserve(count);
+
+                Result result;
+                result.name = name;
+                result.threads = count;
+                result.requests = count;
+                auto rss = current_rss_kib();
+                auto allocated = allocations.load();
+                auto allocatedSize = allocatedBytes.load();
+                auto start = Clock::now();
+                for (std::size_t i = 0; i < count; ++i) {
+                    if (name == "inflight_async") {
+                        worker();
+                    } else {
+                        callers.emplace_back([&] {
+                            char buffer[256];
+                            bytes += client.Send(request.endpoint, request.spec).Receive(std::span<char>(buffer));
+                            done.count_down();
+                        });
+                    }
+                }
+                while (server.Served() < count && Clock::now() - start < std::chrono::seconds(10))
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                result.inflightBytes = static_cast<double>(allocatedBytes.load() - allocatedSize) / static_cast<double>(count);
+                result.inflightRssKiB = static_cast<double>(current_rss_kib() - rss) / static_cast<double>(count);
+                check(server.Served() == count, name + " didn't get every request in flight at once");
+                done.wait();
+                result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+                result.allocationsPerRequest = static_cast<double>(allocations.load() - allocated) / static_cast<double>(count);
+                result.bytes = bytes;
+                callers.clear();
+                std::cerr << name << ": " << result.inflightBytes << " bytes allocated, " << result.inflightRssKiB << " KiB RSS per request in flight" << std::endl;
+                report(std::move(result));
+            }
+        }
+        if (wanted("get_coalesced")) {
+            // The same slow GET from 8 threads at once, each sent upstream against coalesced into one.
+            for (bool coalesce : {false, true}) {
+                LoopbackServer server({.responseSize = 64 * 1024, .latency = std::chrono::milliseconds(5)});
+                WinHTTP::Client client(L"bench", {.maxPerHost = 8});
+                if (coalesce)
+                    client.Coalesce();
+                std::vector<WinHTTP::BatchRequest> requests;
+                for (std::size_t i = 0; i < scaled(settings, 2000); ++i)
+                    requests.push_back(client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/popular").Describe());
+                auto result = measure_batch(coalesce ? "get_coalesced" : "get_uncoalesced", client, requests, 8);
+                std::cerr << result.name << ": " << server.Served() << " upstream requests" << std::endl;
+                report(std::move(result));
+            }
+            // 8 threads released together on a server slow enough for all of them to join the first GET,
+            // which must be the only one it sees.
+            LoopbackServer server({.responseSize = 1024, .latency = std::chrono::milliseconds(200)});
+            WinHTTP::Client client(L"bench", {.maxPerHost = 8});
+            client.Coalesce();
+            std::latch ready(8);
+            std::atomic<std::size_t> received{0};
+            {
+                std::vector<std::jthread> callers;
+                for (int i = 0; i < 8; ++i) {
+                    callers.emplace_back([&] {
+                        ready.arrive_and_wait();
+                        received += client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/popular").Send().Receive().size() == 1024;
+                    });
+                }
+            }
+            check(server.Served() == 1 && received == 8, "get_coalesced sent a GET upstream more than once");
+        }
+        if (wanted("limited")) {
+            // 64 callers against a backend that takes 8 requests at 2 ms and slows down with the square
+            // of the overload, sending 503 past 32. Goodput and latency of the good responses, without
+            // a limit and with the adaptive one.
+            for (bool limit : {false, true}) {
+                LoopbackServer server({.responseSize = 1024, .latency = std::chrono::milliseconds(2), .capacity = 8});
+                WinHTTP::Client client(L"bench", {.maxPerHost = 64});
+                if (limit)
+                    client.LimitConcurrency({.wait = std::chrono::seconds(5)});
+                char buffer[2048];
+                report(measure_threads(limit ? "limited_adaptive" : "limited_unlimited", 64, scaled(settings, 100), [&]() -> std::optional<std::size_t> {
+                    try {
+                        auto response = client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/").Send();
+                        auto size = response.Receive(std::span<char>(buffer));
+                        if (response.Status() != 200)
+                            return {};
+                        return size;
+                    } catch (const std::exception&) {
+                        return {};
+                    }
+                }));
+                if (limit)
+                    std::cerr << "limited_adaptive: settled at " << client.GetLimiter()->For({L"127.0.0.1", server.Port()}).Current() << std::endl;
+            }
+        }
+        if (wanted("tail")) {
+            // One request in 50 takes 100 ms instead of 1 ms. As is, cut off by a 20 ms deadline, and
+            // hedged past the 95th percentile. Hedges need the percentile, so every client warms up first.
+            for (std::string name : {"tail_plain", "tail_deadline", "tail_hedged"}) {
+                LoopbackServer server({.responseSize = 1024, .latency = std::chrono::milliseconds(1), .outlierEvery = 50, .outlierLatency = std::chrono::milliseconds(100)});
+                WinHTTP::Client client(L"bench", {.maxPerHost = 16});
+                if (name == "tail_hedged")
+                    client.EnableRetries({.hedgePercentile = 0.95});
+                char buffer[2048];
+                auto request = [&]() -> std::optional<std::size_t> {
+                    try {
+                        auto get = client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/");
+                        if (name == "tail_deadline")
+                            get.Timeout(std::chrono::milliseconds(20));
+                        auto response = get.Send();
+                        auto size = response.Receive(std::span<char>(buffer));
+                        if (response.Status() != 200)
+                            return {};
+                        return size;
+                    } catch (const std::exception&) {
+                        return {};
+                    }
+                };
+                for (std::size_t i = 0; i < 200; ++i)
+                    request();
+                report(measure_threads(name, 4, scaled(settings, 500), request));
+                if (auto* policy = client.GetRetryPolicy())
+                    std::cerr << name << ": " << policy->Hedges() << " hedges, " << policy->HedgesWon() << " won" << std::endl;
+            }
+        }
+        if (wanted("concurrent")) {
+            // 64 callers sending small GETs to a backend that takes 1 ms each, over a connection per
+            // caller with HTTP/1.1 and as streams of one h2c connection with HTTP/2.
+            for (auto protocol : {WinHTTP::Protocol::Http1, WinHTTP::Protocol::Http2}) {
+                std::string name = protocol == WinHTTP::Protocol::Http2 ? "concurrent_http2" : "concurrent_http1";
+                LoopbackServer server({.responseSize = 128, .latency = std::chrono::milliseconds(1), .http2 = protocol == WinHTTP::Protocol::Http2});
+                WinHTTP::Client client(std::make_unique<WinHTTP::Transport::PosixBackend>(L"bench", protocol), {.maxPerHost = 64});
+                char buffer[256];
+                report(measure_threads(name, 64, scaled(settings, 200), [&]() -> std::optional<std::size_t> {
+                    auto response = client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/").Send();
+                    auto size = response.Receive(std::span<char>(buffer));
+                    if (response.Status() != 200 || response.Negotiated() != protocol)
+                        return {};
+                    return size;
+                }));
+                std::cerr << name << ": " << server.Accepted() << " connections" << std::endl;
+            }
+        }
+        if (wanted("startup")) {
+            // The first 400 requests of a fresh client from 8 threads, to a server whose connections
+            // take a 5 ms handshake behind a resolver that takes 10 ms. Looking the name up for every
+            // connection, with the DNS cache, and with 8 connections prewarmed during startup.
+            for (std::string name : {"startup_cold", "startup_dns_cached", "startup_prewarmed"}) {
+                LoopbackServer server({.responseSize = 128, .handshakeLatency = std::chrono::milliseconds(5)});
+                WinHTTP::Dns::Options dns{.lookup = [](const std::string& host, std::uint16_t port) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    return WinHTTP::Dns::System(host, port);
+                }};
+                if (name == "startup_cold")
+                    dns.ttl = {};
+                WinHTTP::Client client(std::make_unique<WinHTTP::Transport::PosixBackend>(L"bench", WinHTTP::Protocol::Http1, dns), {.maxPerHost = 8});
+                if (name == "startup_prewarmed") {
+                    auto start = Clock::now();
+                    auto opened = client.Prewarm(L"127.0.0.1", server.Port(), 8).Get();
+                    std::cerr << name << ": " << opened << " connections in " << std::chrono::duration<double, std::milli>(Clock::now() - start).count() << " ms" << std::endl;
+                    // The rest of the startup, the server's side of the handshakes finishes meanwhile.
+                    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                }
+                char buffer[256];
+                report(measure_threads(name, 8, 50, [&]() -> std::optional<std::size_t> {
+                    auto response = client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/").Send();
+                    auto size = response.Receive(std::span<char>(buffer));
+                    if (response.Status() != 200)
+                        return {};
+                    return size;
+                }));
+            }
+        }
+        if (wanted("stream")) {
+            // One long response of 10000 records, one every 100 us. Latency is from the server sending a
+            // record to the callback getting it. Streamed as Server-Sent Events and as NDJSON lines, and
+            // as NDJSON received whole and split afterwards.
+            for (std::string name : {"stream_events", "stream_ndjson", "stream_whole_body"}) {
+                auto count = scaled(settings, 10000);
+                LoopbackServer server({.responseSize = 256, .eventCount = count, .eventInterval = std::chrono::microseconds(100), .ndjson = name != "stream_events"});
+                WinHTTP::Client client(L"bench");
+                Result result;
+                result.name = name;
+                result.requests = count;
+                result.latencies.reserve(count);
+                auto record = [&](std::string_view sent) {
+                    long long at = 0;
+                    std::from_chars(sent.data(), sent.data() + sent.size(), at);
+                    auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+                    result.latencies.push_back(static_cast<double>(now - at) / 1000);
+                };
+                // The time stamp follows "sent": in a line, the data starts with it in an event.
+                auto line = [&](std::string_view line) {
+                    record(line.substr(line.find("\"sent\":") + 7));
+                    result.bytes += line.size();
+                    return true;
+                };
+                auto allocated = allocations.load();
+                auto bytes = allocatedBytes.load();
+                auto start = Clock::now();
+                auto response = client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/").Send();
+                if (name == "stream_events") {
+                    response.ReceiveEvents([&](const WinHTTP::Streaming::Event& event) {
+                        record(event.data);
+                        result.bytes += event.data.size();
+                        return true;
+                    });
+                } else if (name == "stream_ndjson") {
+                    response.ReceiveLines(line);
+                } else {
+                    auto body = response.Receive();
+                    for (std::string_view rest = body; not rest.empty();) {
+                        auto end = rest.find('\n');
+                        line(rest.substr(0, end));
+                        rest.remove_prefix(end == std::string_view::npos ? rest.size() : end + 1);
+                    }
+                }
+                result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+                result.allocationsPerRequest = static_cast<double>(allocations.load() - allocated) / static_cast<double>(count);
+                std::cerr << name << ": " << (allocatedBytes.load() - bytes) / 1024 << " KiB allocated" << std::endl;
+                report(std::move(result));
+            }
+        }
+        if (wanted("batch_get")) {
+            // Throughput as the executor gets more worker threads, up to the core count.
+            LoopbackServer server({.responseSize = 128});
+            WinHTTP::Client client(L"bench", {.maxPerHost = 8});
+            std::vector<WinHTTP::BatchRequest> requests;
+            for (std::size_t i = 0; i < scaled(settings, 20000); ++i)
+                requests.push_back(client.Connect(L"127.0.0.1", server.Port()).GetRequest().Target(L"/").Describe());
+            auto cores = std::max(1u, std::thread::hardware_concurrency());
+            for (std::size_t threads = 1;; threads = std::min<std::size_t>(threads * 2, cores)) {
+                report(measure_batch("batch_get", client, requests, threads));
+                if (threads == cores)
+                    break;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "bench failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    auto json = to_json(results, settings);
+    if (settings.out.empty()) {
+        std::cout << json;
+    } else {
+        std::ofstream(settings.out) << json;
+    }
+    return failed ? 1 : 0;
+}